@@ -45,6 +45,7 @@ typedef vlen_t R_len_t;
 API_CALL SEXP allocVector(int type, vlen_t n) {
     switch (type) {
 	    case VECSXP:
+	    case EXPRSXP: /* (expressions are plain lists) */
 		return allocObjectVector(listClass, n);
 	    case STRSXP:
 		return allocObjectVector(stringClass, n);
@@ -113,7 +114,7 @@ API_CALL SEXP getAttrib(SEXP vec, SEXP name) {
     return getAttr(vec, ASymbol2sym_t(name));
 }
 
-static vlen_t length(SEXP x) { return LENGTH(x); }
+static inline vlen_t length(SEXP x) { return LENGTH(x); }
 
 /* more internal stuff (used by the parser) */
 #define R_EOF -1
@@ -196,7 +197,7 @@ API_CALL int R_isnancpp(double); /* in arithmetic.c */
 
 #include <math.h>
 
-#define LibExtern static
+#define LibExtern static __attribute__((unused)) /* (only set by init_Rcompat, so other files would warn about unused copies) */
 
 /* implementation of these : ../../main/arithmetic.c */
 LibExtern double R_NaN;         /* IEEE NaN */
@@ -220,7 +221,7 @@ typedef union {
 #define lw__ 0
 #endif
 
-static double R_ValueOfNA(void)
+static inline double R_ValueOfNA(void)
 {
     /* The gcc shipping with RedHat 9 gets this wrong without
      * the volatile declaration. Thanks to Marc Schwartz. */
@@ -261,10 +262,10 @@ RAPI_CALL int R_finite(double x)
 
 #ifdef MAIN__
 static void init_Rcompat() {
-    R_ClassSymbol = install("class");
-    R_SrcfileSymbol = install("srcfile");
-    R_SrcrefSymbol = install("srcref");
-    R_MissingArg = allocObject(nullClass); /* it is a NULL object but not the same as nullObject */
+    R_ClassSymbol = installed(AS_class);
+    R_SrcfileSymbol = installed(AS_srcfile);
+    R_SrcrefSymbol = installed(AS_srcref);
+    R_MissingArg = preserveObject(allocObject(nullClass)); /* it is a NULL object but not the same as nullObject. Preserved since it is shared by all formals (and frames) that refer to it */
     R_NaString = mkChar("NA");
 
     R_NaInt = INT_MIN;
@@ -7,23 +7,30 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <setjmp.h>
+#include <pthread.h>
 
 #define ALEPH 1
 
 /* experimental features (0 = off, 1 = on) */
-#define POOL_WATERMARKS      1
 #define CLASS_WRITE_BARRIER  0
+#ifndef NURSERY
+#define NURSERY              1 /* allocate small objects from per-thread nursery chunks (can be overridden with -DNURSERY=0) */
+#endif
+#ifndef SLAB
+#define SLAB                 1 /* use the size-class slab allocator (slab.c) instead of malloc for small objects (-DSLAB=0 to disable) */
+#endif
 
 /*=========================================================================================================*/
 
 #define API_VAR extern
+/* HIDDEN_CALL functions are internals that are not meant to be called by outside code. They are used by the API_CALL functions, and an inline function with external linkage may not refer to static ones, so they are linked the same way */
 #if (__STDC_VERSION__ >= 199901L)
 #ifdef MAIN__
 #define API_CALL extern inline
-#define HIDDEN_CALL static inline
+#define HIDDEN_CALL extern inline
 #else
 #define API_CALL inline
-#define HIDDEN_CALL static inline
+#define HIDDEN_CALL inline
 #endif
 #else
 #define API_CALL static
@@ -43,11 +50,74 @@
 API_VAR AClass classClass[1], objectClass[1];
 API_VAR AClass nullClass[1], symbolClass[1];
 
-/* cached symbols */
-API_VAR symbol_t AS_next, AS_head, AS_names, AS_class, AS_tag;
+/* well-known symbols: AS_* constants (generated from symbols.def) */
+#include "symtab.h"
+
+/** ------ thread context ------- */
+
+#define NURSERY_CHUNK_SIZE (64 * 1024) /* chunks are aligned to their size so we can find the chunk from an object pointer */
+#define NURSERY_MAX_OBJECT 512         /* larger objects come from the slab allocator or malloc (see allocLongObjectMemory) */
+#define NURSERY_SPARE_CHUNKS 4         /* number of empty chunks kept for re-use */
+
+typedef struct ANurseryChunk_s {
+    struct ANursery_s *nursery; /* the nursery this chunk belongs to */
+    struct ANurseryChunk_s *next; /* next spare chunk */
+    char *ptr, *end;
+    vlen_t live;                /* number of live objects in the chunk */
+} ANurseryChunk;
+
+typedef struct ANursery_s {
+    ANurseryChunk *current, *spare;
+    vlen_t spares;
+    unsigned long objects, chunks, recycled; /* statistics: objects allocated, chunks allocated, chunks emptied */
+} ANursery;
+
+#define NURSERY_CHUNK(O) ((ANurseryChunk*) (((unsigned long) (O)) & ~((unsigned long) NURSERY_CHUNK_SIZE - 1)))
+#define NURSERY_START(C) (((char*) (C)) + ((sizeof(ANurseryChunk) + 15) & ~15))
+#define NURSERY_CLAIMED ((vlen_t) -1) /* live count of an empty chunk that is being released (see threads.c) */
+
+/* everything that belongs to one thread of execution (see threads.c) */
+typedef struct ThreadContext_s {
+    AllocationPool *pool;
+    AllocationPool *spare_pool; /* released pools kept for re-use (see newPool) */
+    vlen_t spare_pools;
+    ANursery nursery;
+    vsize_t allocated; /* bytes allocated in objects since the last garbage collection (see GC_CHECK) */
+    jmp_buf error_jmpbuf; /* where A_error() goes */
+    int control; /* pending break or next (see control.c) */
+    struct ThreadContext_s *next; /* spare contexts (see threads.c) */
+} ThreadContext;
+
+GHVAR ThreadContext mainThreadContext;
+GHVAR __thread ThreadContext *thread_context; /* the context of the running thread (&mainThreadContext in the main thread) */
+
+#define currentThreadContext() (thread_context)
+#define currentPool() (currentThreadContext()->pool)
+
+/* Shared state (the gc pool, the symbol table, the slab allocator) is only locked while other threads are running. aleph_threads is only changed by the main thread when it doesn't hold any locks (see startThread/joinThread), so the locking calls always match */
+GHVAR int aleph_threads; /* number of running threads (other than the main thread) */
+GHVAR pthread_mutex_t gc_lock, symbol_lock, alloc_lock;
+
+#define A_LOCK(L)   { if (aleph_threads) pthread_mutex_lock(&(L)); }
+#define A_UNLOCK(L) { if (aleph_threads) pthread_mutex_unlock(&(L)); }
+
+typedef struct AThread_s AThread;
+
+extern AThread *startThread(AObject *(*fn)(AObject *), AObject *arg); /* from threads.c */
+extern AObject *joinThread(AThread *thread); /* from threads.c */
+extern int nurseryRetire(ANursery *n, ANurseryChunk *c); /* from threads.c */
+extern void nurseryFreeShared(ANurseryChunk *c); /* from threads.c */
 
-/* very crude error handling for now */
-GHVAR jmp_buf error_jmpbuf;
+/* parallel loops over long vectors (see threads.c) */
+typedef void (*parallel_fn_t)(void *data, vlen_t from, vlen_t to, int worker);
+
+extern int parallel_workers; /* from threads.c */
+extern vlen_t parallel_min_length; /* from threads.c */
+extern int parallelWorkers(vlen_t n); /* from threads.c */
+extern void parallelFor(vlen_t n, vlen_t chunk, parallel_fn_t fn, void *data); /* from threads.c */
+
+/* very crude error handling for now. Each thread has its own error handler */
+#define error_jmpbuf (currentThreadContext()->error_jmpbuf)
 
 API_CALL AObject *A_error(const char *fmt, ...) {
     va_list (ap);
@@ -56,6 +126,7 @@ API_CALL AObject *A_error(const char *fmt, ...) {
     vfprintf(stderr, fmt, ap);
     va_end(ap);
     fprintf(stderr, "\n");
+    currentThreadContext()->control = 0;
     longjmp(error_jmpbuf, 1);
     return NULL;
 }
@@ -108,6 +179,37 @@ API_CALL AObject *A_debug(int level, const char *fmt, ...) {
 /* ------- low-level memory management ------- */
 
 extern void gc_run(size_t); /* from gc.c */
+extern void freeOwned(AObject *); /* from gc.c */
+extern void gc_print_stats(); /* from gc.c */
+extern void gc_thread_exit(); /* from gc.c */
+extern AObject *preserveObject(AObject *); /* from gc.c */
+extern void releaseObject(AObject *); /* from gc.c */
+extern void *slabAlloc(size_t); /* from slab.c */
+extern void slabFree(void *); /* from slab.c */
+extern void slab_print_stats(); /* from slab.c */
+
+/* slab size classes are multiples of SLAB_GRANULE up to SLAB_MAX_SIZE. The limit is above NURSERY_MAX_OBJECT so the sizes the nursery rejects don't all end up in malloc */
+#define SLAB_GRANULE  16
+#define SLAB_MAX_SIZE 4096
+#define SLAB_CLASSES  (SLAB_MAX_SIZE / SLAB_GRANULE)
+#if NURSERY && SLAB && SLAB_MAX_SIZE <= NURSERY_MAX_OBJECT
+#error "SLAB_MAX_SIZE has to be larger than NURSERY_MAX_OBJECT, otherwise the slab allocator only sees copies"
+#endif
+
+/* object flags */
+#define AOF_COLOR   0x0001 /* garbage collector mark (see gc.c) */
+#define AOF_NURSERY 0x0002 /* object memory belongs to a nursery chunk, not malloc */
+#define AOF_SLAB    0x0004 /* object memory was allocated by slabAlloc */
+#define AOF_NOSCOPE 0x0008 /* native function: do not wrap calls in an allocation scope (see enterScope) */
+#define AOF_DEFERRED 0x0010 /* vector: the data is a deferred expression, not the elements (see ADeferred) */
+#define AOF_COMPACT  0x0020 /* integer vector: the data is a compact sequence, not the elements (see ACompactSeq) */
+#define AOF_MAPPED   0x0040 /* numeric vector: the elements are in a memory-mapped file (see AMapping) */
+
+/* bytes allocated in objects since the last garbage collection (counted per thread, see ThreadContext) that trigger the next one */
+GHVAR vsize_t gc_threshold;
+GHVAR unsigned short gc_color; /* color of all live objects after the last collection - new objects get it as well */
+
+#define objectSize(O) (sizeof(AObject) + sizeof(AObject*) * (O)->attrs + (O)->size)
 
 API_CALL void *Amalloc(size_t size) {
     void *v = malloc(size);
@@ -162,24 +264,126 @@ API_CALL AClass *getClass(AObject *o) {
     return CLASS(o);
 }
 
-/** ------ thread context ------- */
+/* Most objects die young - they are temporaries that never leave the local pool they were created in. Small objects are therefore not malloc'ed individually but carved out of a per-thread nursery chunk by bumping a pointer. Objects cannot move (C code holds direct pointers to them), so an object that survives (i.e. is assigned somewhere) simply stays in its chunk - once the chunk is full it is retired and a fresh one is used. Each chunk counts its live objects; when the count drops to zero the chunk is rewound (if it is the current one) or recycled, so a loop creating temporaries keeps re-using the same memory. */
+/* allocate zeroed memory for an object in the current nursery. Returns NULL if the object should be allocated by other means */
+HIDDEN_CALL void *nurseryAlloc(size_t size) {
+    ANursery *n = &currentThreadContext()->nursery;
+    ANurseryChunk *c = n->current;
+    void *v;
+    size = (size + 15) & ~15;
+    if (size > NURSERY_MAX_OBJECT) return 0;
+    if (!c || c->ptr + size > c->end) { /* retire the current chunk - it will be recycled by nurseryFree once its objects are gone */
+	if (!(c && aleph_threads && nurseryRetire(n, c))) { /* (unless other threads have emptied it while it was current - then we just start over) */
+	    if (n->spare) {
+		c = n->spare;
+		n->spare = c->next;
+		n->spares--;
+	    } else {
+		if (posix_memalign(&v, NURSERY_CHUNK_SIZE, NURSERY_CHUNK_SIZE)) {
+		    gc_run(NURSERY_CHUNK_SIZE);
+		    if (posix_memalign(&v, NURSERY_CHUNK_SIZE, NURSERY_CHUNK_SIZE))
+			return 0;
+		}
+		c = (ANurseryChunk*) v;
+		c->nursery = n;
+		c->end = ((char*) c) + NURSERY_CHUNK_SIZE;
+		n->chunks++;
+		A_debug(ADL_alloc, " + nursery chunk <%p>", c);
+	    }
+	}
+	c->next = 0;
+	c->ptr = NURSERY_START(c);
+	c->live = 0;
+	n->current = c;
+    }
+    v = c->ptr;
+    c->ptr += size;
+    if (aleph_threads)
+	__atomic_add_fetch(&c->live, 1, __ATOMIC_SEQ_CST);
+    else
+	c->live++;
+    n->objects++;
+    memset(v, 0, size);
+    return v;
+}
 
-typedef struct ThreadContext_s {
-    AllocationPool *pool;
-} ThreadContext;
+/* release memory of an object allocated by nurseryAlloc */
+HIDDEN_CALL void nurseryFree(AObject *o) {
+    ANurseryChunk *c = NURSERY_CHUNK(o);
+    if (aleph_threads) { /* the chunk may belong to another thread */
+	nurseryFreeShared(c);
+	return;
+    }
+    if (--c->live == 0) {
+	ANursery *n = c->nursery;
+	n->recycled++;
+	c->ptr = NURSERY_START(c);
+	if (c != n->current) {
+	    if (n->spares < NURSERY_SPARE_CHUNKS) {
+		c->next = n->spare;
+		n->spare = c;
+		n->spares++;
+	    } else
+		free(c);
+	}
+    }
+}
 
-GHVAR ThreadContext mainThreadContext;
+/* allocate zeroed memory for an object that is not expected to be short-lived or is too large for the nursery: small objects come from the slab allocator, others from malloc */
+HIDDEN_CALL AObject *allocLongObjectMemory(size_t size) {
+#if SLAB
+    if (size <= SLAB_MAX_SIZE) {
+	AObject *o = (AObject*) slabAlloc(size);
+	if (o) {
+	    o->flags = AOF_SLAB;
+	    return o;
+	}
+    }
+#endif
+    return (AObject*) Acalloc(1, size);
+}
 
-#define currentThreadContext() (&mainThreadContext)
-#define currentPool() (currentThreadContext()->pool)
+/* allocate zeroed memory for a new object */
+HIDDEN_CALL AObject *allocObjectMemory(size_t size) {
+#if NURSERY
+    AObject *o = (AObject*) nurseryAlloc(size);
+    if (o) {
+	o->flags = AOF_NURSERY;
+	return o;
+    }
+#endif
+    return allocLongObjectMemory(size);
+}
+
+extern void mapped_release(AObject *); /* from mapped.c */
+
+/* release memory of an object - the counterpart of allocObjectMemory */
+HIDDEN_CALL void freeObjectMemory(AObject *o) {
+    if (o->flags & AOF_MAPPED)
+	mapped_release(o);
+#if NURSERY
+    if (o->flags & AOF_NURSERY) {
+	nurseryFree(o);
+	return;
+    }
+#endif
+#if SLAB
+    if (o->flags & AOF_SLAB) {
+	slabFree(o);
+	return;
+    }
+#endif
+    free(o);
+}
 
 /** ------ memory management ------- */
 
-/** this is the internal, low-level free call - it should never be made available to the outside code. This call is used to free an object that is already devoid of any references. */
+/** this is the internal, low-level free call - it should never be made available to the outside code. This call is used to free an object that is already devoid of any references. Objects owned exclusively by it (i.e. with no pool) are freed as well. */
 HIDDEN_CALL void _freeObject(AObject *o) {
-    /* FIXME: recursively delete ... destructor? */
+    /* FIXME: destructor? */
     A_debug(ADL_alloc, " - freeing object <%p>", o);
-    free(o);
+    freeOwned(o);
+    freeObjectMemory(o);
 }
 
 /* Idea for implementation: use (stacked?) local allocation pools. Each object is owned by the pool. On assignment the object is moved from the pool (if it's the first assignment), otherwise nothing to do. Objects left in the pool are orphans and can be deleted. This means that we don't need explicit PROTECT/UNPROTECT as all objects are owned until the end of the call (if we wrap calls in pools). We could allow for an explicit release (another perk: in a debug version we could warn if the released object still has a parent but an optimized build could simply skip such checks). For this we may need something in the objects -- a flag that an object has not yet been assigned or alternatively a pointer to the primary owner (once it has multiple owners it can point to a special value or something... - in fact if everything is an obejct is should be the parent and we can check by class whether it's a pool...). The nice part of the latter would be that single-parent objects could be removed immediately (really we just want to know the local pool). [Mabe: a "movable" bit meaning that the object has only one owner] */
@@ -193,22 +397,31 @@ HIDDEN_CALL void _freeObject(AObject *o) {
 /** Classes are currenty outside of the GC scope and treated as constants. If we want to change that, CLASS_WRITE_BARRIER #ifs are in place so we can do it ... (Constants have the gc_pool flag but are not actually in the pool so they don't bother anyone...) */
 
 /** autorelease pools are currently outside of the object structure simply to allow linear dependency. If it was an object it would first need lists etc. defined before it could work, so we'd rather not go there ... */
+/** Each object in a pool knows its slot (obj->slot), so it can be removed without a search. Slots below the watermark that have been vacated are kept on the hole stack and are re-used first, new slots are taken at the watermark and the item array is doubled when it is full. Hence both adding and removing objects is O(1) regardless of the size and fragmentation of the pool. Invariant: all holes are below the watermark, all slots above it are empty. */
 struct AllocationPool_s {
-    struct AllocationPool_s *prev, *next;
-    vlen_t count, ptr, length;
-#if POOL_WATERMARKS
-    vlen_t watermark;
-#endif
-    AObject *item[1];
+    struct AllocationPool_s *prev, *next; /* stack of local pools */
+    vlen_t count, watermark, length; /* number of objects, slots in use (incl. holes), allocated slots */
+    vlen_t holes; /* number of entries on the hole stack */
+    vlen_t *hole; /* stack of empty slots below the watermark */
+    AObject **item;
 };
 
+#define POOL_INITIAL_ITEMS(P) ((AObject**) ((P) + 1))
+
+#define DEFAULT_POOL_SIZE 256
+#define MAX_SPARE_POOLS   16
+
 GHVAR AllocationPool *gc_pool; /* garbage collector pool -- all garbage-collected objects live there */
 GHVAR AllocationPool *root_pool; /* root pool -- all "live" objects start here */
 
 /* Allocate a new autorelease pool with the given parent. This function does not affect the current pool. */
 API_CALL AllocationPool *newCustomPool(AllocationPool *parent, vlen_t size) {
-    AllocationPool *np = (AllocationPool*) Acalloc(1, sizeof(AllocationPool) + sizeof(AObject*) * size - sizeof(AObject*));
+    /* the initial item and hole arrays are allocated along with the pool */
+    AllocationPool *np = (AllocationPool*) Amalloc(sizeof(AllocationPool) + (sizeof(AObject*) + sizeof(vlen_t)) * size);
     if (!np) return (AllocationPool*) A_error("unable to allocate new memory pool for %d objects", size);
+    memset(np, 0, sizeof(AllocationPool));
+    np->item = POOL_INITIAL_ITEMS(np);
+    np->hole = (vlen_t*) (np->item + size);
     np->length = size;
     np->prev = parent;
     if (parent) {
@@ -228,96 +441,171 @@ API_CALL void releasePool(AllocationPool *pool) {
     if (pool->next) releasePool(pool->next);
     A_debug(ADL_pools, " - releasing pool <%p> (count=%d)", pool, pool->count);
     if (pool->count) {
-	/* all objects in the pool are only owned by the pool so we can free them directly */
+	/* all objects in the pool are only owned by the pool so we can free them directly. However, objects in the gc pool can reference each other, so we first free everything the objects own exclusively and only then the objects themselves. Pinned objects (see pinObject) belong to another pool and are skipped. */
 	n = pool->watermark;
-	while (i < n) {
-	    if (pool->item[i])
-		_freeObject(pool->item[i]);
-	    i++;
-	}
+	for (i = 0; i < n; i++)
+	    if (pool->item[i] && pool->item[i]->pool == pool)
+		freeOwned(pool->item[i]);
+	for (i = 0; i < n; i++)
+	    if (pool->item[i] && pool->item[i]->pool == pool)
+		freeObjectMemory(pool->item[i]);
     }
     /* free the pool itself */
     if (pool->prev) {
 	pool->prev->next = NULL;
 	pool->prev = NULL;
     }
+    if (pool->item != POOL_INITIAL_ITEMS(pool)) {
+	free(pool->item);
+	free(pool->hole);
+    } else if (pool->length == DEFAULT_POOL_SIZE && currentThreadContext()->spare_pools < MAX_SPARE_POOLS) { /* keep it for re-use */
+	ThreadContext *ctx = currentThreadContext();
+	pool->next = ctx->spare_pool;
+	ctx->spare_pool = pool;
+	ctx->spare_pools++;
+	return;
+    }
     free(pool);
 }
 
-#define DEFAULT_POOL_SIZE 256
-
 /* create a new autorelease pool. All furhter local allocations will be placed in that pool */
 API_CALL AllocationPool *newPool() {
-    AllocationPool *cp = newCustomPool(currentPool(), DEFAULT_POOL_SIZE);
-    currentThreadContext()->pool = cp;
+    ThreadContext *ctx = currentThreadContext();
+    AllocationPool *cp = ctx->spare_pool, *parent = ctx->pool;
+    if (cp) { /* re-use a released pool - this makes scopes (see enterScope) cheap */
+	ctx->spare_pool = cp->next;
+	ctx->spare_pools--;
+	cp->count = cp->watermark = cp->holes = 0;
+	cp->next = 0;
+	cp->prev = parent;
+	if (parent) {
+	    if (parent->next) {
+		cp->next = parent->next;
+		cp->next->prev = cp;
+	    }
+	    parent->next = cp;
+	}
+    } else
+	cp = newCustomPool(parent, DEFAULT_POOL_SIZE);
+    ctx->pool = cp;
     return cp;
 }
 
 API_CALL AObject *addObjectToPool(AObject *obj, AllocationPool *pool) {
-    int is_gc = (pool == gc_pool);
-    A_debug(ADL_pools, " - move <%p> to pool <%p>(%d/%d,%d)%s", obj, pool, pool->count, pool->length, pool->ptr, is_gc ? " (gc_pool)" : "");
-    while (pool->next && pool->count == pool->length) pool = pool->next; /* find some available pool ...*/
-    if (pool->count == pool->length) /* or .. if there is none, create another pool (take the size from the parent) */
-	pool = newCustomPool(pool, pool->length);
-    pool->item[pool->ptr] = obj;
+    vlen_t i;
+    A_debug(ADL_pools, " - move <%p> to pool <%p>(%d/%d,%d)%s", obj, pool, pool->count, pool->length, pool->watermark, (pool == gc_pool) ? " (gc_pool)" : "");
+    if (pool->holes)
+	i = pool->hole[--pool->holes];
+    else {
+	if (pool->watermark == pool->length) { /* full - double the size */
+	    vlen_t len = pool->length * 2;
+	    if (pool->item == POOL_INITIAL_ITEMS(pool)) { /* the initial arrays are part of the pool - move them out */
+		AObject **ni = (AObject**) Amalloc(sizeof(AObject*) * len);
+		memcpy(ni, pool->item, sizeof(AObject*) * pool->length);
+		pool->item = ni;
+		pool->hole = (vlen_t*) Amalloc(sizeof(vlen_t) * len); /* the hole stack is empty */
+	    } else {
+		pool->item = (AObject**) Arealloc(pool->item, sizeof(AObject*) * len);
+		pool->hole = (vlen_t*) Arealloc(pool->hole, sizeof(vlen_t) * len);
+	    }
+	    pool->length = len;
+	}
+	i = pool->watermark++;
+    }
+    pool->item[i] = obj;
     pool->count++;
-#if POOL_WATERMARKS
-    if (pool->ptr >= pool->watermark)
-	pool->watermark = pool->ptr + 1;
-#endif
-    if (pool->count != pool->length) /* update the ptr to the next empty spot in case there are any */
-	while (pool->item[++(pool->ptr)]) {};
-    obj->pool = is_gc ? gc_pool : pool;
+    obj->pool = pool;
+    obj->slot = i;
     return obj;
 }
 
 API_CALL AObject *removeObjectFromPool(AObject *obj, AllocationPool *pool) {
     if (pool) {
-	vlen_t i = pool->ptr;
-	A_debug(ADL_pools, " - remove <%p> from pool <%p>(%d/%d,%d)", obj, pool, pool->count, pool->length, pool->ptr);
-	/* fast-track heuristic -- if there were no holes we can optimize FILO by looking just before ptr */
-	if (i) i--;
-	if (pool->item[i] != obj) { /* if we didn't find it right away, start a full search */
-#if POOL_WATERMARKS
-	    vsize_t n = pool->watermark;
-#else
-	    vsize_t n = pool->length;
-#endif
-	    i = 0;
-	    while (i < n) {
-		if (pool->item[i] == obj) break;
-		i++;
-	    }
-	    if (i == n) /* not found - this is a fatal error -- we should really supply some more info */
-		return A_error("attempt to remove non-existing object from a pool");
-	}
+	vlen_t i = obj->slot;
+	A_debug(ADL_pools, " - remove <%p> from pool <%p>(%d/%d,%d)", obj, pool, pool->count, pool->length, pool->watermark);
+	if (i >= pool->watermark || pool->item[i] != obj) /* this is a fatal error -- we should really supply some more info */
+	    return A_error("attempt to remove non-existing object from a pool");
 	pool->item[i] = 0;
-	if (i < pool->ptr)
-	    pool->ptr = i;
-#if POOL_WATERMARKS
-	if (i + 1 == pool->watermark) { /* last item removed - adjust the watermark */
-	    while (pool->watermark && !pool->item[pool->watermark - 1])
-		pool->watermark--;
-	    pool->ptr = pool->watermark; /* also adjust the pointer to point just past the last item */
-	}
-#endif
-
+	if (i + 1 == pool->watermark) /* last slot - just lower the watermark */
+	    pool->watermark--;
+	else
+	    pool->hole[pool->holes++] = i;
 	obj->pool = 0;
 	pool->count--;
     }
     return obj;
 }
 
+/* Pin an object that is owned elsewhere (in practice by the gc pool) in a local pool: it is listed in the pool so the garbage collector sees it as reachable for the pool's life time, but the object's own pool doesn't change and releasing the pool doesn't free it. */
+API_CALL AObject *pinObject(AObject *obj, AllocationPool *pool) {
+    AllocationPool *op = obj->pool;
+    vlen_t slot = obj->slot;
+    addObjectToPool(obj, pool);
+    obj->pool = op;
+    obj->slot = slot;
+    return obj;
+}
+
+/* account for a new owner of an object (this is the pool part of the write barrier, see set()): an object in a local pool becomes single-owned, a single-owned object moves to the gc pool. Objects in local pools are only visible to the thread that created them, but single-owned objects may be shared, so other threads can promote the same object at the same time */
+API_CALL AObject *claimObject(AObject *obj) {
+    if (obj->pool != gc_pool) {
+	if (obj->pool) /* has a local pool -> moves from the pool to NULL state which is single ownership */
+	    removeObjectFromPool(obj, obj->pool);
+	else { /* is already single-owned -> has to be moved to the gc pool */
+	    A_LOCK(gc_lock);
+	    if (!obj->pool)
+		addObjectToPool(obj, gc_pool);
+	    A_UNLOCK(gc_lock);
+	}
+    }
+    return obj;
+}
+
+/* keep a value alive in the current pool while C code holds on to it and evaluates further expressions, which may drop its owner (e.g. by assigning to the variable it came from) or run the gc. New objects are owned by their local pool already, anything else is claimed (so its owner cannot free it) and pinned */
+API_CALL AObject *pinValue(AObject *obj) {
+    if (!obj->pool || obj->pool == gc_pool)
+	pinObject(claimObject(obj), currentPool());
+    return obj;
+}
+
+/* Allocation scopes: the evaluation of a call can be wrapped in its own pool, so all temporaries it creates are released in one go when it returns, e.g.
+       AllocationPool *scope = enterScope();
+       return leaveScope(scope, someCall(...));
+   Only the result survives, it is handed over to the enclosing pool. If the result is owned by another object (which may well be a temporary in the scope) or by the gc pool, it is moved to the gc pool and pinned in the enclosing pool so it stays alive until the caller had a chance to assign it. On error the scope is left in place, the error handler has to release it (releasing an enclosing pool releases all pools above it). */
+API_CALL AllocationPool *enterScope() {
+    return newPool();
+}
+
+API_CALL AObject *leaveScope(AllocationPool *scope, AObject *res) {
+    AllocationPool *caller = scope->prev;
+    if (res) {
+	if (res->pool == scope) { /* a new object - just hand it over */
+	    removeObjectFromPool(res, scope);
+	    addObjectToPool(res, caller);
+	} else if (!res->pool || res->pool == gc_pool)
+	    pinObject(claimObject(res), caller); /* (claimObject moves a single-owned object to the gc pool) */
+	/* otherwise it lives in an enclosing pool, so it will outlive the caller's pool anyway */
+    }
+    currentThreadContext()->pool = caller;
+    releasePool(scope);
+    return res;
+}
+
+/* run the garbage collector if enough memory was allocated since the last run. This is only called before allocating a new object since at that point all objects are either in a pool or owned by another object */
+#define GC_CHECK(SIZE) { ThreadContext *ctx_ = currentThreadContext(); if ((ctx_->allocated += (SIZE)) > gc_threshold) gc_run(0); }
+
 /** allocate variable-length objects (with data) */
 API_CALL AObject *allocVarObject(AClass *cl, vsize_t size, vlen_t len) {
     vlen_t a = cl->attrs;
-    AObject *o = Acalloc(1, sizeof(AObject) + sizeof(AObject*) * a + size);
+    GC_CHECK(sizeof(AObject) + sizeof(AObject*) * a + size);
+    AObject *o = allocObjectMemory(sizeof(AObject) + sizeof(AObject*) * a + size);
 #if CLASS_WRITE_BARRIER
     set(o->attr, (AObject*) cl);
 #else
     o->attr[0] = (AObject*) cl;
 #endif
     o->attrs = a;
+    o->flags |= gc_color;
     o->size = size;
     o->len = len;
     A_debug(ADL_alloc, " + alloc <%s %p> [%u/%lu/%u]", className(o), o, a, size, len);
@@ -328,23 +616,28 @@ API_CALL AObject *allocVarObject(AClass *cl, vsize_t size, vlen_t len) {
 /** allocate fixed-length objets (no data) */
 API_CALL AObject *allocObject(AClass *cl) {
     vlen_t a = cl->attrs;
-    AObject *o = Acalloc(1, sizeof(AObject) + sizeof(AObject*) * a);
+    GC_CHECK(sizeof(AObject) + sizeof(AObject*) * a);
+    AObject *o = allocObjectMemory(sizeof(AObject) + sizeof(AObject*) * a);
 #if CLASS_WRITE_BARRIER
     set(o->attr, (AObject*) cl);
 #else
     o->attr[0] = (AObject*) cl;
 #endif
     o->attrs = a;
+    o->flags |= gc_color;
     A_debug(ADL_alloc, " + alloc <%s %p> [%u/no-data]", className(o), o, a);
     addObjectToPool(o, currentPool());
     return o;
 }
 
 API_FN AObject *default_copy(AObject *obj) {
-    vlen_t len = sizeof(AObject) + sizeof(AObject*) * obj->attrs + obj->size;
-    AObject *o = (AObject*) Amalloc(len);
+    vlen_t len = objectSize(obj);
+    GC_CHECK(len);
+    AObject *o = allocLongObjectMemory(len);
+    unsigned short flags = o->flags;
     /* FIXME: deep copy will include referenced objects which all have to be re-assigned using the write barrier ... */
     memcpy(o, obj, len);
+    o->flags = (obj->flags & ~(AOF_NURSERY | AOF_SLAB)) | flags;
     o->pool = NULL;
     return o;
 }
@@ -372,6 +665,80 @@ API_FN vlen_t default_length(AObject *obj) {
     return obj->len;
 }
 
+/* all objects reference their attributes */
+API_FN void default_traverse(AObject *obj, void (*fn)(AObject *, void *), void *ctx) {
+    vlen_t i, n = obj->attrs;
+    for (i = 1; i <= n; i++)
+	if (obj->attr[i]) fn(obj->attr[i], ctx);
+}
+
+/* vectors of objects (lists, strings) also reference their elements */
+API_FN void objvector_traverse(AObject *obj, void (*fn)(AObject *, void *), void *ctx) {
+    AObject **e = (AObject**) DIRECT_DATAPTR(obj);
+    vlen_t i, n = obj->len;
+    default_traverse(obj, fn, ctx);
+    for (i = 0; i < n; i++)
+	if (e[i]) fn(e[i], ctx);
+}
+
+/* Numeric and logical vectors can be deferred (AOF_DEFERRED): instead of the elements they hold an expression node that records an elementwise operation on its operands, which can be deferred themselves. The elements are computed (in one pass over the whole expression, see arith.c) when the data pointer is first requested. */
+typedef struct {
+    AObject *left, *right; /* operands, released once the value has been computed */
+    AObject *value;        /* the materialized result (NULL until the data is needed) */
+    void (*kernel)(void *res, const void *a, vlen_t m, const void *b, vlen_t n, vlen_t k);
+    vlen_t depth;          /* depth of the expression tree */
+} ADeferred;
+
+#define DEFERRED(O) ((ADeferred*) DIRECT_DATAPTR(O))
+#define IS_PENDING(O) (((O)->flags & AOF_DEFERRED) && !DEFERRED(O)->value)
+
+/* Integer sequences created by `:` are compact (AOF_COMPACT): they only store the first element and the step (the length is the vector length). Arithmetic generates their elements block by block (see arith.c), the full vector is only materialized if the data pointer is requested. */
+typedef struct {
+    int start, step;
+    AObject *value; /* the materialized elements (NULL until the data is needed) */
+} ACompactSeq;
+
+#define COMPACT_SEQ(O) ((ACompactSeq*) DIRECT_DATAPTR(O))
+
+/* Real and integer vectors can be backed by a memory-mapped file (AOF_MAPPED, see mapped.c): the data holds the mapping and the elements are paged in from the file on demand. */
+typedef struct {
+    void *addr;
+    size_t size;   /* size of the mapping (0 if the object is a view into the mapping of file) */
+    AObject *file; /* the mapped file the elements are in (NULL if the object owns the mapping itself) */
+} AMapping;
+
+API_VAR AClass *mappedFileClass;
+
+extern AObject *mapFile(const char *file, int copy_on_write); /* from mapped.c */
+extern AObject *mapView(AObject *file, size_t offset, AClass *cls, vlen_t len); /* from mapped.c */
+
+#define MAPPING(O) ((AMapping*) DIRECT_DATAPTR(O))
+
+extern void *deferred_materialize(AObject *); /* from arith.c */
+extern void *compact_materialize(AObject *); /* from arith.c */
+
+API_FN void *vector_dataPtr(AObject *obj) {
+    if (obj->flags & (AOF_DEFERRED | AOF_COMPACT | AOF_MAPPED)) {
+	if (obj->flags & AOF_MAPPED)
+	    return MAPPING(obj)->addr;
+	return (obj->flags & AOF_DEFERRED) ? deferred_materialize(obj) : compact_materialize(obj);
+    }
+    return DIRECT_DATAPTR(obj);
+}
+
+API_FN void vector_traverse(AObject *obj, void (*fn)(AObject *, void *), void *ctx) {
+    default_traverse(obj, fn, ctx);
+    if (obj->flags & AOF_DEFERRED) {
+	ADeferred *d = DEFERRED(obj);
+	if (d->left) fn(d->left, ctx);
+	if (d->right) fn(d->right, ctx);
+	if (d->value) fn(d->value, ctx);
+    } else if ((obj->flags & AOF_COMPACT) && COMPACT_SEQ(obj)->value)
+	fn(COMPACT_SEQ(obj)->value, ctx);
+    else if ((obj->flags & AOF_MAPPED) && MAPPING(obj)->file)
+	fn(MAPPING(obj)->file, ctx);
+}
+
 API_FN AObject *default_eval(AObject *obj, AObject *where) {
     return obj;
 }
@@ -400,35 +767,137 @@ API_FN AObject *lang_eval(AObject *obj, AObject *where) {
     return CLASS(car)->call(car, cdr, where);
 }
 
+/* Language objects can be compiled to bytecode (see bytecode.c) which is run by a stack machine instead of walking the tree. Compiled code calls the arithmetic operators directly */
+API_VAR AClass *bytecodeClass;
+
+extern AObject *compileExpr(AObject *e, AObject *where); /* from bytecode.c */
+extern void bytecode_init(); /* from bytecode.c */
+extern int arithOpIndex(void *fn); /* from arith.c */
+extern AObject *arithApply(int op, AObject *left, AObject *right, AObject *where); /* from arith.c */
+
+/* break and next don't jump out of the loop: they leave a pending control transfer in the thread context, `{` stops evaluating its expressions when it sees one and the innermost loop consumes it (see control.c) */
+#define CTRL_BREAK 1
+#define CTRL_NEXT  2
+
+API_CALL void checkNoLoopControl() {
+    if (currentThreadContext()->control)
+	A_error("no loop for break/next, jumping to top level");
+}
+
+/* user-defined functions (see closure.c) */
+API_VAR AClass *closureClass;
+
+extern void closure_init(); /* from closure.c */
+extern AObject *expandDots(AObject *args, AObject *where); /* from closure.c */
+
+/* generic functions: methods selected by the classes of the first DISPATCH_MAX_ARGS arguments (see dispatch.c) */
+#define DISPATCH_MAX_ARGS 2
+
+typedef struct {
+    AClass *sig[DISPATCH_MAX_ARGS]; /* objectClass matches any class */
+    AObject *fn;
+} AMethod;
+
+typedef struct {
+    symbol_t name;
+    int arity;         /* number of arguments the methods are selected by */
+    vlen_t methods, size;
+    AMethod *method;
+} AGeneric;
+
+API_VAR AClass *genericClass;
+
+extern void registerGeneric(AGeneric *g, symbol_t name); /* from dispatch.c */
+extern AGeneric *findGeneric(symbol_t name, int create); /* from dispatch.c */
+extern void setMethod(AGeneric *g, AClass **sig, int n, AObject *fn); /* from dispatch.c */
+extern AObject *dispatchMethod(AGeneric *g, AObject **args, int n); /* from dispatch.c */
+extern AObject *callMethod(AObject *method, AObject **args, int n, AObject *where); /* from dispatch.c */
+extern void dispatch_init(); /* from dispatch.c */
+extern void arith_init(); /* from arith.c */
+
 /* special NULL object */
 API_VAR AObject nullObject[1];
 
-/* symbols (more precisely attribute names) - this is really hacky for now ... */
-#define MAX_SYM 1024
+/* symbols (more precisely attribute names). Symbols live in fixed-size chunks that are never moved or freed, so ASymbol pointers stored in language objects stay valid as the table grows. Each symbol knows its own index, so ASymbol -> symbol_t is a simple field access. Name lookup uses an open-addressing hash table of (index + 1) which is grown (doubled) at 3/4 load.
+   Lookups don't take a lock, so they can run in any thread: a symbol is complete before its hash entry is published, and the chunk directory and the hash table are replaced by grown copies that are published as a whole (the old ones are kept until no other threads are running). Only adding symbols is serialized (see addSymbol). */
+#define SYM_CHUNK_BITS 10
+#define SYM_CHUNK      (1 << SYM_CHUNK_BITS)
+
+typedef struct ASymbolDir_s {
+    vlen_t size; /* number of chunk slots */
+    struct ASymbolDir_s *retired; /* previous directories that may still be in use by other threads */
+    ASymbol *chunk[1];
+} ASymbolDir;
+
+typedef struct ASymbolHash_s {
+    vlen_t mask;
+    struct ASymbolHash_s *retired; /* previous tables that may still be in use by other threads */
+    symbol_t slot[1];
+} ASymbolHash;
 
 /* FIXME: attributes should include type/class as well (but not in ASymbol) */
-GHVAR ASymbol symbol[MAX_SYM];
-GHVAR vlen_t symbols;
+GHVAR ASymbolDir *symbol_dir;
+GHVAR vlen_t symbols, symbol_chunks;
+GHVAR ASymbolHash *symbol_hash;
+
+#define sym_t2ASymbol(I) (__atomic_load_n(&symbol_dir, __ATOMIC_ACQUIRE)->chunk[(I) >> SYM_CHUNK_BITS] + ((I) & (SYM_CHUNK - 1)))
+
+extern symbol_t addSymbol(const char *name, unsigned int hash); /* from symbols.c */
+extern void addWellKnownSymbols(); /* from symbols.c */
+extern void releaseRetiredSymbolTables(); /* from symbols.c */
+
+/* FNV-1a */
+API_CALL unsigned int symbolHash(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name)
+	h = (h ^ (unsigned char) *(name++)) * 16777619u;
+    return h;
+}
 
 API_CALL symbol_t newSymbol(const char *name) {
-    vlen_t i = 0;
-    for (;i < symbols; i++)
-	if (!strcmp(symbol[i].name, name))
-	    return i;
-    symbol[symbols].obj.attrs = 0;
-    symbol[symbols].obj.size = sizeof(char *);
-    symbol[symbols].obj.attr[0] = (AObject*) symbolClass; /* this is ok even with class write barrier since symbolClass is constant */
-    symbol[symbols].obj.pool = gc_pool; /* flag it as constant to gc_pool */
-    symbol[symbols].name = strdup(name);
-    A_debug(ADL_alloc, " - new symbol: [%d] %s", symbols + 1, name);
-    return symbols++;
+    unsigned int h = symbolHash(name);
+    ASymbolHash *t = __atomic_load_n(&symbol_hash, __ATOMIC_ACQUIRE);
+    if (t) {
+	vlen_t i = h & t->mask;
+	symbol_t s;
+	while ((s = __atomic_load_n(t->slot + i, __ATOMIC_ACQUIRE))) {
+	    ASymbol *sym = sym_t2ASymbol(s - 1);
+	    if (sym->hash == h && !strcmp(sym->name, name))
+		return s - 1;
+	    i = (i + 1) & t->mask;
+	}
+    }
+    return addSymbol(name, h);
 }
 
 API_CALL const char *symbolName(symbol_t sym) {
-    return (const char*) symbol[sym].name;
+    return (const char*) sym_t2ASymbol(sym)->name;
 }
 
 /* attributes handling */
+/* Classes map the symbols of their attributes to slots: > 0 is the index of an object-level attribute in attr[] of the instances, < 0 a class-level attribute. The map only holds the attributes of the class, so it is an open-addressing hash table (at most half full, so lookups end at a free entry quickly) keyed by the symbol like environment frames. */
+#define ATTR_HASH(S) ((S) * 2654435769u)
+
+/* the slot of attribute sym in class c (0 if the class has no such attribute) */
+API_CALL smapi_t attrIndex(AClass *c, symbol_t sym) {
+    AAttrEntry *e = c->attr_map;
+    vlen_t mask = c->attr_map_mask, i;
+    if (!e) return 0;
+    for (i = ATTR_HASH(sym) & mask; e[i].sym; i = (i + 1) & mask)
+	if (e[i].sym == sym) return e[i].index;
+    return 0;
+}
+
+/* add an attribute to the map of c (or change its slot). The map must have room for it */
+API_CALL void attrMapSet(AClass *c, symbol_t sym, smapi_t index) {
+    AAttrEntry *e = c->attr_map;
+    vlen_t mask = c->attr_map_mask, i = ATTR_HASH(sym) & mask;
+    while (e[i].sym && e[i].sym != sym)
+	i = (i + 1) & mask;
+    e[i].sym = sym;
+    e[i].index = index;
+}
+
 API_CALL AObject *getAttr(AObject *o, symbol_t sym) {
     AClass *c = CLASS(o);
     AObject *a;
@@ -436,8 +905,7 @@ API_CALL AObject *getAttr(AObject *o, symbol_t sym) {
     A_debug(ADL_attr, " - getAttr <%s %p> %s", className(o), o, symbolName(sym));
     if (!c) return A_error("class objects have no attributes");
     if (sym == 1) return (AObject*) c; /* class attribute is special */
-    if (sym >= c->attr_map_len) return A_error("object has no %s attribute", symbolName(sym));
-    ao = c->attr_map[sym];
+    ao = attrIndex(c, sym);
     if (!ao) return A_error("object has no %s attribute", symbolName(sym));
     a = (ao > 0) ? o->attr[ao] : c->attr[1 - ao];
     return a ? a : nullObject;
@@ -446,16 +914,16 @@ API_CALL AObject *getAttr(AObject *o, symbol_t sym) {
 API_CALL AObject *getClassAttr(AClass *cls, symbol_t sym) {
     smapi_t ao;
     if (sym == 1) return (AObject*) cls;
-    if (sym >= cls->attr_map_len) return NULL;
-    ao = cls->attr_map[sym];
+    ao = attrIndex(cls, sym);
     return (ao > 0) ? NULL : cls->attr[1 - ao];
 }
 
 API_CALL const char *attrNameAt(AClass *cls, vlen_t index) {
-    vlen_t i, n = cls->attr_map_len;
-    for (i = 0; i < n; i++)
-	if (cls->attr_map[i] == index)
-	    return symbol[i].name;
+    vlen_t i;
+    if (cls->attr_map)
+	for (i = 0; i <= cls->attr_map_mask; i++)
+	    if (cls->attr_map[i].sym && cls->attr_map[i].index == index)
+		return symbolName(cls->attr_map[i].sym);
     return "<undefined>";
 }
 
@@ -466,12 +934,8 @@ API_CALL AObject *set(AObject **ptr, AObject *val) {
 	ptr[0] = val;
 	if (ov && ov->pool != gc_pool) /* if the value was not GC'd we can free it [since we owned it it can't be in a local pool - but we could add a sanity check] */
 	    _freeObject(ov);
-	if (val && val->pool != gc_pool) { /* if the value is not multi-owned, we have to adjust the pool */
-	    if (val->pool) /* has a local pool -> moves from the pool to NULL state which is single ownership */
-		removeObjectFromPool(val, val->pool);
-	    else /* is already single-owned -> has to be moved to the gc pool */
-		addObjectToPool(val, gc_pool);
-	}
+	if (val) /* if the value is not multi-owned, we have to adjust the pool */
+	    claimObject(val);
     }
     return val;
 }
@@ -484,8 +948,7 @@ API_CALL void setAttr(AObject *o, symbol_t sym, AObject *val) {
     }
     A_debug(ADL_attr, " - setAttr <%s %p> %s <%s %p>", className(o), o, symbolName(sym), className(val), val);
     if (!c) A_error("class objects have no attributes");
-    if (sym >= c->attr_map_len) A_error("object has no %s attribute", symbolName(sym));
-    ao = c->attr_map[sym];
+    ao = attrIndex(c, sym);
     if (!ao) A_error("object has no %s attribute", symbolName(sym));
     /* FIXME: this is old code before we had set() - we should re-write it to use set() instead ... */
     if (ao > 0) { /* object-level attribute */
@@ -494,12 +957,7 @@ API_CALL void setAttr(AObject *o, symbol_t sym, AObject *val) {
 	    o->attr[ao] = val;
 	    if (ov && ov->pool != gc_pool) /* if the value was not GC'd we can free it [since we owned it it can't be in a local pool - but we could add a sanity check] */
 		_freeObject(ov);
-	    if (val->pool != gc_pool) { /* if the value is not multi-owned, we have to adjust the pool */
-		if (val->pool) /* has a local pool -> moves from the pool to NULL state which is single ownership */
-		    removeObjectFromPool(val, val->pool);
-		else /* is already single-owned -> has to be moved to the gc pool */
-		    addObjectToPool(val, gc_pool);
-	    }
+	    claimObject(val); /* if the value is not multi-owned, we have to adjust the pool */
 	}
     } else { /* class-level attribute */
 	AObject *ov = c->attr[1 - ao];
@@ -507,56 +965,90 @@ API_CALL void setAttr(AObject *o, symbol_t sym, AObject *val) {
 	    c->attr[1 - ao] = val;
 	    if (ov && ov->pool != gc_pool) /* if the value was not GC'd we can free it [since we owned it it can't be in a local pool - but we could add a sanity check] */
 		_freeObject(ov);
-	    if (val->pool != gc_pool) { /* if the value is not multi-owned, we have to adjust the pool */
-		if (val->pool) /* has a local pool -> moves from the pool to NULL state which is single ownership */
-		    removeObjectFromPool(val, val->pool);
-		else /* is already single-owned -> has to be moved to the gc pool */
-		    addObjectToPool(val, gc_pool);
-	    }
+	    claimObject(val); /* if the value is not multi-owned, we have to adjust the pool */
 	}
     }
 }
 
-/* creating subclasses (currently only single inheritance is implmeneted) */
+/* creating subclasses */
+/* all classes created by subclass() in the order of creation, so classes can be found by name (see findClass) */
+GHVAR AClass **class_list;
+GHVAR vlen_t classes, class_list_size;
+GHVAR unsigned long dispatch_epoch; /* advanced whenever classes or methods change (see dispatch.c) */
+GHVAR vlen_t class_ids; /* number of class ids handed out */
+
+/* Class ancestry: each class has an id (in the order of creation) and a bit set of the ids of the class itself and all its ancestors, so testing whether a class is derived from another is a single bit test no matter how deep the hierarchy is or how many superclasses the classes have. The set of a class is the union of the sets of its superclasses plus its own id, so it is computed when the class is created. It only needs as many words as the highest id in it, which is that of the class itself. */
+#define ANCESTRY_BITS (sizeof(unsigned long) * 8)
+
+/* add the ancestors in set (of words length) to the ancestry of c */
+API_CALL void addAncestry(AClass *c, unsigned long *set, vlen_t words) {
+    vlen_t i;
+    if (words > c->ancestry_words) {
+	c->ancestry = (unsigned long*) Arealloc(c->ancestry, sizeof(unsigned long) * words);
+	memset(c->ancestry + c->ancestry_words, 0, sizeof(unsigned long) * (words - c->ancestry_words));
+	c->ancestry_words = words;
+    }
+    for (i = 0; i < words; i++)
+	c->ancestry[i] |= set[i];
+}
+
+/* give a new class its id and compute its ancestry from its superclasses */
+API_CALL void initClassAncestry(AClass *c) {
+    vlen_t i;
+    c->id = class_ids++;
+    c->ancestry_words = c->id / ANCESTRY_BITS + 1;
+    c->ancestry = (unsigned long*) Acalloc(c->ancestry_words, sizeof(unsigned long));
+    c->ancestry[c->id / ANCESTRY_BITS] = 1ul << (c->id % ANCESTRY_BITS);
+    for (i = 0; i < c->supers; i++) {
+	AClass *s = (i < BUILTIN_SUPERCLASSES) ? c->super[i] : c->more_super[i - BUILTIN_SUPERCLASSES];
+	addAncestry(c, s->ancestry, s->ancestry_words);
+    }
+}
+
 API_CALL AClass *subclass(AClass *cl, const char *name, symbol_t *new_attributes, AClass **new_classes) {
     AClass *nc = (AClass*) Acalloc(1, sizeof(AClass));
     nc->class_obj.attr[0] = (AObject*) classClass; /* this is ok since classClass is constant */
     nc->name = strdup(name);
     nc->class_obj.pool = gc_pool; /* FIXME: classes are currently considered constants so they are flagged with gc_pool even though they are not part of it. Maybe they should be subject to the usual memory management.. */
-    symbol_t highest_sym = cl->attr_map_len, ca = cl->attrs, *a;
+    symbol_t ca = cl->attrs, *a;
     if (new_attributes) {
-	vlen_t new_atts = 0;
-	/* find the necessary size of the attribute map */
+	vlen_t new_atts = 0, entries, capacity = 2, i;
 	a = new_attributes;
 	while (*a) {
-	    if (*a > highest_sym) highest_sym = *a;
 	    a++; new_atts++;
 	}
-	/* copy superclass' attr map */
-	nc->attr_map = (smapi_t*) Acalloc(highest_sym + 1, sizeof(smapi_t));
-	nc->attr_map_len = highest_sym + 1;
-	if (cl->attr_map_len)
-	    memcpy(nc->attr_map, cl->attr_map, sizeof(smapi_t) * cl->attr_map_len);
+	/* the map holds the superclass' attributes and the new ones */
+	entries = new_atts;
+	if (cl->attr_map)
+	    for (i = 0; i <= cl->attr_map_mask; i++)
+		if (cl->attr_map[i].sym) entries++;
+	while (capacity < entries * 2)
+	    capacity *= 2;
+	nc->attr_map = (AAttrEntry*) Acalloc(capacity, sizeof(AAttrEntry));
+	nc->attr_map_mask = capacity - 1;
+	if (cl->attr_map)
+	    for (i = 0; i <= cl->attr_map_mask; i++)
+		if (cl->attr_map[i].sym)
+		    attrMapSet(nc, cl->attr_map[i].sym, cl->attr_map[i].index);
 	nc->attr_classes = Amalloc((cl->attrs + new_atts) * sizeof(AClass*));
 	if (cl->attr_classes)
 	    memcpy(nc->attr_classes, cl->attr_classes, sizeof(AClass*) * cl->attrs);
 	if (new_classes)
 	    memcpy(nc->attr_classes + cl->attrs, new_classes, sizeof(AClass*) * new_atts);
 	else {
-	    vlen_t i;
 	    for (i = 0; i < new_atts; i++)
 		nc->attr_classes[i + cl->attrs] = objectClass;
 	}
     } else {
 	nc->attr_map = cl->attr_map;
-	nc->attr_map_len = cl->attr_map_len;
+	nc->attr_map_mask = cl->attr_map_mask;
 	nc->attr_classes = cl->attr_classes;
     }
     /* add new attributes to the map */
     if (new_attributes) {
 	a = new_attributes;
 	while (*a) {
-	    nc->attr_map[*a] = ++ca;
+	    attrMapSet(nc, *a, ++ca);
 	    a++;
 	}
     }
@@ -568,25 +1060,53 @@ API_CALL AClass *subclass(AClass *cl, const char *name, symbol_t *new_attributes
     nc->dataPtr = cl->dataPtr;
     nc->eval = cl->eval;
     nc->call = cl->call;
-
+    nc->traverse = cl->traverse;
+    nc->supers = 1;
+    nc->super[0] = cl;
+    initClassAncestry(nc);
+    dispatch_epoch++;
+
+    if (classes == class_list_size) {
+	class_list_size = class_list_size ? class_list_size * 2 : 64;
+	class_list = (AClass**) Arealloc(class_list, sizeof(AClass*) * class_list_size);
+    }
+    class_list[classes++] = nc;
     return nc;
 }
 
-/** is assignable from class cc to class cl */
-API_CALL int isAssignableClass(AClass *cc, AClass *cl) {
-    if (cc == cl) return 1;
-    if (cc->supers == 0) return 0;
-    if (isAssignableClass(cc->super[0], cl)) return 1;
-    if (cc->supers > 1 && isAssignableClass(cc->super[1], cl)) return 1;
-    if (cc->supers > 2 && isAssignableClass(cc->super[2], cl)) return 1;
-    if (cc->supers > 3) {
-	vlen_t i = 0, n = cc->supers - BUILTIN_SUPERCLASSES;
-	for (; i < n; i++)
-	    if (isAssignableClass(cc->more_super[i], cl)) return 1;
-    }
+/* returns the class of the given name or NULL if there is none. If there are several classes of the same name, the most recent one is used */
+API_CALL AClass *findClass(const char *name) {
+    AClass *builtin[] = { objectClass, classClass, nullClass, symbolClass };
+    vlen_t i;
+    for (i = classes; i > 0; i--)
+	if (!strcmp(class_list[i - 1]->name, name)) return class_list[i - 1];
+    for (i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++)
+	if (!strcmp(builtin[i]->name, name)) return builtin[i];
     return 0;
 }
 
+/** is assignable from class cc to class cl (i.e. is cc cl or derived from it) */
+API_CALL int isAssignableClass(AClass *cc, AClass *cl) {
+    return cc == cl || (cl->id < cc->ancestry_words * ANCESTRY_BITS && ((cc->ancestry[cl->id / ANCESTRY_BITS] >> (cl->id % ANCESTRY_BITS)) & 1));
+}
+
+/* add another superclass to class cl (multiple inheritance). Classes already derived from cl inherit the new ancestors as well */
+API_CALL void addSuperclass(AClass *cl, AClass *super) {
+    vlen_t i;
+    if (isAssignableClass(super, cl)) A_error("class '%s' cannot be its own ancestor", cl->name);
+    if (cl->supers >= BUILTIN_SUPERCLASSES) {
+	cl->more_super = (AClass**) Arealloc(cl->more_super, sizeof(AClass*) * (cl->supers + 1 - BUILTIN_SUPERCLASSES));
+	cl->more_super[cl->supers - BUILTIN_SUPERCLASSES] = super;
+    } else
+	cl->super[cl->supers] = super;
+    cl->supers++;
+    for (i = 0; i < classes; i++)
+	if (class_list[i] != cl && isAssignableClass(class_list[i], cl))
+	    addAncestry(class_list[i], super->ancestry, super->ancestry_words);
+    addAncestry(cl, super->ancestry, super->ancestry_words);
+    dispatch_epoch++;
+}
+
 /** just a shorthand for isAssignableClass(CLASS(object), class) */
 API_CALL int isAssignable(AObject *o, AClass *cl) {
     return isAssignableClass(CLASS(o), cl);
@@ -613,6 +1133,10 @@ API_CALL AObject *allocIntVector(vlen_t n) {
     return allocVarObject(integerClass, sizeof(int) * n, n);
 }
 
+/* missing values of integer and logical vectors (as in R) */
+#define A_NA_INT     INT_MIN
+#define A_NA_LOGICAL INT_MIN
+
 API_CALL AObject *allocLogicalVector(vlen_t n) {
     return allocVarObject(logicalClass, sizeof(bool_t) * n, n);
 }
@@ -621,16 +1145,95 @@ API_CALL AObject *allocObjectVector(AClass *cl, vlen_t n) {
     return allocVarObject(cl, sizeof(AObject*) * n, n);
 }
 
-API_CALL AObject *allocEnv() {
-    vlen_t init_len = 1024;
+/* environments keep their bindings in a frame: an open-addressing hash table of (symbol, value) entries keyed directly by symbol_t. Symbol 0 (the empty symbol) marks a free slot. The frame is a separate object so it can be replaced by a larger one while the environment keeps its identity. The frame length is the number of bindings, its capacity is always a power of two. Each frame has a unique serial number (never reused) which is used to validate the symbol lookup caches (see symbol_eval). */
+typedef struct {
+    symbol_t sym;
+    AObject *value;
+} AFrameEntry;
+
+typedef struct {
+    unsigned long serial;
+    AFrameEntry entry[1];
+} AFrameData;
+
+API_VAR AClass *frameClass;
+GHVAR unsigned long frame_serial;
+
+#define ENV_FRAME_ATTR_ID  1
+#define ENV_PARENT_ATTR_ID 2
+
+#define ENV_FRAME(E) ((E)->attr[ENV_FRAME_ATTR_ID])
+#define ENV_PARENT(E) ((E)->attr[ENV_PARENT_ATTR_ID])
+#define FRAME_SERIAL(F) (((AFrameData*) DIRECT_DATAPTR(F))->serial)
+#define FRAME_ENTRY(F) (((AFrameData*) DIRECT_DATAPTR(F))->entry)
+#define FRAME_CAPACITY(F) ((vlen_t) (((F)->size - sizeof(AFrameData) + sizeof(AFrameEntry)) / sizeof(AFrameEntry)))
+#define FRAME_HASH(S) ((S) * 2654435769u)
+
+#define DEFAULT_FRAME_SIZE 8
+
+API_CALL AObject *allocFrame(vlen_t capacity) {
+    AObject *frame = allocVarObject(frameClass, sizeof(AFrameData) + sizeof(AFrameEntry) * (capacity - 1), 0);
+    FRAME_SERIAL(frame) = aleph_threads ? __atomic_add_fetch(&frame_serial, 1, __ATOMIC_RELAXED) : ++frame_serial;
+    return frame;
+}
+
+API_VAR AObject *globalEnv; /* the top-level environment (NULL until it has been created) */
+API_VAR AObject *R_MissingArg; /* the value of formals that were neither supplied nor have a default (defined in Rcompat.h) */
+
+/* allocate a new environment enclosed by parent (which can be NULL or nullObject for none) */
+API_CALL AObject *allocEnv(AObject *parent) {
     AObject *env = allocObject(envClass);
-    AObject *values = allocVarObject(listClass, sizeof(AObject*) * init_len, 0);
-    AObject *names = allocVarObject(stringClass, sizeof(AObject*) * init_len, 0);
-    setAttr(env, newSymbol("names"), names);
-    setAttr(env, newSymbol("values"), values);
+    set(&ENV_FRAME(env), allocFrame(DEFAULT_FRAME_SIZE));
+    set(&ENV_PARENT(env), parent ? parent : nullObject);
     return env;
 }
 
+API_FN void frame_traverse(AObject *frame, void (*fn)(AObject *, void *), void *ctx) {
+    AFrameEntry *e = FRAME_ENTRY(frame);
+    vlen_t i, n = FRAME_CAPACITY(frame);
+    default_traverse(frame, fn, ctx);
+    for (i = 0; i < n; i++)
+	if (e[i].sym && e[i].value) fn(e[i].value, ctx);
+}
+
+/* returns the entry for the symbol or NULL if it is not bound in the frame */
+API_CALL AFrameEntry *frameLookup(AObject *frame, symbol_t sym) {
+    AFrameEntry *e = FRAME_ENTRY(frame);
+    vlen_t mask = FRAME_CAPACITY(frame) - 1, i = FRAME_HASH(sym) & mask;
+    while (e[i].sym) {
+	if (e[i].sym == sym) return e + i;
+	i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* returns the free slot in which the (unbound) symbol is to be inserted */
+API_CALL AFrameEntry *frameInsertSlot(AObject *frame, symbol_t sym) {
+    AFrameEntry *e = FRAME_ENTRY(frame);
+    vlen_t mask = FRAME_CAPACITY(frame) - 1, i = FRAME_HASH(sym) & mask;
+    while (e[i].sym)
+	i = (i + 1) & mask;
+    return e + i;
+}
+
+/* replace the frame of an environment with one twice as large. The values are moved without going through the write barrier since their ownership simply transfers from the old frame to the new one. */
+API_CALL AObject *growEnvFrame(AObject *env) {
+    AObject *frame = ENV_FRAME(env), *nf = allocFrame(FRAME_CAPACITY(frame) * 2);
+    AFrameEntry *e = FRAME_ENTRY(frame);
+    vlen_t i, n = FRAME_CAPACITY(frame);
+    for (i = 0; i < n; i++)
+	if (e[i].sym) {
+	    AFrameEntry *ne = frameInsertSlot(nf, e[i].sym);
+	    ne->sym = e[i].sym;
+	    ne->value = e[i].value;
+	}
+    nf->len = frame->len; /* nf has a new serial so all lookup caches pointing to the old frame are invalid now */
+    memset(e, 0, sizeof(AFrameEntry) * n); /* the old frame no longer owns anything */
+    frame->len = 0;
+    set(&ENV_FRAME(env), nf);
+    return nf;
+}
+
 API_CALL AObject *consPairs(AClass *cl, AObject *car, AObject *cdr, AObject *tag) {
     AObject *o = allocObject(cl);
     set(&DIRECT_CAR(o), car);
@@ -650,7 +1253,7 @@ API_CALL AObject *consPairs(AClass *cl, AObject *car, AObject *cdr, AObject *tag
 #define SETCAR(X, Y) set(&DIRECT_CAR(X), Y)
 #define SETCDR(X, Y) set(&DIRECT_CDR(X), Y)
 
-#define ASymbol2sym_t(name)  ((symbol_t) ((ASymbol*)(name) - symbol))
+#define ASymbol2sym_t(name)  (((ASymbol*)(name))->index)
 
 #define PRINTNAME(X) mkChar(symbolName(ASymbol2sym_t(X)))
 
@@ -730,7 +1333,17 @@ API_CALL void PrintValueL(AObject *obj, vlen_t level) {
 	vlen_t i, n = LENGTH(obj);
 	A_printvstart();
 	for (i = 0; i < n; i++)
-	    A_printv("%2d ", di[i]);
+	    if (di[i] == A_NA_INT)
+		A_printv("NA ");
+	    else
+		A_printv("%2d ", di[i]);
+	A_printvend();
+    } else if (CLASS(obj) == logicalClass) {
+	bool_t *di = LOGICAL(obj);
+	vlen_t i, n = LENGTH(obj);
+	A_printvstart();
+	for (i = 0; i < n; i++)
+	    A_printv("%s ", (di[i] == A_NA_LOGICAL) ? "NA" : (di[i] ? "TRUE" : "FALSE"));
 	A_printvend();
     } else if (CLASS(obj) == realClass) {
 	double *di = REAL(obj);
@@ -762,77 +1375,93 @@ API_CALL void PrintValueL(AObject *obj, vlen_t level) {
 
 /* TODO: functions, methods ... */
 
-API_CALL AObject *symbol_get(symbol_t sym_, AObject *where) {
-    ASymbol *sym = symbol + sym_;
-    const char *sym_name = sym->name;
-    if (!where) return NULL;
-    AObject *names = getAttr(where, newSymbol("names"));
-    AObject *vals  = getAttr(where, newSymbol("values"));
-    if (vals && names && LENGTH(names) == LENGTH(vals) && LENGTH(names) > 0) {
-	vsize_t i, n = LENGTH(names);
-	for (i = 0; i < n; i++) {
-	    AObject *o = GET_STRING_ELT(names, i);
-	    if (o && !strcmp(CHAR(o), sym_name))
-		return GET_VECTOR_ELT(vals, i);
+/* find the binding of a symbol in the environment or its parents, returns NULL if it is not bound. If found is not NULL, it will be set to the environment in which the binding was found. */
+API_CALL AFrameEntry *envLookup(symbol_t sym, AObject *where, AObject **found) {
+    while (where && where != nullObject) {
+	AFrameEntry *e = frameLookup(ENV_FRAME(where), sym);
+	if (e) {
+	    if (found) *found = where;
+	    return e;
 	}
-    }	    
+	where = ENV_PARENT(where);
+    }
     return NULL;
 }
 
-API_CALL int symbol_set(symbol_t sym_, AObject *val, AObject *where) {
-    ASymbol *sym = symbol + sym_;
-    const char *sym_name = sym->name;
+API_CALL AObject *symbol_get(symbol_t sym, AObject *where) {
+    AFrameEntry *e = envLookup(sym, where, NULL);
+    return e ? e->value : NULL;
+}
+
+/* assigns the value in the environment where (never in its parents) */
+API_CALL int symbol_set(symbol_t sym, AObject *val, AObject *where) {
+    AObject *frame;
+    AFrameEntry *e;
     if (!where) { A_warning("symbol_set: where is NULL"); return 0; }
 #ifdef A_DEBUG
-    A_debug(ADL_set, "symbol_set '%s': ", sym_name);
+    A_debug(ADL_set, "symbol_set '%s': ", symbolName(sym));
     PrintValue(val);
 #endif
-    AObject *names = getAttr(where, newSymbol("names"));
-    AObject *vals  = getAttr(where, newSymbol("values"));
-    if (vals && names && LENGTH(names) == LENGTH(vals)) {
-	vsize_t i, n = LENGTH(names);
-	for (i = 0; i < n; i++) {
-	    AObject *o = GET_STRING_ELT(names, i);
-	    if (o && !strcmp(CHAR(o), sym_name)) {
-		SET_VECTOR_ELT(vals, i, val);
-		return 1;
-	    }
-	}
-	/* FIXME: this is a bad hack for now ... we should be checking size and re-allocating */
-	if ((names->len + 2) * sizeof(AObject*) > names->size ||
-	    (vals->len + 2) * sizeof(AObject*) > vals->size) {
-	    A_warning("symbol_set: out of memory [%d,%d,%d,%d]", 
-		      (names->len + 2) * sizeof(AObject*), names->size,
-		      (vals->len + 2) * sizeof(AObject*), vals->size
-		      );
-	    return 0;
-	}
-	names->len++;
-	SET_STRING_ELT(names, i, mkChar(sym_name));
-	vals->len++;
-	SET_VECTOR_ELT(vals, i, val);
-	return 1;
+    frame = ENV_FRAME(where);
+    e = frameLookup(frame, sym);
+    if (!e) {
+	if ((frame->len + 1) * 4 > FRAME_CAPACITY(frame) * 3) /* keep the load under 3/4 */
+	    frame = growEnvFrame(where);
+	e = frameInsertSlot(frame, sym);
+	e->sym = sym;
+	frame->len++;
+	sym_t2ASymbol(sym)->version++; /* a new binding may shadow cached ones */
     }
-    A_warning("invalid environment");
-    return 0;
+    set(&e->value, val);
+    return 1;
 }
 
+/* Symbol evaluation uses a lookup cache in the symbol object: it records the serial of the frame the lookup started in, the environment the binding was found in (along with its frame serial) and the slot in that frame. The cache is valid as long as
+   a) the lookup starts in the same environment (serials are unique and never reused, so this also guards against recycled environment addresses)
+   b) no binding of the symbol was created since (the symbol's version is unchanged) - this covers shadowing by a frame on the way to the cached one
+   c) the frame holding the binding has not been replaced by growing (its serial is unchanged)
+   The parent of an environment never changes, so the chain between the two frames is fixed and the found environment is alive as long as the starting one is.
+   The cache is not used while other threads are running since it cannot be updated atomically.
+   Evaluating a formal that is bound to R_MissingArg is an error. */
+#define SYMBOL_VALUE(S, V) (((V) == R_MissingArg) ? A_error("argument '%s' is missing, with no default", (S)->name) : (V))
+
 API_CALL AObject *symbol_eval(AObject *obj, AObject *where) {
+    ASymbol *sym = (ASymbol*) obj;
+    AObject *found;
+    AFrameEntry *e;
     if (!where)
-	A_error("invalid context (NULL)");
-    else {
-	AObject *o = symbol_get(ASymbol2sym_t(obj), where);
-	if (!o) 
-	    A_error("symbol '%s' is undefined", ((ASymbol*)obj)->name);
-	return o;
-    }
-    return NULL;
+	return A_error("invalid context (NULL)");
+    if (!aleph_threads && sym->cache_serial == FRAME_SERIAL(ENV_FRAME(where)) && sym->cache_version == sym->version &&
+	sym->cache_found == FRAME_SERIAL(ENV_FRAME(sym->cache_env)))
+	return SYMBOL_VALUE(sym, FRAME_ENTRY(ENV_FRAME(sym->cache_env))[sym->cache_slot].value);
+    e = envLookup(sym->index, where, &found);
+    if (!e)
+	return A_error("symbol '%s' is undefined", sym->name);
+    if (aleph_threads)
+	return SYMBOL_VALUE(sym, e->value);
+    sym->cache_serial = FRAME_SERIAL(ENV_FRAME(where));
+    sym->cache_version = sym->version;
+    sym->cache_env = found;
+    sym->cache_found = FRAME_SERIAL(ENV_FRAME(found));
+    sym->cache_slot = (vlen_t) (e - FRAME_ENTRY(ENV_FRAME(found)));
+    return SYMBOL_VALUE(sym, e->value);
 }
 
 API_CALL AObject *eval(AObject *obj, AObject *where) {
     return CLASS(obj)->eval(obj, where);
 }
 
+/* evaluate the next argument of a native function call which must be a single string and advance args. Returns def if there are no more arguments */
+API_CALL const char *stringArg(AObject **args, AObject *where, const char *name, const char *def) {
+    AObject *v;
+    if (*args == nullObject) return def;
+    v = eval(getAttr(*args, AS_head), where);
+    *args = getAttr(*args, AS_next);
+    if (CLASS(v) != stringClass || LENGTH(v) != 1)
+	A_error("'%s' must be a single string", name);
+    return CHAR(STRING_ELT(v, 0));
+}
+
 #include "methods.h"
 
 /** the following should probably go to Rcompat.h instead */
@@ -841,6 +1470,7 @@ API_CALL AObject *eval(AObject *obj, AObject *where) {
 
 #define isNull(X) ((X) == nullObject)
 
-#define install(C) ((AObject*)&symbol[newSymbol(C)])
+#define install(C) ((AObject*)sym_t2ASymbol(newSymbol(C)))
+#define installed(S) ((AObject*)sym_t2ASymbol(S)) /* symbol object of a well-known symbol (AS_*) */
 
 #endif
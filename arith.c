@@ -1,67 +1,637 @@
 #include "aleph.h"
 
+#include <math.h>
 
-/* this is a hack until we have proper dispatch */
+/* Temporaries.
+
+   An object that is still in the current pool was created during the current call and nothing but the pool references it (the first assignment moves an object out of its pool, see set()). Once it has been passed to an operation nobody can look at it again, so the operation can write its result over it instead of allocating a new vector. This applies to plain vectors only: the data of deferred, compact and mapped vectors is not the elements. Setting arith_reuse to 0 disables it. */
+int arith_reuse = 1;
+
+#define ELT_SIZE_OF(C) (((C) == realClass) ? sizeof(double) : sizeof(int))
+#define ELT_SIZE(O) ELT_SIZE_OF(CLASS(O))
+
+/* returns o turned into a vector of class cls if its memory can hold the result of length len (see above), NULL otherwise. owner is the pool o has to be in - NULL means o is only owned by the object that asks */
+static AObject *reuse_vector(AObject *o, AllocationPool *owner, AClass *cls, vlen_t len) {
+    if (!arith_reuse || o->pool != owner || o->len != len || (o->flags & (AOF_DEFERRED | AOF_COMPACT | AOF_MAPPED)) ||
+	ELT_SIZE(o) != ELT_SIZE_OF(cls) || CLASS(o)->attrs != cls->attrs)
+	return 0;
+    if (CLASS(o) != cls) { /* integer and logical vectors have the same layout */
+#if CLASS_WRITE_BARRIER
+	set(o->attr, (AObject*) cls);
+#else
+	o->attr[0] = (AObject*) cls;
+#endif
+    }
+    return o;
+}
+
+/* this is a hack until we have proper dispatch. Temporaries may be converted in place, so obj must not be used afterwards */
 AObject *coerce(AObject *obj, AClass *cls) {
   if (CLASS(obj) == cls) return obj;
+  if (cls == integerClass && CLASS(obj) == logicalClass) {
+    AObject *res = reuse_vector(obj, currentPool(), integerClass, LENGTH(obj));
+    if (!res) {
+      res = allocIntVector(LENGTH(obj));
+      memcpy(INTEGER(res), INTEGER(obj), sizeof(int) * LENGTH(obj));
+    }
+    return res;
+  }
   if (cls == realClass) {
-    if (CLASS(obj) == integerClass) {
+    if (CLASS(obj) == integerClass || CLASS(obj) == logicalClass) {
       vlen_t n = LENGTH(obj), i;
       AObject *res = allocRealVector(n);
       double *d = REAL(res);
       int *s = INTEGER(obj);
-      for (i = 0; i < n; i++) d[i] = (double) s[i];
+      for (i = 0; i < n; i++) d[i] = (s[i] == A_NA_INT) ? NAN : (double) s[i];
       return res;
     }
   }
-  A_error("no method to coerce '%s' into '%s'", CLASS(obj), cls);
+  A_error("no method to coerce '%s' into '%s'", className(obj), cls->name);
   return nullObject;
 }
 
-/* some very basic arithmetics */
-AObject *fn_add(AObject *args, AObject *where) {
+/* Arithmetic kernels.
+
+   A binary operation on vectors of lengths m and n has a result of length max(m, n) (0 if either is empty) where the shorter argument is recycled. BINARY_KERNEL defines a kernel for one operation and one combination of argument types. The operation is an expression in x (element of a) and y (element of b). Each kernel has four loops:
+    - equal lengths: c[i] = x[i] op y[i]
+    - scalar on the left or right: the scalar is hoisted out of the loop
+    - general recycling: the result is filled in contiguous runs that end where either argument wraps around, so there is no modulo in the inner loop
+   The inner loops are simple indexed loops, so the compiler can vectorize them. The result may be the memory of an argument of the same length (see reuse_vector) - that is fine since each element is read before it is written and nothing else reads that position. So the pointers cannot be restrict; instead the loops are marked as free of loop-carried dependencies (ARITH_LOOP), which is what the compiler needs to vectorize them without run-time overlap checks.
+
+   Integer NA is INT_MIN (as in R). Integer operations return NA for NA arguments and on overflow, operations on reals rely on NaN propagation (we don't distinguish NA and NaN for reals yet). */
+
+typedef void (*arith_kernel_t)(void *res, const void *a, vlen_t m, const void *b, vlen_t n, vlen_t k);
+
+#if defined(__clang__)
+#define ARITH_LOOP _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define ARITH_LOOP _Pragma("GCC ivdep")
+#else
+#define ARITH_LOOP
+#endif
+
+#define BINARY_KERNEL(NAME, TA, TB, TR, EXPR) \
+static void NAME(void *res, const void *av, vlen_t m, const void *bv, vlen_t n, vlen_t k) { \
+    TR *c = (TR*) res; \
+    const TA *a = (const TA*) av; \
+    const TB *b = (const TB*) bv; \
+    vlen_t i; \
+    if (m == n) { \
+	ARITH_LOOP for (i = 0; i < k; i++) { TA x = a[i]; TB y = b[i]; c[i] = (EXPR); } \
+    } else if (m == 1) { \
+	const TA x = a[0]; \
+	ARITH_LOOP for (i = 0; i < k; i++) { TB y = b[i]; c[i] = (EXPR); } \
+    } else if (n == 1) { \
+	const TB y = b[0]; \
+	ARITH_LOOP for (i = 0; i < k; i++) { TA x = a[i]; c[i] = (EXPR); } \
+    } else { \
+	vlen_t ia = 0, ib = 0, j, run; \
+	for (i = 0; i < k; i += run) { \
+	    run = m - ia; \
+	    if (n - ib < run) run = n - ib; \
+	    if (k - i < run) run = k - i; \
+	    ARITH_LOOP for (j = 0; j < run; j++) { TA x = a[ia + j]; TB y = b[ib + j]; c[i + j] = (EXPR); } \
+	    if ((ia += run) == m) ia = 0; \
+	    if ((ib += run) == n) ib = 0; \
+	} \
+    } \
+}
+
+#define INT_NA2(X, Y) ((X) == A_NA_INT || (Y) == A_NA_INT)
+/* the result of an integer operation computed in 64-bit, NA if it doesn't fit */
+#define INT_RES(R) (((R) > INT_MAX || (R) <= INT_MIN) ? A_NA_INT : (int) (R))
+
+/* integer division and modulo round towards -Inf (as in R) */
+static inline int int_mod(int x, int y) {
+    int r = x % y;
+    return (r && ((r ^ y) < 0)) ? r + y : r;
+}
+
+static inline int int_idiv(int x, int y) {
+    int q = x / y;
+    return ((x % y) && ((x ^ y) < 0)) ? q - 1 : q;
+}
+
+static inline double real_mod(double x, double y) {
+    return x - floor(x / y) * y;
+}
+
+BINARY_KERNEL(add_ii, int, int, int, INT_NA2(x, y) ? A_NA_INT : INT_RES((long) x + (long) y))
+BINARY_KERNEL(sub_ii, int, int, int, INT_NA2(x, y) ? A_NA_INT : INT_RES((long) x - (long) y))
+BINARY_KERNEL(mul_ii, int, int, int, INT_NA2(x, y) ? A_NA_INT : INT_RES((long) x * (long) y))
+BINARY_KERNEL(div_ii, int, int, double, INT_NA2(x, y) ? NAN : (double) x / (double) y)
+BINARY_KERNEL(pow_ii, int, int, double, (x == 1 || y == 0) ? 1.0 : (INT_NA2(x, y) ? NAN : pow((double) x, (double) y)))
+BINARY_KERNEL(mod_ii, int, int, int, (INT_NA2(x, y) || y == 0) ? A_NA_INT : int_mod(x, y))
+BINARY_KERNEL(idiv_ii, int, int, int, (INT_NA2(x, y) || y == 0) ? A_NA_INT : int_idiv(x, y))
+
+/* Operations involving reals. Integer arguments are converted element by element inside the loop instead of creating a coerced copy, so each operation has kernels for real/real, integer/real and real/integer arguments. */
+#define I2R(X) (((X) == A_NA_INT) ? NAN : (double) (X))
+
+#define REAL_KERNELS(NAME, TR, EXPR) \
+    BINARY_KERNEL(NAME ## _rr, double, double, TR, EXPR(x, y)) \
+    BINARY_KERNEL(NAME ## _ir, int, double, TR, EXPR(I2R(x), y)) \
+    BINARY_KERNEL(NAME ## _ri, double, int, TR, EXPR(x, I2R(y)))
+
+#define R_ADD(X, Y)  ((X) + (Y))
+#define R_SUB(X, Y)  ((X) - (Y))
+#define R_MUL(X, Y)  ((X) * (Y))
+#define R_DIV(X, Y)  ((X) / (Y))
+#define R_POW(X, Y)  (((X) == 1.0 || (Y) == 0.0) ? 1.0 : (((Y) == 2.0) ? (X) * (X) : pow(X, Y)))
+#define R_MOD(X, Y)  real_mod(X, Y)
+#define R_IDIV(X, Y) floor((X) / (Y))
+
+REAL_KERNELS(add, double, R_ADD)
+REAL_KERNELS(sub, double, R_SUB)
+REAL_KERNELS(mul, double, R_MUL)
+REAL_KERNELS(div, double, R_DIV)
+REAL_KERNELS(pow, double, R_POW)
+REAL_KERNELS(mod, double, R_MOD)
+REAL_KERNELS(idiv, double, R_IDIV)
+
+/* comparisons return logicals */
+#define R_CMP(X, Y, OP) ((isnan(X) || isnan(Y)) ? A_NA_LOGICAL : (bool_t) ((X) OP (Y)))
+#define CMP_KERNELS(NAME, OP) \
+    BINARY_KERNEL(NAME ## _ii, int, int, bool_t, INT_NA2(x, y) ? A_NA_LOGICAL : (bool_t) (x OP y)) \
+    BINARY_KERNEL(NAME ## _rr, double, double, bool_t, R_CMP(x, y, OP)) \
+    BINARY_KERNEL(NAME ## _ir, int, double, bool_t, R_CMP(I2R(x), y, OP)) \
+    BINARY_KERNEL(NAME ## _ri, double, int, bool_t, R_CMP(x, I2R(y), OP))
+
+CMP_KERNELS(eq, ==)
+CMP_KERNELS(ne, !=)
+CMP_KERNELS(lt, <)
+CMP_KERNELS(gt, >)
+CMP_KERNELS(le, <=)
+CMP_KERNELS(ge, >=)
+
+static AGeneric add_generic, sub_generic, mul_generic, div_generic, pow_generic, mod_generic, idiv_generic, eq_generic, ne_generic, lt_generic, gt_generic, le_generic, ge_generic;
+
+/* description of a binary operator: kernels for all combinations of integer and real arguments along with the class of their results (if any argument is real the result class is the same) */
+typedef struct {
+    const char *name;
+    arith_kernel_t ii;
+    AClass **ii_class;
+    arith_kernel_t rr, ir, ri;
+    AClass **rr_class;
+    AGeneric *generic; /* methods for other classes (see dispatch.c) */
+} arith_op_t;
+
+#define REAL_OPS(NAME) NAME ## _rr, NAME ## _ir, NAME ## _ri
+
+static const arith_op_t op_add  = { "+",   add_ii,  &integerClass, REAL_OPS(add),  &realClass, &add_generic };
+static const arith_op_t op_sub  = { "-",   sub_ii,  &integerClass, REAL_OPS(sub),  &realClass, &sub_generic };
+static const arith_op_t op_mul  = { "*",   mul_ii,  &integerClass, REAL_OPS(mul),  &realClass, &mul_generic };
+static const arith_op_t op_div  = { "/",   div_ii,  &realClass,    REAL_OPS(div),  &realClass, &div_generic };
+static const arith_op_t op_pow  = { "^",   pow_ii,  &realClass,    REAL_OPS(pow),  &realClass, &pow_generic };
+static const arith_op_t op_mod  = { "%%",  mod_ii,  &integerClass, REAL_OPS(mod),  &realClass, &mod_generic };
+static const arith_op_t op_idiv = { "%/%", idiv_ii, &integerClass, REAL_OPS(idiv), &realClass, &idiv_generic };
+static const arith_op_t op_eq   = { "==",  eq_ii,   &logicalClass, REAL_OPS(eq),   &logicalClass, &eq_generic };
+static const arith_op_t op_ne   = { "!=",  ne_ii,   &logicalClass, REAL_OPS(ne),   &logicalClass, &ne_generic };
+static const arith_op_t op_lt   = { "<",   lt_ii,   &logicalClass, REAL_OPS(lt),   &logicalClass, &lt_generic };
+static const arith_op_t op_gt   = { ">",   gt_ii,   &logicalClass, REAL_OPS(gt),   &logicalClass, &gt_generic };
+static const arith_op_t op_le   = { "<=",  le_ii,   &logicalClass, REAL_OPS(le),   &logicalClass, &le_generic };
+static const arith_op_t op_ge   = { ">=",  ge_ii,   &logicalClass, REAL_OPS(ge),   &logicalClass, &ge_generic };
+
+#define IS_INTLIKE(O) (CLASS(O) == integerClass || CLASS(O) == logicalClass)
+
+/* Deferred expressions.
+
+   In a chain like a * b + c every operation would write a full-length temporary only for the next one to read it back. So for long vectors arith_binary doesn't run the kernel, it returns a deferred vector that records the kernel and its operands (see ADeferred in aleph.h). Operands can be deferred as well, so chained operations build an expression tree. When the data of the vector is requested the tree is evaluated in blocks of DEFERRED_BLOCK elements: intermediate results only live in block-sized buffers that stay in the cache and the result is the only full-length vector that is written. Afterwards the vector keeps the result and releases its operands.
+
+   Trees are at most DEFERRED_MAX_DEPTH levels deep (deeper operands are materialized first), otherwise loops like x = x + 1 would build unbounded chains. */
+
+#define DEFERRED_BLOCK 1024
+#define DEFERRED_BLOCK_BYTES (DEFERRED_BLOCK * sizeof(double))
+#define DEFERRED_MAX_DEPTH 8
+
+/* results shorter than this are computed right away */
+#ifndef DEFERRED_MIN_LENGTH
+#define DEFERRED_MIN_LENGTH 4096
+#endif
+vlen_t deferred_min_length = DEFERRED_MIN_LENGTH;
+
+static void node_block(AObject *o, vlen_t from, vlen_t n, vlen_t k, void *res, char *scratch);
+
+/* generate elements [from, from + n) of a compact sequence recycled to any length */
+static void compact_block(AObject *o, vlen_t from, vlen_t n, int *res) {
+    ACompactSeq *s = COMPACT_SEQ(o);
+    vlen_t lo = o->len, i, j, r, run;
+    for (i = 0, j = from % lo; i < n; i += run, j = 0) {
+	int v = (int) ((long) s->start + (long) j * s->step);
+	run = lo - j;
+	if (n - i < run) run = n - i;
+	for (r = 0; r < run; r++, v += s->step)
+	    res[i + r] = v;
+    }
+}
+
+/* get elements [from, from + n) of an operand of an expression of length k. Returns a pointer to the elements and sets *len to n (or 1 for scalars which the kernels handle directly). buf has room for DEFERRED_BLOCK elements, scratch is free space behind it */
+static const void *operand_block(AObject *o, vlen_t from, vlen_t n, vlen_t k, char *buf, char *scratch, vlen_t *len) {
+    const char *data;
+    vlen_t lo, i, j, run;
+    size_t es;
+    if (IS_PENDING(o)) {
+	node_block(o, from, n, k, buf, scratch);
+	*len = n;
+	return buf;
+    }
+    if (o->flags & AOF_COMPACT) { /* no need to expand it */
+	compact_block(o, from, n, (int*) buf);
+	*len = n;
+	return buf;
+    }
+    data = (const char*) ADataPtr(o);
+    lo = LENGTH(o);
+    es = ELT_SIZE(o);
+    if (lo == 1) {
+	*len = 1;
+	return data;
+    }
+    *len = n;
+    if (lo == k)
+	return data + es * from;
+    /* recycled operand - copy the block in contiguous runs */
+    for (i = 0, j = from % lo; i < n; i += run, j = 0) {
+	run = lo - j;
+	if (n - i < run) run = n - i;
+	memcpy(buf + es * i, data + es * j, es * run);
+    }
+    return buf;
+}
+
+/* apply a kernel to elements [from, from + n) of its operands, the result goes to res */
+static void binary_block(arith_kernel_t kernel, AObject *left, AObject *right, vlen_t from, vlen_t n, vlen_t k, void *res, char *scratch) {
+    vlen_t m, l;
+    const void *a = operand_block(left, from, n, k, scratch, scratch + DEFERRED_BLOCK_BYTES, &m);
+    const void *b = operand_block(right, from, n, k, scratch + DEFERRED_BLOCK_BYTES, scratch + 2 * DEFERRED_BLOCK_BYTES, &l);
+    kernel(res, a, m, b, l, n);
+}
+
+/* compute elements [from, from + n) of the pending deferred vector o into res */
+static void node_block(AObject *o, vlen_t from, vlen_t n, vlen_t k, void *res, char *scratch) {
+    ADeferred *d = DEFERRED(o);
+    binary_block(d->kernel, d->left, d->right, from, n, k, res, scratch);
+}
+
+/* Long results are computed in parallel chunks of PARALLEL_CHUNK elements (see parallelFor), each worker has its own scratch space */
+#define PARALLEL_CHUNK (16 * DEFERRED_BLOCK)
+
+typedef struct {
+    arith_kernel_t kernel;
+    AObject *left, *right;
+    vlen_t k;
+    char *data, *scratch;
+    size_t es, scratch_size;
+} block_job_t;
+
+static void block_chunk(void *job, vlen_t from, vlen_t to, int worker) {
+    block_job_t *j = (block_job_t*) job;
+    char *scratch = j->scratch + j->scratch_size * worker;
+    vlen_t i, n;
+    for (i = from; i < to; i += n) {
+	n = (to - i < DEFERRED_BLOCK) ? (to - i) : DEFERRED_BLOCK;
+	binary_block(j->kernel, j->left, j->right, i, n, j->k, j->data + j->es * i, scratch);
+    }
+}
+
+/* compute all k elements of kernel(left, right) into data block by block. depth is the depth of the expression (0 if neither operand is pending) */
+static void compute_blocks(arith_kernel_t kernel, AObject *left, AObject *right, vlen_t k, char *data, size_t es, vlen_t depth) {
+    char local[2 * DEFERRED_BLOCK_BYTES];
+    int workers = parallelWorkers(k);
+    block_job_t j = { kernel, left, right, k, data, local, es, DEFERRED_BLOCK_BYTES * (2 * depth + 2) }; /* each level of the tree needs at most two buffers */
+    if (workers > 1 || depth)
+	j.scratch = (char*) Amalloc(j.scratch_size * workers);
+    parallelFor(k, PARALLEL_CHUNK, block_chunk, &j);
+    if (j.scratch != local)
+	free(j.scratch);
+}
+
+/* find an operand in the tree of o that can take its result: a vector that only its node owns, reached through nodes that are only owned by their parent (so nothing outside the tree can see it and it is read only at the positions being written). Returns the reference to it or NULL */
+static AObject **owned_operand(AObject *o, AClass *cls, vlen_t k) {
+    ADeferred *d = DEFERRED(o);
+    AObject **ref[2] = { &d->left, &d->right }, **r;
+    int i;
+    for (i = 0; i < 2; i++)
+	if (reuse_vector(*ref[i], 0, cls, k))
+	    return ref[i];
+    for (i = 0; i < 2; i++)
+	if (IS_PENDING(*ref[i]) && !(*ref[i])->pool && (r = owned_operand(*ref[i], cls, k)))
+	    return r;
+    return 0;
+}
+
+/* dataPtr of deferred vectors: computes the value on first access */
+void *deferred_materialize(AObject *o) {
+    ADeferred *d = DEFERRED(o);
+    if (!d->value) {
+	vlen_t k = o->len;
+	size_t es = ELT_SIZE(o);
+	AObject **owned = arith_reuse ? owned_operand(o, CLASS(o), k) : 0, *res = owned ? *owned : allocVarObject(CLASS(o), es * k, k);
+	compute_blocks(d->kernel, d->left, d->right, k, (char*) DIRECT_DATAPTR(res), es, d->depth);
+	if (owned) { /* move the reference, so it remains single-owned and isn't freed with the tree */
+	    *owned = 0;
+	    d->value = res;
+	} else
+	    set(&d->value, res);
+	set(&d->left, 0);
+	set(&d->right, 0);
+    }
+    return DIRECT_DATAPTR(d->value);
+}
+
+/* depth of an operand in a new expression of length k. Deferred operands of a different length (they are recycled) or ones that are too deep are materialized */
+static vlen_t operand_depth(AObject *o, vlen_t k) {
+    if (!IS_PENDING(o)) return 0;
+    if (o->len != k || DEFERRED(o)->depth >= DEFERRED_MAX_DEPTH) {
+	deferred_materialize(o);
+	return 0;
+    }
+    return DEFERRED(o)->depth;
+}
+
+static AObject *defer_binary(arith_kernel_t kernel, AClass *rc, AObject *left, AObject *right, vlen_t k) {
+    vlen_t dl = operand_depth(left, k), dr = operand_depth(right, k);
+    AObject *res = allocVarObject(rc, sizeof(ADeferred), k);
+    ADeferred *d = DEFERRED(res);
+    res->flags |= AOF_DEFERRED;
+    d->kernel = kernel;
+    d->depth = ((dl > dr) ? dl : dr) + 1;
+    set(&d->left, left);
+    set(&d->right, right);
+    return res;
+}
+
+/* objects of classes derived from the vector classes are converted to plain vectors (the kernels only know those). NULL if o isn't a numeric vector */
+static AObject *arith_operand(AObject *o) {
+    AClass *c = CLASS(o), *base;
+    AObject *res;
+    size_t es;
+    if (c == realClass || IS_INTLIKE(o)) return o;
+    if (isAssignableClass(c, realClass)) base = realClass;
+    else if (isAssignableClass(c, integerClass)) base = integerClass;
+    else if (isAssignableClass(c, logicalClass)) base = logicalClass;
+    else return 0;
+    es = ELT_SIZE_OF(base);
+    res = allocVarObject(base, es * LENGTH(o), LENGTH(o));
+    memcpy(DIRECT_DATAPTR(res), ADataPtr(o), es * LENGTH(o));
+    return res;
+}
+
+/* apply a binary operator to two (evaluated) vectors. Methods defined for the operator take precedence over the built-in arithmetic */
+static AObject *arith_binary(const arith_op_t *op, AObject *left, AObject *right, AObject *where) {
+    int li, ri;
+    vlen_t m, n, k;
+    arith_kernel_t kernel;
+    AClass *rc;
+    AObject *res, *l, *r;
+    if (op->generic->methods) {
+	AObject *a[2] = { left, right }, *method = dispatchMethod(op->generic, a, 2);
+	if (method)
+	    return callMethod(method, a, 2, where);
+    }
+    if (!(l = arith_operand(left)) || !(r = arith_operand(right)))
+	A_error("no method for '%s' %s '%s'", className(left), op->name, className(right));
+    left = l;
+    right = r;
+    li = IS_INTLIKE(left);
+    ri = IS_INTLIKE(right);
+    if (li && ri) {
+	kernel = op->ii;
+	rc = *op->ii_class;
+    } else {
+	kernel = li ? op->ir : (ri ? op->ri : op->rr);
+	rc = *op->rr_class;
+    }
+    m = LENGTH(left); n = LENGTH(right); k = (m && n) ? ((m >= n) ? m : n) : 0;
+    if (k >= deferred_min_length)
+	return defer_binary(kernel, rc, left, right, k);
+    if (!(res = reuse_vector(left, currentPool(), rc, k)) && !(res = reuse_vector(right, currentPool(), rc, k)))
+	res = allocVarObject(rc, ELT_SIZE_OF(rc) * k, k);
+    /* compact sequences are generated block by block instead of being expanded (long vectors end up here if deferring is disabled) */
+    if (((left->flags | right->flags) & AOF_COMPACT) || parallelWorkers(k) > 1)
+	compute_blocks(kernel, left, right, k, (char*) ADataPtr(res), ELT_SIZE(res), 0);
+    else
+	kernel(ADataPtr(res), ADataPtr(left), m, ADataPtr(right), n, k);
+    return res;
+}
+
+/* apply a unary operator (unary is NULL if the operator has no unary form) */
+static AObject *arith_unary(const arith_op_t *op, AObject *x, AObject *(*unary)(AObject *), AObject *where) {
+    AObject *v;
+    if (op->generic->methods && (v = dispatchMethod(op->generic, &x, 1)))
+	return callMethod(v, &x, 1, where);
+    if (!unary) A_error("invalid unary operator '%s'", op->name);
+    if (!(v = arith_operand(x))) A_error("invalid argument to unary operator");
+    return unary(v);
+}
+
+/* evaluate the arguments of an operator call and apply it */
+static AObject *arith_call(const arith_op_t *op, AObject *args, AObject *where, AObject *(*unary)(AObject *)) {
     AObject *left = getAttr(args, AS_head), *right;
     args = getAttr(args, AS_next);
     left = eval(left, where);
-    if (args == nullObject) /* unary + */
-	return left;
-    right = eval(getAttr(args, AS_head), where);
-    /* FIXME: eventually this will use method dispatch ... */
-    if (CLASS(left) != CLASS(right)) {
-	if (CLASS(left) == integerClass && CLASS(right) == realClass)
-	    left = coerce(left, realClass);
-	else if (CLASS(left) == realClass && CLASS(right) == integerClass)
-	    right = coerce(right, realClass);
-	else
-	    A_error("no method for '%s' + '%s'", className(left), className(right));
-    }
-    if (CLASS(left) == CLASS(right)) {
-	if (CLASS(left) == realClass) {
-	    double *a = REAL(left);
-	    double *b = REAL(right);
-	    vlen_t m = LENGTH(left), n = LENGTH(right), k = (m >= n) ? m : n, i;
-	    AObject *res = allocRealVector(k);
-	    double *c = REAL(res);
-	    for (i = 0; i < k; i++) c[i] = a[i % m] + b[i % n];
-	    return res;
-	} else if (CLASS(left) == integerClass) {
-	    int *a = INTEGER(left);
-	    int *b = INTEGER(right);
-	    vlen_t m = LENGTH(left), n = LENGTH(right), k = (m >= n) ? m : n, i;
-	    AObject *res = allocIntVector(k);
-	    int *c = INTEGER(res);
-	    for (i = 0; i < k; i++) c[i] = a[i % m] + b[i % n];
-	    return res;
-	}
-    }
-    A_error("no method for '%s' + '%s'", className(left), className(right));
-    return nullObject;
+    if (args == nullObject)
+	return arith_unary(op, left, unary, where);
+    right = getAttr(args, AS_head);
+    if (CLASS(right) == langClass) /* evaluating a call may drop the owner of the left operand, e.g. x + (x = 5) */
+	pinValue(left);
+    right = eval(right, where);
+    return arith_binary(op, left, right, where);
+}
+
+static AObject *unary_plus(AObject *x) {
+    return x;
+}
+
+typedef struct {
+    const void *x;
+    void *res;
+} unary_job_t;
+
+static void minus_int_chunk(void *job, vlen_t from, vlen_t to, int worker) {
+    const int *s = (const int*) ((unary_job_t*) job)->x;
+    int *d = (int*) ((unary_job_t*) job)->res;
+    vlen_t i;
+    for (i = from; i < to; i++) d[i] = (s[i] == A_NA_INT) ? A_NA_INT : -s[i];
+}
+
+static void minus_real_chunk(void *job, vlen_t from, vlen_t to, int worker) {
+    const double *s = (const double*) ((unary_job_t*) job)->x;
+    double *d = (double*) ((unary_job_t*) job)->res;
+    vlen_t i;
+    for (i = from; i < to; i++) d[i] = -s[i];
+}
+
+static AObject *unary_minus(AObject *x) {
+    vlen_t n = LENGTH(x);
+    AObject *res;
+    unary_job_t j;
+    if (IS_INTLIKE(x)) {
+	j.x = INTEGER(x);
+	if (!(res = reuse_vector(x, currentPool(), integerClass, n)))
+	    res = allocIntVector(n);
+	j.res = INTEGER(res);
+	parallelFor(n, PARALLEL_CHUNK, minus_int_chunk, &j);
+    } else if (CLASS(x) == realClass) {
+	j.x = REAL(x);
+	if (!(res = reuse_vector(x, currentPool(), realClass, n)))
+	    res = allocRealVector(n);
+	j.res = REAL(res);
+	parallelFor(n, PARALLEL_CHUNK, minus_real_chunk, &j);
+    } else
+	return A_error("invalid argument to unary operator");
+    return res;
 }
 
+AObject *fn_add(AObject *args, AObject *where) { return arith_call(&op_add, args, where, unary_plus); }
+AObject *fn_sub(AObject *args, AObject *where) { return arith_call(&op_sub, args, where, unary_minus); }
+AObject *fn_mul(AObject *args, AObject *where) { return arith_call(&op_mul, args, where, 0); }
+AObject *fn_div(AObject *args, AObject *where) { return arith_call(&op_div, args, where, 0); }
+AObject *fn_pow(AObject *args, AObject *where) { return arith_call(&op_pow, args, where, 0); }
+AObject *fn_mod(AObject *args, AObject *where) { return arith_call(&op_mod, args, where, 0); }
+AObject *fn_idiv(AObject *args, AObject *where) { return arith_call(&op_idiv, args, where, 0); }
+AObject *fn_eq(AObject *args, AObject *where) { return arith_call(&op_eq, args, where, 0); }
+AObject *fn_ne(AObject *args, AObject *where) { return arith_call(&op_ne, args, where, 0); }
+AObject *fn_lt(AObject *args, AObject *where) { return arith_call(&op_lt, args, where, 0); }
+AObject *fn_gt(AObject *args, AObject *where) { return arith_call(&op_gt, args, where, 0); }
+AObject *fn_le(AObject *args, AObject *where) { return arith_call(&op_le, args, where, 0); }
+AObject *fn_ge(AObject *args, AObject *where) { return arith_call(&op_ge, args, where, 0); }
+
+/* the operators for compiled code (see bytecode.c) */
+static const struct {
+    AObject *(*fn)(AObject *, AObject *);
+    const arith_op_t *op;
+    AObject *(*unary)(AObject *);
+} arith_natives[] = {
+    { fn_add, &op_add, unary_plus }, { fn_sub, &op_sub, unary_minus }, { fn_mul, &op_mul, 0 }, { fn_div, &op_div, 0 },
+    { fn_pow, &op_pow, 0 }, { fn_mod, &op_mod, 0 }, { fn_idiv, &op_idiv, 0 }, { fn_eq, &op_eq, 0 }, { fn_ne, &op_ne, 0 },
+    { fn_lt, &op_lt, 0 }, { fn_gt, &op_gt, 0 }, { fn_le, &op_le, 0 }, { fn_ge, &op_ge, 0 }
+};
+
+/* index of the operator implemented by the native function fn, -1 if it isn't one */
+int arithOpIndex(void *fn) {
+    int i;
+    for (i = 0; i < sizeof(arith_natives) / sizeof(arith_natives[0]); i++)
+	if ((void*) arith_natives[i].fn == fn) return i;
+    return -1;
+}
+
+/* apply operator op to evaluated arguments, right is NULL for unary calls */
+AObject *arithApply(int op, AObject *left, AObject *right, AObject *where) {
+    if (right)
+	return arith_binary(arith_natives[op].op, left, right, where);
+    return arith_unary(arith_natives[op].op, left, arith_natives[op].unary, where);
+}
+
+/* the operators are generics (see dispatch.c) */
+void arith_init() {
+    int i;
+    for (i = 0; i < sizeof(arith_natives) / sizeof(arith_natives[0]); i++) {
+	arith_natives[i].op->generic->arity = 2;
+	registerGeneric(arith_natives[i].op->generic, newSymbol(arith_natives[i].op->name));
+    }
+}
+
+/* Reductions.
+
+   Sums are computed in chunks of REDUCE_CHUNK elements whose partial sums are added up in order. The chunks are the same whether they are processed serially or in parallel, so the result doesn't depend on the number of workers (floating-point addition is not associative, so a different split would change the last bits). */
+#define REDUCE_CHUNK 4096
+
+typedef struct {
+    const void *x;
+    void *partial; /* one double (reals) or long (integers) per chunk */
+} reduce_job_t;
+
+static void sum_real_chunk(void *job, vlen_t from, vlen_t to, int worker) {
+    const double *x = (const double*) ((reduce_job_t*) job)->x;
+    double s[4] = { 0.0, 0.0, 0.0, 0.0 };
+    vlen_t i;
+    /* independent accumulators, so the additions don't wait for each other */
+    for (i = from; i + 4 <= to; i += 4) {
+	s[0] += x[i]; s[1] += x[i + 1]; s[2] += x[i + 2]; s[3] += x[i + 3];
+    }
+    for (; i < to; i++) s[0] += x[i];
+    ((double*) ((reduce_job_t*) job)->partial)[from / REDUCE_CHUNK] = (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+/* a chunk can't reach LONG_MIN, so it marks chunks with NAs */
+static void sum_int_chunk(void *job, vlen_t from, vlen_t to, int worker) {
+    const int *x = (const int*) ((reduce_job_t*) job)->x;
+    long s = 0;
+    int na = 0;
+    vlen_t i;
+    for (i = from; i < to; i++) {
+	na |= (x[i] == A_NA_INT);
+	s += x[i];
+    }
+    ((long*) ((reduce_job_t*) job)->partial)[from / REDUCE_CHUNK] = na ? LONG_MIN : s;
+}
+
+/* apply a chunked sum to the n elements at x, the partial sums go to partial (which has room for 16 chunks) unless there are more chunks */
+static void *sum_chunks(parallel_fn_t fn, const void *x, vlen_t n, void *partial) {
+    vlen_t chunks = n / REDUCE_CHUNK + ((n % REDUCE_CHUNK) ? 1 : 0);
+    reduce_job_t j = { x, (chunks > 16) ? Amalloc(sizeof(double) * chunks) : partial };
+    parallelFor(n, REDUCE_CHUNK, fn, &j);
+    return j.partial;
+}
+
+static double sum_real(AObject *x) {
+    double buf[16], *partial = (double*) sum_chunks(sum_real_chunk, REAL(x), LENGTH(x), buf), s = 0.0;
+    vlen_t i, chunks = LENGTH(x) / REDUCE_CHUNK + ((LENGTH(x) % REDUCE_CHUNK) ? 1 : 0);
+    for (i = 0; i < chunks; i++) s += partial[i];
+    if (partial != buf) free(partial);
+    return s;
+}
+
+/* sum of an integer or logical vector in *res. Returns 0 if it contains NAs */
+static int sum_int(AObject *x, long *res) {
+    long buf[16], *partial, s = 0;
+    vlen_t i, n = LENGTH(x), chunks;
+    int ok = 1;
+    if (x->flags & AOF_COMPACT) { /* no need to expand it: n (start + last) / 2 where one of the factors is even */
+	long first = COMPACT_SEQ(x)->start, last = first + (long) (n - 1) * COMPACT_SEQ(x)->step;
+	*res = (n & 1) ? (long) n * ((first + last) / 2) : (long) (n / 2) * (first + last);
+	return 1;
+    }
+    partial = (long*) sum_chunks(sum_int_chunk, INTEGER(x), n, buf);
+    chunks = n / REDUCE_CHUNK + ((n % REDUCE_CHUNK) ? 1 : 0);
+    for (i = 0; i < chunks; i++) {
+	if (partial[i] == LONG_MIN) ok = 0;
+	s += partial[i];
+    }
+    if (partial != buf) free(partial);
+    *res = s;
+    return ok;
+}
+
+/* sum(...) - sum of all elements of all arguments. The result is an integer (NA on overflow) unless any argument is real */
+AObject *fn_sum(AObject *args, AObject *where) {
+    long isum = 0;
+    double rsum = 0.0;
+    int real = 0, na = 0;
+    while (args != nullObject) {
+	AObject *x = eval(getAttr(args, AS_head), where);
+	args = getAttr(args, AS_next);
+	if (CLASS(x) == nullClass) /* NULL and empty arguments */
+	    continue;
+	if (CLASS(x) == realClass) {
+	    real = 1;
+	    rsum += sum_real(x);
+	} else if (IS_INTLIKE(x)) {
+	    long s;
+	    if (!sum_int(x, &s)) na = 1;
+	    isum += s;
+	} else
+	    A_error("invalid 'type' (%s) of argument", className(x));
+    }
+    if (real)
+	return ScalarReal(na ? NAN : ((double) isum + rsum));
+    return ScalarInteger((na || isum > INT_MAX || isum <= INT_MIN) ? A_NA_INT : (int) isum);
+}
 
 AObject *fn_seq(AObject *args, AObject *where) {
     vdiff_t s0, s1, step = 1;
-    vlen_t n, i;
+    vlen_t n;
+    double d0, d1, span;
     AObject *left = getAttr(args, AS_head), *right, *res;
     args = getAttr(args, AS_next);
     left = eval(left, where);
@@ -69,21 +639,42 @@ AObject *fn_seq(AObject *args, AObject *where) {
     right = eval(getAttr(args, AS_head), where);
     if (LENGTH(left) != 1 || LENGTH(right) != 1) A_error("both arguments must have the length 1");
     if (CLASS(left) == realClass)
-	s0 = (vlen_t) (REAL(left)[0] + 0.5);
+	d0 = floor(REAL(left)[0] + 0.5);
     else if (CLASS(left) == integerClass)
-	s0 = INTEGER(left)[0];
+	d0 = INTEGER(left)[0];
     else A_error("no method for '%s' : '%s'", className(left), className(right));
     if (CLASS(right) == realClass)
-	s1 = (vlen_t) (REAL(right)[0] + 0.5);
+	d1 = floor(REAL(right)[0] + 0.5);
     else if (CLASS(right) == integerClass)
-	s1 = INTEGER(right)[0];
+	d1 = INTEGER(right)[0];
     else A_error("no method for '%s' : '%s'", className(left), className(right));
-    n = (s0 < s1) ? (s1 - s0) : (s0 - s1);
-    n++;
+    /* the elements are integers, the span is computed in double so bounds far apart cannot overflow */
+    if (!(d0 >= INT_MIN && d0 <= INT_MAX && d1 >= INT_MIN && d1 <= INT_MAX))
+	A_error("sequence bounds must be finite and within the integer range");
+    span = fabs(d1 - d0) + 1.0;
+    if (span > (double) ((vlen_t) -1))
+	A_error("result would be too long a vector");
+    s0 = (vdiff_t) d0;
+    s1 = (vdiff_t) d1;
+    n = (vlen_t) span;
     if (s1 < s0) step = -1;
-    res = allocIntVector(n);
-    int *rv = INTEGER(res);
-    for (i = 0; i < n; i++, s0 += step)
-	rv[i] = s0;
+    if (n == 1)
+	return ScalarInteger(s0);
+    /* the elements are only stored if someone asks for the data */
+    res = allocVarObject(integerClass, sizeof(ACompactSeq), n);
+    res->flags |= AOF_COMPACT;
+    COMPACT_SEQ(res)->start = s0;
+    COMPACT_SEQ(res)->step = step;
     return res;
 }
+
+/* dataPtr of compact sequences: expands the sequence on first access */
+void *compact_materialize(AObject *o) {
+    ACompactSeq *s = COMPACT_SEQ(o);
+    if (!s->value) {
+	AObject *res = allocIntVector(o->len);
+	compact_block(o, 0, o->len, (int*) DIRECT_DATAPTR(res));
+	set(&s->value, res);
+    }
+    return DIRECT_DATAPTR(s->value);
+}
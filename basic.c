@@ -2,10 +2,10 @@
 
 /* assignment */
 AObject *fn_assign(AObject *args, AObject *where) {
-    AObject *name = getAttr(args, newSymbol("head")), *value;
+    AObject *name = getAttr(args, AS_head), *value;
     const char *name_str;
-    args = getAttr(args, newSymbol("next"));
-    value = getAttr(args, newSymbol("head"));
+    args = getAttr(args, AS_next);
+    value = getAttr(args, AS_head);
     if (CLASS(name) == symbolClass)
 	name_str = ((ASymbol*)name)->name;
     else A_error("LHS of an assignment is not a symbol");
@@ -14,3 +14,17 @@ AObject *fn_assign(AObject *args, AObject *where) {
     symbol_set(ASymbol2sym_t(name), value, where);
     return value;
 }
+
+/* { expr; ... } - evaluates the expressions in turn, the value is that of the last one. A break or next stops the evaluation (see control.c) */
+AObject *fn_brace(AObject *args, AObject *where) {
+    ThreadContext *ctx = currentThreadContext();
+    AObject *value = nullObject;
+    for (; args != nullObject && !ctx->control; args = getAttr(args, AS_next))
+	value = eval(getAttr(args, AS_head), where);
+    return value;
+}
+
+/* (expr) */
+AObject *fn_paren(AObject *args, AObject *where) {
+    return eval(getAttr(args, AS_head), where);
+}
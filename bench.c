@@ -0,0 +1,1118 @@
+/* micro-benchmarks of the Aleph core. Build with "make bench" (preferably with optimization, e.g. make bench CFLAGS=-O2) and run
+   ./bench [<name> ...] - without arguments all benchmarks are run */
+
+#include "aleph.h"
+#include "Rcompat.h"
+
+#include <sys/time.h>
+#include <unistd.h>
+
+int alephInitialize(); /* from main.c */
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((double) tv.tv_sec) + ((double) tv.tv_usec) / 1000000.0;
+}
+
+/* symbol interning: the cost of looking up an existing symbol should not depend on the number of symbols in the table.
+   "hot" looks up the same 1000 symbols (typical for an interpreter), "all" spreads lookups over the whole table (so it includes cache misses) */
+static void bench_symbols() {
+    vlen_t sizes[] = { 1000, 10000, 100000, 1000000, 0 }, *n = sizes;
+    vlen_t i, lookups = 1000000, have = 0;
+    char name[32];
+    A_printf("%10s %12s %12s %12s\n", "symbols", "intern[ns]", "hot[ns]", "all[ns]");
+    while (*n) {
+	double t0 = now(), t1, t2, t3;
+	vlen_t added = *n - have;
+	for (i = have; i < *n; i++) {
+	    snprintf(name, sizeof(name), "sym.%u", i);
+	    newSymbol(name);
+	}
+	t1 = now();
+	for (i = 0; i < lookups; i++) {
+	    snprintf(name, sizeof(name), "sym.%u", (i * 7919) % 1000);
+	    if (!newSymbol(name))
+		A_error("lookup failed");
+	}
+	t2 = now();
+	for (i = 0; i < lookups; i++) {
+	    snprintf(name, sizeof(name), "sym.%u", (i * 7919) % *n);
+	    if (!newSymbol(name))
+		A_error("lookup failed");
+	}
+	t3 = now();
+	/* the snprintf() overhead is included in all columns */
+	A_printf("%10u %12.1f %12.1f %12.1f\n", *n, (t1 - t0) * 1e9 / (double) added, (t2 - t1) * 1e9 / (double) lookups, (t3 - t2) * 1e9 / (double) lookups);
+	have = *n;
+	n++;
+    }
+}
+
+/* variable lookup through a chain of environments: symbol_eval() (cached) vs. walking the chain each time */
+static void bench_lookup() {
+    vlen_t depths[] = { 1, 4, 16, 64, 0 }, *d = depths;
+    vlen_t i, n = 10000000;
+    A_printf("%10s %12s %12s\n", "depth", "cached[ns]", "walk[ns]");
+    while (*d) {
+	AObject *env = allocEnv(NULL), *sym = install("bench.x"), *res = 0;
+	double t0, t1, t2;
+	char name[32];
+	symbol_set(ASymbol2sym_t(sym), ScalarInteger(1), env);
+	for (i = 1; i < *d; i++) { /* each level has a few other bindings */
+	    env = allocEnv(env);
+	    snprintf(name, sizeof(name), "bench.y%u", i);
+	    symbol_set(newSymbol(name), nullObject, env);
+	}
+	t0 = now();
+	for (i = 0; i < n; i++)
+	    res = eval(sym, env);
+	t1 = now();
+	for (i = 0; i < n; i++)
+	    res = symbol_get(ASymbol2sym_t(sym), env);
+	t2 = now();
+	if (INTEGER(res)[0] != 1) A_error("invalid lookup result");
+	A_printf("%10u %12.2f %12.2f\n", *d, (t1 - t0) * 1e9 / (double) n, (t2 - t1) * 1e9 / (double) n);
+	d++;
+    }
+}
+
+/* garbage collection: values that were bound to two variables live in the gc pool, so once both are re-assigned only the collector can reclaim them */
+static void bench_gc() {
+    AObject *env = preserveObject(allocEnv(NULL));
+    symbol_t x = newSymbol("bench.x"), y = newSymbol("bench.y");
+    vlen_t i, n = 20000, len = 1000;
+    double t0 = now(), t;
+    for (i = 0; i < n; i++) {
+	AllocationPool *cp = currentPool(), *p = newPool();
+	symbol_set(x, allocIntVector(len), env);
+	symbol_set(y, symbol_get(x, env), env);
+	releasePool(p);
+	currentThreadContext()->pool = cp;
+    }
+    t = now() - t0;
+    A_printf("%u x %u bytes of garbage in %.3fs\n", n, len * (vlen_t) sizeof(int), t);
+    gc_print_stats();
+    releaseObject(env);
+}
+
+/* allocation of short-lived temporaries: a local pool is filled with small objects and released. Compare with a build using -DNURSERY=0 to see the cost of malloc/free */
+static void bench_alloc() {
+    vlen_t i, j, n = 100000, per = 100;
+    double t0 = now(), t;
+    for (i = 0; i < n; i++) {
+	AllocationPool *cp = currentPool(), *p = newPool();
+	for (j = 0; j < per; j++)
+	    if (j & 1)
+		ScalarInteger(j);
+	    else
+		consPairs(pairlistClass, nullObject, nullObject, nullObject);
+	releasePool(p);
+	currentThreadContext()->pool = cp;
+    }
+    t = now() - t0;
+    A_printf("%u objects in %.3fs (%.1f ns per object)\n", n * per, t, t * 1e9 / (double) (n * per));
+    gc_print_stats();
+}
+
+/* slab allocator vs. calloc/free: a working set of small blocks of mixed sizes where blocks are replaced in random order (as objects with different life times would be). Use -DSLAB=0 to see the effect on the other benchmarks */
+static void bench_slab() {
+    vlen_t i, n = 10000000, live = 100000;
+    void **block = (void**) calloc(live, sizeof(void*));
+    unsigned int seed = 1;
+    double t0, t1, t2, t3;
+    for (i = 0; i < live; i++) block[i] = calloc(1, 32 + (i % 8) * 32);
+    t0 = now();
+    for (i = 0; i < n; i++) {
+	vlen_t j = (seed = seed * 1103515245 + 12345) % live;
+	free(block[j]);
+	block[j] = calloc(1, 32 + (i % 8) * 32);
+    }
+    t1 = now();
+    for (i = 0; i < live; i++) {
+	free(block[i]);
+	block[i] = slabAlloc(32 + (i % 8) * 32);
+    }
+    t2 = now();
+    for (i = 0; i < n; i++) {
+	vlen_t j = (seed = seed * 1103515245 + 12345) % live;
+	slabFree(block[j]);
+	block[j] = slabAlloc(32 + (i % 8) * 32);
+    }
+    t3 = now();
+    slab_print_stats();
+    for (i = 0; i < live; i++) slabFree(block[i]);
+    free(block);
+    A_printf("calloc/free: %.1f ns, slab: %.1f ns per block\n", (t1 - t0) * 1e9 / (double) n, (t3 - t2) * 1e9 / (double) n);
+}
+
+/* vectors too large for the nursery (they come from the slab allocator up to SLAB_MAX_SIZE, from malloc above that): a working set held by a list whose elements are replaced in random order */
+static void bench_vectors() {
+    vlen_t i, n = 2000000, live = 10000;
+    unsigned int seed = 1;
+    AllocationPool *cp = currentPool(), *p = newPool();
+    AObject *ws = allocObjectVector(listClass, live);
+    double t0, t;
+    for (i = 0; i < live; i++)
+	SET_VECTOR_ELT(ws, i, allocRealVector(64 + (i % 8) * 56));
+    t0 = now();
+    for (i = 0; i < n; i++) {
+	vlen_t j = (seed = seed * 1103515245 + 12345) % live;
+	SET_VECTOR_ELT(ws, j, allocRealVector(64 + (i % 8) * 56));
+    }
+    t = now() - t0;
+    A_printf("%u vectors of 64..456 doubles in %.3fs (%.1f ns per vector)\n", n, t, t * 1e9 / (double) n);
+    releasePool(p);
+    currentThreadContext()->pool = cp;
+}
+
+/* pool bookkeeping: objects are removed from a pool (as on their first assignment) in random order and added back in a different random order */
+static void bench_pools() {
+    vlen_t sizes[] = { 1000, 10000, 100000, 0 }, *n = sizes;
+    A_printf("%10s %12s %12s\n", "objects", "remove[ns]", "add[ns]");
+    while (*n) {
+	AllocationPool *cp = currentPool(), *p = newPool();
+	AObject **obj = (AObject**) malloc(sizeof(AObject*) * *n);
+	vlen_t *order = (vlen_t*) malloc(sizeof(vlen_t) * *n);
+	vlen_t i, r, rounds = (*n < 1000000) ? 1000000 / *n : 1;
+	unsigned int seed = 1;
+	double t0, t_rm = 0.0, t_add = 0.0;
+	for (i = 0; i < *n; i++) {
+	    obj[i] = ScalarInteger(i);
+	    order[i] = i;
+	}
+	for (r = 0; r < rounds; r++) {
+	    for (i = *n - 1; i > 0; i--) { /* shuffle */
+		vlen_t j = (seed = seed * 1103515245 + 12345) % (i + 1), t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	    }
+	    t0 = now();
+	    for (i = 0; i < *n; i++)
+		removeObjectFromPool(obj[order[i]], obj[order[i]]->pool);
+	    t_rm += now() - t0;
+	    t0 = now();
+	    for (i = 0; i < *n; i++)
+		addObjectToPool(obj[order[(i * 7919) % *n]], p);
+	    t_add += now() - t0;
+	}
+	A_printf("%10u %12.1f %12.1f\n", *n, t_rm * 1e9 / (double) (*n * rounds), t_add * 1e9 / (double) (*n * rounds));
+	free(order);
+	free(obj);
+	releasePool(p);
+	currentThreadContext()->pool = cp;
+	n++;
+    }
+}
+
+/* allocation scopes: (x + 1L) + 2L is evaluated repeatedly, each time in a scope that is left without keeping the result (like the body of a loop). Without scopes all temporaries pile up in the enclosing pool */
+extern AClass *natFnClass; /* from main.c */
+AObject *fn_add(AObject *args, AObject *where); /* from arith.c */
+
+static void bench_scope() {
+    AllocationPool *cp = currentPool(), *hold = newPool();
+    AObject *env = preserveObject(allocEnv(NULL)), *plus = allocVarObject(natFnClass, sizeof(void*), 0), *expr;
+    symbol_t x = newSymbol("bench.x");
+    vlen_t i, n = 1000000, mode;
+    plus->attr[plus->attrs + 1] = (AObject*) fn_add;
+    symbol_set(x, allocIntVector(100), env);
+    expr = LCONS(plus, CONS(LCONS(plus, CONS((AObject*) sym_t2ASymbol(x), CONS(ScalarInteger(1), nullObject))), CONS(ScalarInteger(2), nullObject)));
+    A_printf("%10s %12s %12s\n", "scopes", "time[ns]", "max.pool");
+    for (mode = 0; mode < 2; mode++) {
+	AllocationPool *p = newPool();
+	vlen_t max = 0;
+	double t0 = now(), t;
+	if (mode) plus->flags &= ~AOF_NOSCOPE; else plus->flags |= AOF_NOSCOPE;
+	for (i = 0; i < n; i++) {
+	    if (mode) {
+		AllocationPool *scope = enterScope();
+		eval(expr, env);
+		leaveScope(scope, NULL);
+	    } else
+		eval(expr, env);
+	    if (p->count > max) max = p->count;
+	}
+	t = now() - t0;
+	A_printf("%10s %12.1f %12u\n", mode ? "yes" : "no", t * 1e9 / (double) n, max);
+	releasePool(p);
+	currentThreadContext()->pool = hold;
+    }
+    releaseObject(env);
+    releasePool(hold);
+    currentThreadContext()->pool = cp;
+}
+
+/* arithmetic: fn_add vs. the loop it used to have (c[i] = a[i %% m] + b[i %% n]) on real vectors - equal lengths, vector + scalar and recycling of a vector of length 10 */
+static AObject *old_add(AObject *left, AObject *right) {
+    double *a = REAL(left), *b = REAL(right);
+    vlen_t m = LENGTH(left), n = LENGTH(right), k = (m >= n) ? m : n, i;
+    AObject *res = allocRealVector(k);
+    double *c = REAL(res);
+    for (i = 0; i < k; i++) c[i] = a[i % m] + b[i % n];
+    return res;
+}
+
+static void bench_arith() {
+    vlen_t sizes[] = { 1000, 10000, 100000, 1000000, 10000000, 100000000, 0 }, *n = sizes;
+    A_printf("%10s %10s %10s %10s %10s %10s %10s   [ns per element]\n", "length", "old.eq", "new.eq", "old.scal", "new.scal", "old.rec", "new.rec");
+    while (*n) {
+	AllocationPool *cp = currentPool(), *p = newPool();
+	vlen_t i, r, rounds = (*n < 100000000) ? 100000000 / *n : 1, lens[3] = { *n, 1, 10 };
+	AObject *a = allocRealVector(*n);
+	double t[6];
+	for (i = 0; i < *n; i++) REAL(a)[i] = (double) i;
+	for (i = 0; i < 3; i++) {
+	    AObject *b = allocRealVector(lens[i]), *args;
+	    double t0;
+	    vlen_t j;
+	    for (j = 0; j < lens[i]; j++) REAL(b)[j] = 0.5;
+	    args = CONS(a, CONS(b, nullObject));
+	    t0 = now();
+	    for (r = 0; r < rounds; r++) {
+		AllocationPool *s = enterScope();
+		old_add(a, b);
+		leaveScope(s, NULL);
+	    }
+	    t[i * 2] = now() - t0;
+	    t0 = now();
+	    for (r = 0; r < rounds; r++) {
+		AllocationPool *s = enterScope();
+		ADataPtr(fn_add(args, nullObject)); /* long results are deferred - force them */
+		leaveScope(s, NULL);
+	    }
+	    t[i * 2 + 1] = now() - t0;
+	}
+	A_printf("%10u", *n);
+	for (i = 0; i < 6; i++)
+	    A_printf(" %10.3f", t[i] * 1e9 / (double) (*n) / (double) rounds);
+	A_printf("\n");
+	releasePool(p);
+	currentThreadContext()->pool = cp;
+	n++;
+    }
+}
+
+/* mixed arithmetic: integer + real, coercing the integer vector first (as fn_add used to) vs. converting inside the kernel */
+AObject *coerce(AObject *obj, AClass *cls); /* from arith.c */
+
+static void bench_mixed() {
+    vlen_t sizes[] = { 1000, 100000, 10000000, 0 }, *n = sizes;
+    A_printf("%10s %12s %12s   [ns per element]\n", "length", "coerce", "mixed");
+    while (*n) {
+	AllocationPool *cp = currentPool(), *p = newPool();
+	vlen_t i, r, rounds = 100000000 / *n;
+	AObject *a = allocIntVector(*n), *b = allocRealVector(*n), *args;
+	double t0, t1, t2;
+	for (i = 0; i < *n; i++) {
+	    INTEGER(a)[i] = i;
+	    REAL(b)[i] = 0.5;
+	}
+	args = CONS(a, CONS(b, nullObject));
+	t0 = now();
+	for (r = 0; r < rounds; r++) {
+	    AllocationPool *s = enterScope();
+	    ADataPtr(fn_add(CONS(coerce(a, realClass), CONS(b, nullObject)), nullObject));
+	    leaveScope(s, NULL);
+	}
+	t1 = now();
+	for (r = 0; r < rounds; r++) {
+	    AllocationPool *s = enterScope();
+	    ADataPtr(fn_add(args, nullObject));
+	    leaveScope(s, NULL);
+	}
+	t2 = now();
+	A_printf("%10u %12.3f %12.3f\n", *n, (t1 - t0) * 1e9 / 1e8, (t2 - t1) * 1e9 / 1e8);
+	releasePool(p);
+	currentThreadContext()->pool = cp;
+	n++;
+    }
+}
+
+/* fused expressions: a * b + c * d + e on real vectors evaluated one operation at a time (each writes a full-length temporary) vs. deferred and computed in one blocked pass */
+AObject *fn_mul(AObject *args, AObject *where); /* from arith.c */
+extern vlen_t deferred_min_length; /* from arith.c */
+
+static AObject *bench_binary(AObject *(*fn)(AObject *, AObject *), AObject *a, AObject *b) {
+    return fn(CONS(a, CONS(b, nullObject)), nullObject);
+}
+
+static void bench_fused() {
+    vlen_t sizes[] = { 10000, 100000, 1000000, 10000000, 0 }, *n = sizes, min_length = deferred_min_length;
+    A_printf("%10s %12s %12s   [ns per element]\n", "length", "eager", "fused");
+    while (*n) {
+	AllocationPool *cp = currentPool(), *p = newPool();
+	vlen_t i, r, mode, rounds = 100000000 / *n;
+	AObject *v[5];
+	double t[2];
+	for (i = 0; i < 5; i++) {
+	    vlen_t j;
+	    v[i] = preserveObject(allocRealVector(*n)); /* operands of deferred vectors become owned by them, so they must not live in p */
+	    for (j = 0; j < *n; j++) REAL(v[i])[j] = (double) (i + j);
+	}
+	for (mode = 0; mode < 2; mode++) {
+	    double t0 = now();
+	    deferred_min_length = mode ? min_length : (vlen_t) -1;
+	    for (r = 0; r < rounds; r++) {
+		AllocationPool *s = enterScope();
+		AObject *ab = bench_binary(fn_mul, v[0], v[1]), *cd = bench_binary(fn_mul, v[2], v[3]);
+		ADataPtr(bench_binary(fn_add, bench_binary(fn_add, ab, cd), v[4]));
+		leaveScope(s, NULL);
+	    }
+	    t[mode] = now() - t0;
+	}
+	deferred_min_length = min_length;
+	for (i = 0; i < 5; i++) releaseObject(v[i]);
+	A_printf("%10u %12.3f %12.3f\n", *n, t[0] * 1e9 / 1e8, t[1] * 1e9 / 1e8);
+	releasePool(p);
+	currentThreadContext()->pool = cp;
+	n++;
+    }
+}
+
+/* compact sequences: 1:n + 1L with the sequence expanded first (as fn_seq used to) vs. a compact sequence generated inside the kernel. The first column is the time to create 1:n */
+AObject *fn_seq(AObject *args, AObject *where); /* from arith.c */
+
+static void bench_seq() {
+    vlen_t sizes[] = { 1000, 100000, 10000000, 0 }, *n = sizes;
+    A_printf("%10s %12s %12s %12s   [ns per element]\n", "length", "create[ns]", "expanded", "compact");
+    while (*n) {
+	AllocationPool *cp = currentPool(), *p = newPool();
+	vlen_t i, r, rounds = 100000000 / *n;
+	AObject *one = ScalarInteger(1), *range = CONS(one, CONS(ScalarInteger((int) *n), nullObject));
+	double t0, t1, t2, t3;
+	t0 = now();
+	for (r = 0; r < 1000000; r++) {
+	    AllocationPool *s = enterScope();
+	    fn_seq(range, nullObject);
+	    leaveScope(s, NULL);
+	}
+	t1 = now();
+	for (r = 0; r < rounds; r++) {
+	    AllocationPool *s = enterScope();
+	    AObject *x = allocIntVector(*n);
+	    int *xi = INTEGER(x);
+	    for (i = 0; i < *n; i++) xi[i] = (int) i + 1;
+	    ADataPtr(fn_add(CONS(x, CONS(one, nullObject)), nullObject));
+	    leaveScope(s, NULL);
+	}
+	t2 = now();
+	for (r = 0; r < rounds; r++) {
+	    AllocationPool *s = enterScope();
+	    ADataPtr(fn_add(CONS(fn_seq(range, nullObject), CONS(one, nullObject)), nullObject));
+	    leaveScope(s, NULL);
+	}
+	t3 = now();
+	A_printf("%10u %12.1f %12.3f %12.3f\n", *n, (t1 - t0) * 1e9 / 1e6, (t2 - t1) * 1e9 / 1e8, (t3 - t2) * 1e9 / 1e8);
+	releasePool(p);
+	currentThreadContext()->pool = cp;
+	n++;
+    }
+}
+
+/* mapped vectors: getting the sum of a file of doubles by reading it into a vector vs. mapping it (the file is in the page cache in both cases). "ready" is the time until the vector can be used */
+AObject *mapVector(const char *file, AClass *cls, int copy_on_write); /* from mapped.c */
+
+static void bench_mmap() {
+    vlen_t sizes[] = { 100000, 1000000, 10000000, 0 }, *n = sizes;
+    const char *file = "bench-mmap.tmp";
+    A_printf("%10s %12s %12s %12s %12s   [ms]\n", "length", "read.ready", "read.sum", "mmap.ready", "mmap.sum");
+    while (*n) {
+	AllocationPool *cp = currentPool(), *p = newPool();
+	vlen_t i, mode;
+	double t[4], sum[2];
+	FILE *f = fopen(file, "wb");
+	if (!f) A_error("cannot create %s", file);
+	for (i = 0; i < *n; i++) {
+	    double d = (double) i;
+	    fwrite(&d, sizeof(d), 1, f);
+	}
+	fclose(f);
+	for (mode = 0; mode < 2; mode++) {
+	    double t0 = now(), *d;
+	    AObject *v;
+	    if (mode)
+		v = mapVector(file, realClass, 0);
+	    else {
+		v = allocRealVector(*n);
+		f = fopen(file, "rb");
+		if (fread(REAL(v), sizeof(double), *n, f) != *n) A_error("read error");
+		fclose(f);
+	    }
+	    t[mode * 2] = now() - t0;
+	    d = REAL(v);
+	    for (i = 0, sum[mode] = 0.0; i < *n; i++) sum[mode] += d[i];
+	    t[mode * 2 + 1] = now() - t0;
+	}
+	if (sum[0] != sum[1]) A_error("mapped vector has different contents");
+	A_printf("%10u %12.3f %12.3f %12.3f %12.3f\n", *n, t[0] * 1e3, t[1] * 1e3, t[2] * 1e3, t[3] * 1e3);
+	releasePool(p);
+	currentThreadContext()->pool = cp;
+	n++;
+    }
+    unlink(file);
+}
+
+/* serialization: a parsed program (language objects) saved and loaded again vs. parsing its source, and a large real vector which is loaded without copying. Round trips are checked by saving the loaded object again - the files must be identical */
+AObject *parsingTest(FILE *f); /* from gram.y */
+void saveObject(AObject *o, const char *file); /* from serialize.c */
+AObject *loadObject(const char *file); /* from serialize.c */
+
+static size_t file_size(const char *file) {
+    FILE *f = fopen(file, "rb");
+    size_t n;
+    fseek(f, 0, SEEK_END);
+    n = (size_t) ftell(f);
+    fclose(f);
+    return n;
+}
+
+static int same_files(const char *a, const char *b) {
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    int ca, cb;
+    do {
+	ca = fgetc(fa);
+	cb = fgetc(fb);
+    } while (ca == cb && ca != EOF);
+    fclose(fa);
+    fclose(fb);
+    return ca == cb;
+}
+
+static void bench_serialize() {
+    const char *src = "bench-src.tmp", *ser = "bench-ser.tmp", *ser2 = "bench-ser2.tmp";
+    AllocationPool *cp = currentPool(), *p = newPool();
+    vlen_t i, n = 20000, r, rounds = 5;
+    size_t src_size, ser_size;
+    double t0, t_parse, t_save, t_load;
+    AObject *prog = allocObjectVector(listClass, n), *env, *v;
+    FILE *f = fopen(src, "w");
+    for (i = 0; i < n; i++)
+	fprintf(f, "x%u = a * %u + b %%%% %uL - foo(c, %u.5, \"str%u\", y <= z)\n", i % 100, i, i % 7 + 1, i, i);
+    fclose(f);
+    src_size = file_size(src);
+
+    /* only parsing and loading are timed, not the release of the previous results */
+    for (r = 0, t_parse = 0.0; r < rounds; r++) {
+	AllocationPool *s = enterScope();
+	AObject *res = allocObjectVector(listClass, n);
+	t0 = now();
+	f = fopen(src, "r");
+	for (i = 0; i < n; i++)
+	    SET_VECTOR_ELT(res, i, parsingTest(f));
+	fclose(f);
+	t_parse += now() - t0;
+	if (!r) {
+	    for (i = 0; i < n; i++)
+		SET_VECTOR_ELT(prog, i, VECTOR_ELT(res, i));
+	}
+	leaveScope(s, NULL);
+    }
+    t_parse /= rounds;
+
+    t0 = now();
+    for (r = 0; r < rounds; r++)
+	saveObject(prog, ser);
+    t_save = (now() - t0) / rounds;
+    ser_size = file_size(ser);
+    for (r = 0, t_load = 0.0; r < rounds; r++) {
+	AllocationPool *s = enterScope();
+	t0 = now();
+	loadObject(ser);
+	t_load += now() - t0;
+	leaveScope(s, NULL);
+    }
+    t_load /= rounds;
+    saveObject(loadObject(ser), ser2);
+    A_printf("program: %u expressions, source %.1f MB, serialized %.1f MB, round trip %s\n", n, src_size / 1048576.0, ser_size / 1048576.0, same_files(ser, ser2) ? "ok" : "FAILED");
+    A_printf("%10s %10s %10s %10s\n", "", "parse", "save", "load");
+    A_printf("%10s %10.2f %10.2f %10.2f\n", "ms", t_parse * 1e3, t_save * 1e3, t_load * 1e3);
+    A_printf("%10s %10.1f %10s %10.1f   [source MB/s]\n", "MB/s", src_size / 1048576.0 / t_parse, "", src_size / 1048576.0 / t_load);
+
+    /* environments with a cycle and a large vector */
+    env = allocEnv(NULL);
+    v = allocRealVector(10000000);
+    for (i = 0; i < 10000000; i++) REAL(v)[i] = (double) i;
+    symbol_set(newSymbol("v"), v, env);
+    symbol_set(newSymbol("self"), env, env);
+    symbol_set(newSymbol("prog"), prog, env);
+    t0 = now();
+    saveObject(env, ser);
+    t_save = now() - t0;
+    t0 = now();
+    v = symbol_get(newSymbol("v"), loadObject(ser));
+    t_load = now() - t0;
+    saveObject(loadObject(ser), ser2);
+    A_printf("environment with 1e7 reals: save %.2f ms, load %.3f ms, v[1e7] = %.0f, round trip %s\n", t_save * 1e3, t_load * 1e3, REAL(v)[9999999], same_files(ser, ser2) ? "ok" : "FAILED");
+    unlink(src);
+    unlink(ser);
+    unlink(ser2);
+    releasePool(p);
+    currentThreadContext()->pool = cp;
+}
+
+/* re-use of temporaries: -x * 2 + 1 - x / 3 evaluated as a call (so each operation gets the previous result as a temporary) with every operation allocating its result vs. writing over a temporary. Short vectors are computed right away, long ones are deferred and the result goes into the storage of -x */
+AObject *fn_sub(AObject *args, AObject *where); /* from arith.c */
+AObject *fn_div(AObject *args, AObject *where); /* from arith.c */
+extern int arith_reuse; /* from arith.c */
+
+static AObject *bench_fn(AObject *(*ptr)(AObject *, AObject *)) {
+    AObject *fn = allocVarObject(natFnClass, sizeof(void*), 0);
+    fn->attr[fn->attrs + 1] = (AObject*) ptr;
+    return fn;
+}
+
+static AObject *bench_call(AObject *fn, AObject *a, AObject *b) {
+    return LCONS(fn, b ? CONS(a, CONS(b, nullObject)) : CONS(a, nullObject));
+}
+
+static void bench_reuse() {
+    vlen_t sizes[] = { 100, 1000, 4000, 100000, 1000000, 0 }, *n = sizes;
+    AllocationPool *cp = currentPool(), *hold = newPool();
+    AObject *env = preserveObject(allocEnv(NULL)), *add = bench_fn(fn_add), *sub = bench_fn(fn_sub), *mul = bench_fn(fn_mul), *div = bench_fn(fn_div), *expr;
+    symbol_t x = newSymbol("bench.x");
+    AObject *sx = (AObject*) sym_t2ASymbol(x);
+    /* ((-x * 2) + 1) - (x / 3) */
+    expr = bench_call(sub, bench_call(add, bench_call(mul, bench_call(sub, sx, 0), ScalarReal(2.0)), ScalarReal(1.0)), bench_call(div, sx, ScalarReal(3.0)));
+    A_printf("%10s %12s %12s   [ns per element]\n", "length", "allocate", "reuse");
+    while (*n) {
+	vlen_t i, r, mode, rounds = 100000000 / *n;
+	AObject *v = allocRealVector(*n);
+	double t[2];
+	for (i = 0; i < *n; i++) REAL(v)[i] = (double) i;
+	symbol_set(x, v, env);
+	for (mode = 0; mode < 2; mode++) {
+	    double t0 = now();
+	    arith_reuse = (int) mode;
+	    for (r = 0; r < rounds; r++) {
+		AllocationPool *s = enterScope();
+		ADataPtr(eval(expr, env));
+		leaveScope(s, NULL);
+	    }
+	    t[mode] = now() - t0;
+	}
+	arith_reuse = 1;
+	A_printf("%10u %12.3f %12.3f\n", *n, t[0] * 1e9 / 1e8, t[1] * 1e9 / 1e8);
+	n++;
+    }
+    releaseObject(env);
+    releasePool(hold);
+    currentThreadContext()->pool = cp;
+}
+
+/* threads: (x + 1) + 2 on an integer vector of length 100 in a shared environment, evaluated n times by the main thread alone vs. split over 1, 2, 4 and 8 threads. The main thread run doesn't pay for synchronization, the run with one thread shows its cost, the others how evaluation scales with the number of cores */
+static AObject *thread_expr, *thread_env;
+
+static AObject *bench_thread(AObject *arg) {
+    vlen_t i, n = (vlen_t) INTEGER(arg)[0];
+    for (i = 0; i < n; i++) {
+	AllocationPool *s = enterScope();
+	eval(thread_expr, thread_env);
+	leaveScope(s, NULL);
+    }
+    return arg;
+}
+
+static void bench_threads() {
+    AllocationPool *cp = currentPool(), *hold = newPool();
+    AObject *plus = allocVarObject(natFnClass, sizeof(void*), 0);
+    symbol_t x = newSymbol("bench.x");
+    vlen_t i, n = 2000000, counts[] = { 0, 1, 2, 4, 8 }, c;
+    thread_env = preserveObject(allocEnv(NULL));
+    plus->attr[plus->attrs + 1] = (AObject*) fn_add;
+    symbol_set(x, allocIntVector(100), thread_env);
+    thread_expr = preserveObject(LCONS(plus, CONS(LCONS(plus, CONS((AObject*) sym_t2ASymbol(x), CONS(ScalarInteger(1), nullObject))), CONS(ScalarInteger(2), nullObject))));
+    A_printf("%10s %12s %12s\n", "threads", "time[ms]", "evals/us");
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+	AllocationPool *p = newPool();
+	double t0 = now(), t;
+	if (!counts[c])
+	    bench_thread(ScalarInteger((int) n));
+	else {
+	    AThread *th[8];
+	    for (i = 0; i < counts[c]; i++)
+		th[i] = startThread(bench_thread, ScalarInteger((int) (n / counts[c])));
+	    for (i = 0; i < counts[c]; i++)
+		if (!joinThread(th[i]))
+		    A_printf("thread %u failed\n", i);
+	}
+	t = now() - t0;
+	if (counts[c]) A_printf("%10u", counts[c]); else A_printf("%10s", "main");
+	A_printf(" %12.1f %12.2f\n", t * 1e3, (double) n / t / 1e6);
+	releasePool(p);
+	currentThreadContext()->pool = hold;
+    }
+    releaseObject(thread_expr);
+    releaseObject(thread_env);
+    releasePool(hold);
+    currentThreadContext()->pool = cp;
+}
+
+/* parallel kernels: a * b + c (deferred, computed in one pass) and sum(a) on real vectors with 1 to 8 workers. The sums must be the same for all worker counts */
+AObject *fn_sum(AObject *args, AObject *where); /* from arith.c */
+
+static void bench_parallel() {
+    vlen_t sizes[] = { 1000000, 10000000, 0 }, *n = sizes;
+    int workers[] = { 1, 2, 4, 8 }, saved = parallel_workers;
+    A_printf("%10s %8s %12s %12s %12s %12s\n", "length", "workers", "fused[ms]", "speedup", "sum[ms]", "speedup");
+    while (*n) {
+	AllocationPool *cp = currentPool(), *p = newPool();
+	vlen_t i, r, w, rounds = 100000000 / *n;
+	AObject *v[3];
+	double base[2] = { 0.0, 0.0 }, first = 0.0;
+	for (i = 0; i < 3; i++) {
+	    vlen_t j;
+	    v[i] = preserveObject(allocRealVector(*n));
+	    for (j = 0; j < *n; j++) REAL(v[i])[j] = 1.0 / (double) (i + j + 1);
+	}
+	for (w = 0; w < sizeof(workers) / sizeof(workers[0]); w++) {
+	    double t[2], t0 = now(), s = 0.0;
+	    parallel_workers = workers[w];
+	    for (r = 0; r < rounds; r++) {
+		AllocationPool *sc = enterScope();
+		ADataPtr(bench_binary(fn_add, bench_binary(fn_mul, v[0], v[1]), v[2]));
+		leaveScope(sc, NULL);
+	    }
+	    t[0] = now() - t0;
+	    t0 = now();
+	    for (r = 0; r < rounds; r++) {
+		AllocationPool *sc = enterScope();
+		s = REAL(fn_sum(CONS(v[0], nullObject), nullObject))[0];
+		leaveScope(sc, NULL);
+	    }
+	    t[1] = now() - t0;
+	    if (!w) {
+		base[0] = t[0];
+		base[1] = t[1];
+		first = s;
+	    } else if (s != first)
+		A_printf("sum differs: %.17g vs %.17g\n", s, first);
+	    A_printf("%10u %8d %12.2f %12.2f %12.2f %12.2f\n", *n, workers[w], t[0] * 1e3 / rounds, base[0] / t[0], t[1] * 1e3 / rounds, base[1] / t[1]);
+	}
+	parallel_workers = saved;
+	for (i = 0; i < 3; i++) releaseObject(v[i]);
+	releasePool(p);
+	currentThreadContext()->pool = cp;
+	n++;
+    }
+}
+
+/* bytecode: expressions on scalars (so the time is spent in the evaluator, not in the operations) evaluated by walking the tree vs. compiled. The last one calls a function the compiler doesn't know, so it is called with its arguments as usual */
+AObject *fn_assign(AObject *args, AObject *where); /* from basic.c */
+AObject *fn_mod(AObject *args, AObject *where); /* from arith.c */
+
+static void bench_bytecode() {
+    const char *exprs[] = { "x + 1", "x * 2 + 1 - x / 3", "y = -x * 2 + x %% 3", "a + b + c + d + e + f + g + h", "sum(x, 1) * 2", 0 }, **e = exprs;
+    const char *vars[] = { "x", "a", "b", "c", "d", "e", "f", "g", "h", 0 }, **v;
+    AllocationPool *cp = currentPool(), *hold = newPool();
+    AObject *env = preserveObject(allocEnv(NULL)), *assign = bench_fn(fn_assign);
+    vlen_t r, rounds = 2000000;
+    assign->flags |= AOF_NOSCOPE; /* as in main.c */
+    symbol_set(newSymbol("+"), bench_fn(fn_add), env);
+    symbol_set(newSymbol("-"), bench_fn(fn_sub), env);
+    symbol_set(newSymbol("*"), bench_fn(fn_mul), env);
+    symbol_set(newSymbol("/"), bench_fn(fn_div), env);
+    symbol_set(newSymbol("%%"), bench_fn(fn_mod), env);
+    symbol_set(newSymbol("sum"), bench_fn(fn_sum), env);
+    symbol_set(newSymbol("="), assign, env);
+    for (v = vars; *v; v++)
+	symbol_set(newSymbol(*v), ScalarReal(2.5), env);
+    A_printf("%-32s %12s %12s %10s\n", "expression", "tree[ns]", "bytecode[ns]", "speedup");
+    while (*e) {
+	AllocationPool *p = newPool();
+	char src[128];
+	FILE *f = fmemopen(src, snprintf(src, sizeof(src), "%s\n", *e), "r"); /* the parser needs the end of the line */
+	AObject *tree = parsingTest(f), *bc = compileExpr(tree, env);
+	double t0, t[2];
+	int mode;
+	fclose(f);
+	for (mode = 0; mode < 2; mode++) {
+	    AObject *x = mode ? bc : tree;
+	    t0 = now();
+	    for (r = 0; r < rounds; r++) {
+		AllocationPool *s = enterScope();
+		eval(x, env);
+		leaveScope(s, NULL);
+	    }
+	    t[mode] = now() - t0;
+	}
+	A_printf("%-32s %12.1f %12.1f %10.2f\n", *e, t[0] * 1e9 / rounds, t[1] * 1e9 / rounds, t[0] / t[1]);
+	releasePool(p);
+	currentThreadContext()->pool = hold;
+	e++;
+    }
+    releaseObject(env);
+    releasePool(hold);
+    currentThreadContext()->pool = cp;
+}
+
+static AObject *bench_parse(const char *expr) {
+    char src[128];
+    FILE *f = fmemopen(src, snprintf(src, sizeof(src), "%s\n", expr), "r");
+    AObject *res = parsingTest(f);
+    fclose(f);
+    return res;
+}
+
+extern AObject *fn_function(AObject *args, AObject *where); /* from closure.c */
+
+/* a call of a closure against evaluating its body inline and against binding the arguments in an environment one by one */
+static void bench_closures() {
+    const char *calls[][2] = {
+	{ "f(x, 1)", "x + 1" },
+	{ "f(b = 1, a = x)", "x + 1" },
+	{ "g(x)", "x + 2" },
+	{ "h(x, 1, 2)", "x + 1" },
+	{ 0, 0 } };
+    const char *defs[] = { "f = function(a, b) a + b", "g = function(a, b = 2) a + b", "h = function(a, ...) a + 1", 0 }, **d;
+    AllocationPool *cp = currentPool(), *hold = newPool();
+    AObject *env = preserveObject(allocEnv(NULL)), *assign = bench_fn(fn_assign);
+    symbol_t formals[2] = { newSymbol("a"), newSymbol("b") };
+    vlen_t r, rounds = 1000000;
+    int i;
+    assign->flags |= AOF_NOSCOPE;
+    symbol_set(newSymbol("+"), bench_fn(fn_add), env);
+    symbol_set(newSymbol("="), assign, env);
+    symbol_set(newSymbol("function"), bench_fn(fn_function), env);
+    symbol_set(newSymbol("x"), ScalarReal(2.5), env);
+    for (d = defs; *d; d++)
+	eval(bench_parse(*d), env);
+    A_printf("%-20s %12s %12s %12s\n", "call", "inline[ns]", "env[ns]", "closure[ns]");
+    for (i = 0; calls[i][0]; i++) {
+	AllocationPool *p = newPool();
+	AObject *call = bench_parse(calls[i][0]), *body = bench_parse(calls[i][1]), *ab = bench_parse("a + b");
+	AObject *x = (AObject*) sym_t2ASymbol(newSymbol("x")), *one = ScalarReal(1.0);
+	double t0, t[3];
+	t0 = now();
+	for (r = 0; r < rounds; r++) {
+	    AllocationPool *s = enterScope();
+	    eval(body, env);
+	    leaveScope(s, NULL);
+	}
+	t[0] = now() - t0;
+	t0 = now(); /* what a call costs when the arguments are bound by name in a fresh environment */
+	for (r = 0; r < rounds; r++) {
+	    AllocationPool *s = enterScope();
+	    AObject *e = allocEnv(env);
+	    symbol_set(formals[0], eval(x, env), e);
+	    symbol_set(formals[1], eval(one, env), e);
+	    eval(ab, e);
+	    leaveScope(s, NULL);
+	}
+	t[1] = now() - t0;
+	t0 = now();
+	for (r = 0; r < rounds; r++) {
+	    AllocationPool *s = enterScope();
+	    eval(call, env);
+	    leaveScope(s, NULL);
+	}
+	t[2] = now() - t0;
+	A_printf("%-20s %12.1f %12.1f %12.1f\n", calls[i][0], t[0] * 1e9 / rounds, t[1] * 1e9 / rounds, t[2] * 1e9 / rounds);
+	releasePool(p);
+	currentThreadContext()->pool = hold;
+    }
+    releaseObject(env);
+    releasePool(hold);
+    currentThreadContext()->pool = cp;
+}
+
+AObject *fn_brace(AObject *args, AObject *where); /* from basic.c */
+AObject *fn_lt(AObject *args, AObject *where); /* from arith.c */
+AObject *fn_gt(AObject *args, AObject *where); /* from arith.c */
+AObject *fn_if(AObject *args, AObject *where); /* from control.c */
+AObject *fn_for(AObject *args, AObject *where); /* from control.c */
+AObject *fn_while(AObject *args, AObject *where); /* from control.c */
+AObject *fn_break(AObject *args, AObject *where); /* from control.c */
+
+/* time per iteration of loops and the number of objects they allocate per iteration */
+static void bench_loops() {
+    const char *loops[] = { "for (i in 1:n) i", "for (i in 1:n) s = s + i", "for (i in 1:n) s = i", "for (i in 1:n) { if (i > n) break }", "while (k < n) k = k + 1", 0 }, **l;
+    AllocationPool *cp = currentPool(), *hold = newPool();
+    AObject *env = preserveObject(allocEnv(NULL)), *assign = bench_fn(fn_assign);
+    ANursery *nursery = &currentThreadContext()->nursery;
+    int n = 1000000;
+    assign->flags |= AOF_NOSCOPE;
+    symbol_set(newSymbol("+"), bench_fn(fn_add), env);
+    symbol_set(newSymbol("<"), bench_fn(fn_lt), env);
+    symbol_set(newSymbol(">"), bench_fn(fn_gt), env);
+    symbol_set(newSymbol(":"), bench_fn(fn_seq), env);
+    symbol_set(newSymbol("{"), bench_fn(fn_brace), env);
+    symbol_set(newSymbol("if"), bench_fn(fn_if), env);
+    symbol_set(newSymbol("for"), bench_fn(fn_for), env);
+    symbol_set(newSymbol("while"), bench_fn(fn_while), env);
+    symbol_set(newSymbol("break"), bench_fn(fn_break), env);
+    symbol_set(newSymbol("="), assign, env);
+    symbol_set(newSymbol("n"), ScalarInteger(n), env);
+    A_printf("%-40s %12s %14s\n", "loop", "ns/iter", "objects/iter");
+    for (l = loops; *l; l++) {
+	AllocationPool *p = newPool();
+	AObject *loop = bench_parse(*l);
+	vsize_t objects;
+	double t0;
+	symbol_set(newSymbol("s"), ScalarInteger(0), env);
+	symbol_set(newSymbol("k"), ScalarInteger(0), env);
+	objects = nursery->objects;
+	t0 = now();
+	eval(loop, env);
+	t0 = now() - t0;
+	A_printf("%-40s %12.1f %14.2f\n", *l, t0 * 1e9 / n, (double) (nursery->objects - objects) / n);
+	releasePool(p);
+	currentThreadContext()->pool = hold;
+    }
+    releaseObject(env);
+    releasePool(hold);
+    currentThreadContext()->pool = cp;
+}
+
+/* method lookup through the dispatch cache against resolving the method every time (as the superclass walk did), for classes at increasing depth below the classes the methods are defined for */
+static void bench_dispatch() {
+    AllocationPool *cp = currentPool(), *hold = newPool();
+    AGeneric *g = findGeneric(newSymbol("benchGeneric"), 1);
+    AClass *base[4], *cls, *sig[DISPATCH_MAX_ARGS];
+    AObject *fn = bench_fn(fn_add), *a[2];
+    vlen_t r, rounds = 2000000;
+    int depths[] = { 0, 4, 16 }, i, j;
+    char name[32];
+    /* a few methods so resolving has to compare signatures */
+    for (i = 0; i < 4; i++) {
+	snprintf(name, sizeof(name), "benchBase%d", i);
+	base[i] = subclass(realClass, name, NULL, NULL);
+	sig[0] = base[i];
+	sig[1] = realClass;
+	setMethod(g, sig, 2, fn);
+    }
+    A_printf("%-8s %12s %12s %10s\n", "depth", "cached[ns]", "resolve[ns]", "speedup");
+    for (j = 0; j < sizeof(depths) / sizeof(depths[0]); j++) {
+	double t0, t[2];
+	for (cls = base[3], i = 0; i < depths[j]; i++) {
+	    snprintf(name, sizeof(name), "benchDerived%d", i);
+	    cls = subclass(cls, name, NULL, NULL);
+	}
+	a[0] = allocVarObject(cls, sizeof(double), 1);
+	a[1] = ScalarReal(1.0);
+	t0 = now();
+	for (r = 0; r < rounds; r++)
+	    dispatchMethod(g, a, 2);
+	t[0] = now() - t0;
+	t0 = now();
+	for (r = 0; r < rounds; r++) {
+	    dispatch_epoch++; /* every lookup misses */
+	    dispatchMethod(g, a, 2);
+	}
+	t[1] = now() - t0;
+	A_printf("%-8d %12.1f %12.1f %10.2f\n", depths[j], t[0] * 1e9 / rounds, t[1] * 1e9 / rounds, t[1] / t[0]);
+    }
+    releasePool(hold);
+    currentThreadContext()->pool = cp;
+}
+
+/* subclass tests: isAssignableClass against the recursive walk through the superclasses it used to do, for the leaf of a chain of classes of increasing depth - both for the root of the chain (found at the end of the walk) and an unrelated class (the whole hierarchy is walked) */
+static int old_assignable(AClass *cc, AClass *cl) {
+    vlen_t i;
+    if (cc == cl) return 1;
+    for (i = 0; i < cc->supers; i++)
+	if (old_assignable((i < BUILTIN_SUPERCLASSES) ? cc->super[i] : cc->more_super[i - BUILTIN_SUPERCLASSES], cl)) return 1;
+    return 0;
+}
+
+static void bench_classes() {
+    int depths[] = { 1, 8, 64, 512 }, i, j;
+    AClass *root = subclass(objectClass, "benchRoot", NULL, NULL), *other = subclass(objectClass, "benchOther", NULL, NULL), *leaf = root;
+    vlen_t r, rounds = 2000000, found = 0;
+    char name[32];
+    A_printf("%-8s %12s %12s %12s %12s  [ns per test]\n", "depth", "old.root", "new.root", "old.other", "new.other");
+    for (j = 0, i = 0; j < sizeof(depths) / sizeof(depths[0]); j++) {
+	AClass *target[2] = { root, other };
+	double t0, t[4];
+	int k;
+	for (; i < depths[j]; i++) {
+	    snprintf(name, sizeof(name), "benchChain%d", i);
+	    leaf = subclass(leaf, name, NULL, NULL);
+	}
+	for (k = 0; k < 2; k++) {
+	    t0 = now();
+	    for (r = 0; r < rounds; r++)
+		found += old_assignable(leaf, target[k]);
+	    t[2 * k] = now() - t0;
+	    t0 = now();
+	    for (r = 0; r < rounds; r++)
+		found += isAssignableClass(leaf, target[k]);
+	    t[2 * k + 1] = now() - t0;
+	}
+	A_printf("%-8d %12.1f %12.1f %12.1f %12.1f\n", depths[j], t[0] * 1e9 / rounds, t[1] * 1e9 / rounds, t[2] * 1e9 / rounds, t[3] * 1e9 / rounds);
+    }
+    if (found != 2 * rounds * (sizeof(depths) / sizeof(depths[0])))
+	A_printf("unexpected results (%lu)\n", (unsigned long) found);
+}
+
+/* attribute maps: a few thousand user-defined classes, each with an attribute of its own (so their symbols are created late and have large numbers). Reports the memory of their attribute maps against the symbol-indexed arrays used before (a slot for every symbol up to the highest attribute) and getAttr against a lookup in such an array */
+static AObject *old_getattr(AObject *o, smapi_t *map, vlen_t map_len, symbol_t sym) {
+    AClass *c = CLASS(o);
+    smapi_t ao;
+    if (sym >= map_len || !(ao = map[sym])) return A_error("object has no %s attribute", symbolName(sym));
+    return (ao > 0) ? o->attr[ao] : c->attr[1 - ao];
+}
+
+static void bench_attrmaps() {
+    AllocationPool *cp = currentPool(), *hold = newPool();
+    vlen_t steps[] = { 100, 1000, 3000 }, i = 0, j, k, r, rounds = 10000000, map_len = 0;
+    size_t old_bytes = 0, new_bytes = 0;
+    smapi_t *old_map;
+    AClass *cls = 0, *tests[2];
+    AObject *o, *found = 0;
+    symbol_t sym = 0, syms[2];
+    char name[32];
+    A_printf("%-8s %14s %14s\n", "classes", "old[B/class]", "new[B/class]");
+    for (j = 0; j < sizeof(steps) / sizeof(steps[0]); j++) {
+	for (; i < steps[j]; i++) {
+	    symbol_t attrs[2];
+	    snprintf(name, sizeof(name), "benchAttr%u", (unsigned int) i);
+	    attrs[0] = sym = newSymbol(name);
+	    attrs[1] = 0;
+	    cls = subclass(objectClass, name, attrs, NULL);
+	    old_bytes += (sym + 1) * sizeof(smapi_t);
+	    new_bytes += (cls->attr_map_mask + 1) * sizeof(AAttrEntry);
+	}
+	A_printf("%-8u %14.1f %14.1f\n", (unsigned int) i, (double) old_bytes / i, (double) new_bytes / i);
+    }
+    /* lookups: the attribute of the last class and the head of a pairlist */
+    tests[0] = cls;
+    tests[1] = pairlistClass;
+    syms[0] = sym;
+    syms[1] = AS_head;
+    A_printf("%-8s %12s %12s\n", "getAttr", "old[ns]", "new[ns]");
+    for (k = 0; k < 2; k++) {
+	double t0, t[2];
+	o = allocObject(tests[k]);
+	map_len = 0;
+	for (j = 0; j <= tests[k]->attr_map_mask; j++)
+	    if (tests[k]->attr_map[j].sym >= map_len) map_len = tests[k]->attr_map[j].sym + 1;
+	old_map = (smapi_t*) Acalloc(map_len, sizeof(smapi_t));
+	for (j = 0; j <= tests[k]->attr_map_mask; j++)
+	    if (tests[k]->attr_map[j].sym) old_map[tests[k]->attr_map[j].sym] = tests[k]->attr_map[j].index;
+	t0 = now();
+	for (r = 0; r < rounds; r++)
+	    found = old_getattr(o, old_map, map_len, syms[k]);
+	t[0] = now() - t0;
+	t0 = now();
+	for (r = 0; r < rounds; r++)
+	    found = getAttr(o, syms[k]);
+	t[1] = now() - t0;
+	A_printf("%-8s %12.2f %12.2f\n", tests[k]->name, t[0] * 1e9 / rounds, t[1] * 1e9 / rounds);
+	free(old_map);
+    }
+    if (!found)
+	A_printf("unexpected result\n");
+    releasePool(hold);
+    currentThreadContext()->pool = cp;
+}
+
+/* parser input: a generated script (long names, numbers, indentation and comments) parsed from a file one expression at a time - only checking the syntax (which is mostly the lexer) and building the expressions - and from a character vector of its lines */
+int parsingCheck(FILE *f); /* from gram.y */
+SEXP R_ParseVector(SEXP text, int n, ParseStatus *status, SEXP srcfile); /* from gram.y */
+
+static void bench_lexer() {
+    const char *src = "bench-lex.tmp";
+    AllocationPool *cp = currentPool(), *p = newPool();
+    vlen_t i, n = 50000, r, rounds = 3, exprs[3];
+    size_t size;
+    double t0, t[3] = { 0.0, 0.0, 0.0 };
+    char line[256];
+    AObject *text = allocObjectVector(stringClass, n);
+    ParseStatus ps;
+    FILE *f = fopen(src, "w");
+    for (i = 0; i < n; i++) {
+	snprintf(line, sizeof(line), (i % 4) ? "    accumulated_value.%u = previous_result_%u * 1234.5678 + offset_%u - 42L   # step %u" : "## section %u: some explanatory text that the lexer has to skip over %u %u %u", i % 97, i, i % 13, i);
+	fprintf(f, "%s\n", line);
+	SET_STRING_ELT(text, i, mkChar(line));
+    }
+    fclose(f);
+    size = file_size(src);
+    for (r = 0; r < rounds; r++) {
+	int gencode;
+	for (gencode = 0; gencode < 2; gencode++) {
+	    AllocationPool *s = enterScope();
+	    t0 = now();
+	    f = fopen(src, "r");
+	    exprs[gencode] = 0;
+	    if (gencode)
+		while (parsingTest(f))
+		    exprs[gencode]++;
+	    else
+		while ((ps = parsingCheck(f)) == PARSE_OK || ps == PARSE_NULL)
+		    if (ps == PARSE_OK) exprs[gencode]++;
+	    fclose(f);
+	    t[gencode] += now() - t0;
+	    leaveScope(s, NULL);
+	}
+	{
+	    AllocationPool *s = enterScope();
+	    AObject *res;
+	    t0 = now();
+	    res = R_ParseVector(text, -1, &ps, R_NilValue);
+	    t[2] += now() - t0;
+	    exprs[2] = (ps == PARSE_OK) ? LENGTH(res) : 0;
+	    leaveScope(s, NULL);
+	}
+    }
+    A_printf("source: %u lines, %.1f MB\n", n, size / 1048576.0);
+    A_printf("%-10s %10s %10s %10s\n", "", "check", "parse", "vector");
+    A_printf("%-10s %10.1f %10.1f %10.1f\n", "MB/s", size / 1048576.0 * rounds / t[0], size / 1048576.0 * rounds / t[1], size / 1048576.0 * rounds / t[2]);
+    A_printf("%-10s %10u %10u %10u\n", "exprs", exprs[0], exprs[1], exprs[2]);
+    unlink(src);
+    releasePool(p);
+    currentThreadContext()->pool = cp;
+}
+
+static struct {
+    const char *name;
+    void (*fn)();
+} benchmarks[] = {
+    { "symbols", bench_symbols },
+    { "lookup",  bench_lookup },
+    { "gc",      bench_gc },
+    { "alloc",   bench_alloc },
+    { "slab",    bench_slab },
+    { "vectors", bench_vectors },
+    { "pools",   bench_pools },
+    { "scope",   bench_scope },
+    { "arith",   bench_arith },
+    { "mixed",   bench_mixed },
+    { "fused",   bench_fused },
+    { "seq",     bench_seq },
+    { "mmap",    bench_mmap },
+    { "serialize", bench_serialize },
+    { "reuse",   bench_reuse },
+    { "threads", bench_threads },
+    { "parallel", bench_parallel },
+    { "bytecode", bench_bytecode },
+    { "closures", bench_closures },
+    { "loops",   bench_loops },
+    { "dispatch", bench_dispatch },
+    { "classes", bench_classes },
+    { "attrmaps", bench_attrmaps },
+    { "lexer",   bench_lexer },
+    { 0, 0 }
+};
+
+int main(int argc, char **argv) {
+    int i, j;
+    if (alephInitialize())
+	return 1;
+
+    ON_ERROR {
+	fprintf(stderr, "Terminating due to a run-time error\n");
+	return 1;
+    }
+
+    newPool();
+    for (i = 0; benchmarks[i].name; i++) {
+	int run = (argc < 2);
+	for (j = 1; j < argc; j++)
+	    if (!strcmp(argv[j], benchmarks[i].name)) run = 1;
+	if (run) {
+	    A_printf("--- %s\n", benchmarks[i].name);
+	    benchmarks[i].fn();
+	}
+    }
+    return 0;
+}
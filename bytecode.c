@@ -0,0 +1,271 @@
+#include "aleph.h"
+
+/* Bytecode.
+
+   eval() of a language object walks the tree: every call looks up the function, hands it the unevaluated argument pairlist and the function evaluates its arguments by walking their trees. compileExpr() translates a tree into a flat sequence of instructions for a stack machine instead. Symbols are operands of the instructions (by index) and all other objects the code needs go into a constant pool (the "constants" attribute of the bytecode object).
+
+   Calls of natives that the compiler knows (arithmetic operators and assignment) evaluate their arguments on the stack and call the operation directly, so there are no pairlists to walk and no scopes to enter for each operation. Which function a symbol refers to can only be known at run time, so the compiler resolves it in the environment it is given and the code checks that the symbol still refers to the same function (BC_GUARD) - if not, or for any other call, the function is called with the original arguments just like eval() would (BC_CALL). So compiled code always gives the same result as the tree it was compiled from.
+
+   Bytecode objects are evaluated by running the code in the environment of the caller, either as part of a language object or by calling them. */
+
+enum {
+    BC_RETURN,  /* return the top of the stack */
+    BC_CONST,   /* k: push constant k */
+    BC_GETVAR,  /* sym: push the value of a symbol */
+    BC_EVAL,    /* k: push the value of constant k */
+    BC_GUARD,   /* sym k else: continue if sym refers to constant k, otherwise push its value and jump */
+    BC_ARITH,   /* op: replace the two top values by the result of arithmetic operator op */
+    BC_ARITH1,  /* op: replace the top value by the result of unary operator op */
+    BC_SETVAR,  /* sym: assign the top value to sym (it stays on the stack) */
+    BC_CALL,    /* k: replace the function on top of the stack by the result of calling it with the arguments in constant k */
+    BC_JUMP,    /* to: continue at to */
+    BC_PIN,     /* pin the top value in the current pool (see pinValue), so it survives the code that follows */
+    BC_OPS
+};
+
+typedef struct {
+    vlen_t length; /* number of code words */
+    vlen_t stack;  /* maximal stack depth */
+    int code[1];
+} ABytecode;
+
+#define BYTECODE(O) ((ABytecode*) DIRECT_DATAPTR(O))
+#define BC_CONSTANTS(O) ((AObject**) DIRECT_DATAPTR((O)->attr[1]))
+
+extern AObject *fn_assign(AObject *args, AObject *where); /* from basic.c */
+extern AClass *natFnClass; /* from main.c */
+
+#define NATIVE_PTR(O) ((void*) (O)->attr[(O)->attrs + 1])
+
+typedef struct {
+    AObject *where; /* the environment used to resolve functions */
+    int *code;
+    vlen_t length, size;
+    AObject **constants;
+    vlen_t constant_count, constant_size;
+    vlen_t depth, max_depth;
+} bc_compiler_t;
+
+static vlen_t bc_emit(bc_compiler_t *c, int word) {
+    if (c->length == c->size) {
+	c->size *= 2;
+	c->code = (int*) Arealloc(c->code, sizeof(int) * c->size);
+    }
+    c->code[c->length] = word;
+    return c->length++;
+}
+
+static void bc_push(bc_compiler_t *c, int n) {
+    c->depth += n;
+    if (c->depth > c->max_depth) c->max_depth = c->depth;
+}
+
+static int bc_constant(bc_compiler_t *c, AObject *o) {
+    vlen_t i;
+    for (i = 0; i < c->constant_count; i++)
+	if (c->constants[i] == o) return (int) i;
+    if (c->constant_count == c->constant_size) {
+	c->constant_size *= 2;
+	c->constants = (AObject**) Arealloc(c->constants, sizeof(AObject*) * c->constant_size);
+    }
+    c->constants[c->constant_count] = o;
+    return (int) c->constant_count++;
+}
+
+static void bc_compile(bc_compiler_t *c, AObject *e);
+
+/* the native function sym refers to in the compile environment (NULL if it doesn't refer to one) */
+static AObject *bc_native(bc_compiler_t *c, AObject *sym) {
+    AObject *fn;
+    if (!c->where || CLASS(sym) != symbolClass) return 0;
+    fn = symbol_get(ASymbol2sym_t(sym), c->where);
+    return (fn && CLASS(fn) == natFnClass) ? fn : 0;
+}
+
+/* number of arguments or -1 if any of them is named */
+static int bc_arg_count(AObject *args) {
+    int n = 0;
+    for (; args && args != nullObject; args = DIRECT_CDR(args), n++)
+	if (DIRECT_TAG(args) && DIRECT_TAG(args) != nullObject) return -1;
+    return n;
+}
+
+/* compile a call of a known native with evaluated arguments. Returns 0 if the call can't be compiled (the code emitted so far is then discarded) */
+static int bc_compile_builtin(bc_compiler_t *c, void *fn, AObject *args, int n) {
+    int op;
+    if (fn == (void*) fn_assign) { /* `=`(symbol, value) */
+	AObject *name, *value;
+	if (n != 2) return 0;
+	name = DIRECT_CAR(args);
+	value = DIRECT_CAR(DIRECT_CDR(args));
+	if (CLASS(name) != symbolClass) return 0;
+	if (!value || value == nullObject) { /* the value is not evaluated */
+	    bc_emit(c, BC_CONST);
+	    bc_emit(c, bc_constant(c, nullObject));
+	    bc_push(c, 1);
+	} else
+	    bc_compile(c, value);
+	bc_emit(c, BC_SETVAR);
+	bc_emit(c, (int) ASymbol2sym_t(name));
+	return 1;
+    }
+    if ((op = arithOpIndex(fn)) < 0 || n < 1 || n > 2)
+	return 0;
+    bc_compile(c, DIRECT_CAR(args));
+    if (n == 1) {
+	bc_emit(c, BC_ARITH1);
+    } else {
+	AObject *right = DIRECT_CAR(DIRECT_CDR(args));
+	if (right && CLASS(right) == langClass) /* evaluating a call may drop the owner of the left operand, e.g. x + (x = 5) */
+	    bc_emit(c, BC_PIN);
+	bc_compile(c, right);
+	bc_emit(c, BC_ARITH);
+	bc_push(c, -1);
+    }
+    bc_emit(c, op);
+    return 1;
+}
+
+static void bc_compile_call(bc_compiler_t *c, AObject *e) {
+    AObject *fun = DIRECT_CAR(e), *args = DIRECT_CDR(e), *native;
+    int n;
+    if (!args) args = nullObject;
+    n = bc_arg_count(args);
+    if ((native = bc_native(c, fun)) && n >= 0) {
+	vlen_t guard = bc_emit(c, BC_GUARD), length = c->length, depth = c->depth, jump;
+	bc_emit(c, (int) ASymbol2sym_t(fun));
+	bc_emit(c, bc_constant(c, native));
+	bc_emit(c, 0);
+	if (bc_compile_builtin(c, NATIVE_PTR(native), args, n)) {
+	    jump = bc_emit(c, BC_JUMP);
+	    bc_emit(c, 0);
+	    c->code[guard + 3] = (int) c->length; /* not the same function: call it */
+	    c->depth = depth;
+	    bc_push(c, 1);
+	    bc_emit(c, BC_CALL);
+	    bc_emit(c, bc_constant(c, args));
+	    c->code[jump + 1] = (int) c->length;
+	    return;
+	}
+	c->length = length - 1;
+	c->depth = depth;
+    }
+    bc_compile(c, fun);
+    bc_emit(c, BC_CALL);
+    bc_emit(c, bc_constant(c, args));
+}
+
+static void bc_compile(bc_compiler_t *c, AObject *e) {
+    if (!e) e = nullObject;
+    if (CLASS(e) == langClass) {
+	bc_compile_call(c, e);
+	return;
+    }
+    if (CLASS(e) == symbolClass) {
+	bc_emit(c, BC_GETVAR);
+	bc_emit(c, (int) ASymbol2sym_t(e));
+    } else {
+	bc_emit(c, (CLASS(e)->eval == default_eval) ? BC_CONST : BC_EVAL);
+	bc_emit(c, bc_constant(c, e));
+    }
+    bc_push(c, 1);
+}
+
+/* compile the expression e. Calls of known natives are resolved in where (can be NULL) */
+AObject *compileExpr(AObject *e, AObject *where) {
+    bc_compiler_t c;
+    AObject *res, *constants;
+    ABytecode *b;
+    vlen_t i;
+    memset(&c, 0, sizeof(c));
+    c.where = where;
+    c.code = (int*) Amalloc(sizeof(int) * (c.size = 64));
+    c.constants = (AObject**) Amalloc(sizeof(AObject*) * (c.constant_size = 16));
+    bc_compile(&c, e);
+    bc_emit(&c, BC_RETURN);
+    res = allocVarObject(bytecodeClass, sizeof(ABytecode) + sizeof(int) * c.length, 0);
+    b = BYTECODE(res);
+    b->length = c.length;
+    b->stack = c.max_depth;
+    memcpy(b->code, c.code, sizeof(int) * c.length);
+    constants = allocObjectVector(listClass, c.constant_count);
+    for (i = 0; i < c.constant_count; i++)
+	SET_VECTOR_ELT(constants, i, c.constants[i]);
+    setAttr(res, AS_constants, constants);
+    setAttr(res, AS_source, e);
+    free(c.code);
+    free(c.constants);
+    return res;
+}
+
+/* run the code of bc in the environment where. Compiled code doesn't enter a scope (it would have to pin results that are assigned to variables), so its temporaries live in the pool of the caller. The operations can still write over them (see reuse_vector in arith.c) since the code only gets hold of temporaries it created itself */
+static AObject *bc_run(AObject *bc, AObject *where) {
+    static const void *dispatch[BC_OPS] = { &&op_return, &&op_const, &&op_getvar, &&op_eval, &&op_guard, &&op_arith, &&op_arith1, &&op_setvar, &&op_call, &&op_jump, &&op_pin };
+    ABytecode *b = BYTECODE(bc);
+    AObject **k = BC_CONSTANTS(bc), *stack[b->stack + 1], **sp = stack, *v;
+    const int *code = b->code, *pc = code;
+
+#define NEXT goto *dispatch[*pc++]
+    NEXT;
+ op_return:
+    return sp[-1];
+ op_const:
+    *(sp++) = k[*(pc++)];
+    NEXT;
+ op_getvar:
+    v = (AObject*) sym_t2ASymbol(*pc);
+    pc++;
+    *(sp++) = symbol_eval(v, where);
+    NEXT;
+ op_eval:
+    *(sp++) = eval(k[*(pc++)], where);
+    NEXT;
+ op_guard:
+    v = symbol_eval((AObject*) sym_t2ASymbol(pc[0]), where);
+    if (v == k[pc[1]]) {
+	pc += 3;
+	NEXT;
+    }
+    *(sp++) = v;
+    pc = code + pc[2];
+    NEXT;
+ op_arith:
+    sp--;
+    sp[-1] = arithApply(*(pc++), sp[-1], sp[0], where);
+    NEXT;
+ op_arith1:
+    sp[-1] = arithApply(*(pc++), sp[-1], 0, where);
+    NEXT;
+ op_setvar:
+    symbol_set(*(pc++), sp[-1], where);
+    NEXT;
+ op_call:
+    v = sp[-1];
+    sp[-1] = CLASS(v)->call(v, k[*(pc++)], where);
+    NEXT;
+ op_jump:
+    pc = code + *pc;
+    NEXT;
+ op_pin:
+    pinValue(sp[-1]);
+    NEXT;
+#undef NEXT
+}
+
+static AObject *bytecode_call(AObject *obj, AObject *args, AObject *where) {
+    return bc_run(obj, where);
+}
+
+void bytecode_init() {
+    symbol_t attrs[3] = { AS_constants, AS_source, 0 };
+    bytecodeClass = subclass(objectClass, "bytecode", attrs, NULL);
+    bytecodeClass->copy = default_nocopy;
+    bytecodeClass->eval = bc_run;
+    bytecodeClass->call = bytecode_call;
+}
+
+/* compile(expr) - compiles expr (not evaluated). The result is evaluated by calling it */
+AObject *fn_compile(AObject *args, AObject *where) {
+    if (args == nullObject) A_error("missing expression");
+    return compileExpr(getAttr(args, AS_head), where);
+}
@@ -0,0 +1,232 @@
+#include "aleph.h"
+
+/* Closures.
+
+   function(formals) body creates a closure: the formals, the body and the environment it was created in. Calling it binds the arguments to the formals in a new environment enclosed by that one and evaluates the body there.
+
+   Everything about argument matching that only depends on the formals is worked out once when the closure is created and kept in its data as a plan (AClosurePlan): the symbols of the formals, the position of ... and the slot each formal occupies in a frame of the planned capacity. A call allocates such a frame and stores the values directly into their slots, so there is no hashing and no name comparison unless arguments are named. Arguments are matched as in R: exact names first, then unique prefixes (only formals before ...), then the remaining formals (before ...) are filled by position and anything left goes to ... (a pairlist of the values, with their names as tags).
+
+   Arguments are evaluated in the caller when the closure is called (there are no promises yet), defaults are evaluated in the new environment after all supplied arguments have been bound. Formals that are neither supplied nor have a default are bound to the missing argument (R_MissingArg), evaluating them is an error. The body is compiled to bytecode when the closure is created (see bytecode.c) and each call is a scope, so its temporaries and the environment are released when it returns (unless something captured them). */
+
+typedef struct {
+    symbol_t sym;
+    vlen_t slot;    /* slot of the binding in a new frame */
+    AObject *value; /* default expression (owned by the formals) or NULL */
+} AFormal;
+
+typedef struct {
+    vlen_t n;        /* number of formals */
+    vlen_t dots;     /* index of ... (n if there is none) */
+    vlen_t capacity; /* frame capacity */
+    AFormal formal[1];
+} AClosurePlan;
+
+#define CLOSURE_FORMALS(O) ((O)->attr[1])
+#define CLOSURE_BODY(O) ((O)->attr[2])
+#define CLOSURE_ENV(O) ((O)->attr[3])
+#define CLOSURE_CODE(O) ((O)->attr[4])
+#define CLOSURE_PLAN(O) ((AClosurePlan*) DIRECT_DATAPTR(O))
+
+#define IS_DOTS(E) ((E) && CLASS(E) == symbolClass && ASymbol2sym_t(E) == AS_dots)
+
+static AObject *closure_new(AObject *formals, AObject *body, AObject *env) {
+    AObject *f, *res;
+    AClosurePlan *plan;
+    AFrameEntry *slots;
+    vlen_t n = 0, i, capacity = DEFAULT_FRAME_SIZE;
+    for (f = formals; f != nullObject; f = DIRECT_CDR(f))
+	n++;
+    /* leave room for a few local variables */
+    while ((n + 2) * 4 > capacity * 3)
+	capacity *= 2;
+    res = allocVarObject(closureClass, sizeof(AClosurePlan) + sizeof(AFormal) * (n ? n - 1 : 0), 0);
+    plan = CLOSURE_PLAN(res);
+    plan->n = n;
+    plan->dots = n;
+    plan->capacity = capacity;
+    /* the slots are where frameInsertSlot() would put the formals in a new frame */
+    slots = (AFrameEntry*) Acalloc(capacity, sizeof(AFrameEntry));
+    for (f = formals, i = 0; f != nullObject; f = DIRECT_CDR(f), i++) {
+	AFormal *a = plan->formal + i;
+	vlen_t s = FRAME_HASH(ASymbol2sym_t(DIRECT_TAG(f))) & (capacity - 1);
+	a->sym = ASymbol2sym_t(DIRECT_TAG(f));
+	a->value = (DIRECT_CAR(f) == R_MissingArg) ? NULL : DIRECT_CAR(f);
+	if (a->sym == AS_dots && plan->dots == n)
+	    plan->dots = i;
+	while (slots[s].sym)
+	    s = (s + 1) & (capacity - 1);
+	slots[s].sym = a->sym;
+	a->slot = s;
+    }
+    free(slots);
+    set(&CLOSURE_FORMALS(res), formals);
+    set(&CLOSURE_BODY(res), body);
+    set(&CLOSURE_ENV(res), env);
+    set(&CLOSURE_CODE(res), (CLASS(body) == langClass) ? compileExpr(body, env) : body);
+    return res;
+}
+
+/* `function`(formals, body, source) - created by the parser for function definitions */
+AObject *fn_function(AObject *args, AObject *where) {
+    AObject *formals = getAttr(args, AS_head), *body;
+    args = getAttr(args, AS_next);
+    if (args == nullObject) A_error("missing function body");
+    body = getAttr(args, AS_head);
+    return closure_new(formals, body, where);
+}
+
+/* a supplied argument: its value, tag (symbol or 0) and the formal it is matched to */
+typedef struct {
+    AObject *value;
+    symbol_t tag;
+    vlen_t formal;
+} closure_arg_t;
+
+#define UNMATCHED ((vlen_t) -1)
+
+/* evaluate the arguments in where into a (or only count them if a is NULL). ... is replaced by the arguments it holds. Returns the number of arguments */
+static vlen_t closure_args(AObject *args, AObject *where, closure_arg_t *a) {
+    vlen_t n = 0, pinned = 0;
+    if (args != nullObject && DIRECT_CAR(args) == R_MissingArg && DIRECT_CDR(args) == nullObject && (!DIRECT_TAG(args) || DIRECT_TAG(args) == nullObject))
+	return 0; /* f() is parsed as a call with one empty argument. Other empty arguments keep their position */
+    for (; args != nullObject; args = DIRECT_CDR(args)) {
+	AObject *e = DIRECT_CAR(args), *tag = DIRECT_TAG(args);
+	if (IS_DOTS(e)) {
+	    AObject *d = symbol_get(AS_dots, where);
+	    for (; d && CLASS(d) == pairlistClass; d = DIRECT_CDR(d), n++)
+		if (a) {
+		    a[n].value = DIRECT_CAR(d);
+		    a[n].tag = (DIRECT_TAG(d) && DIRECT_TAG(d) != nullObject) ? ASymbol2sym_t(DIRECT_TAG(d)) : 0;
+		    a[n].formal = UNMATCHED;
+		}
+	    continue;
+	}
+	if (a) {
+	    if (e && CLASS(e) == langClass) /* evaluating a call may drop the owners of the values so far, e.g. f(x, (x = 5)) */
+		for (; pinned < n; pinned++)
+		    pinValue(a[pinned].value);
+	    a[n].value = eval(e ? e : nullObject, where);
+	    a[n].tag = (tag && tag != nullObject) ? ASymbol2sym_t(tag) : 0;
+	    a[n].formal = UNMATCHED;
+	}
+	n++;
+    }
+    return n;
+}
+
+/* match named and positional arguments to the formals. matched[i] is the argument matched to formal i (UNMATCHED if none) */
+static void closure_match(AClosurePlan *plan, closure_arg_t *a, vlen_t n, vlen_t *matched) {
+    vlen_t i, j;
+    /* exact names */
+    for (j = 0; j < n; j++)
+	if (a[j].tag)
+	    for (i = 0; i < plan->n; i++)
+		if (plan->formal[i].sym == a[j].tag && i != plan->dots) {
+		    if (matched[i] != UNMATCHED)
+			A_error("formal argument \"%s\" matched by multiple actual arguments", symbolName(a[j].tag));
+		    matched[i] = j;
+		    a[j].formal = i;
+		    break;
+		}
+    /* unique prefixes of the formals before ... */
+    for (j = 0; j < n; j++)
+	if (a[j].tag && a[j].formal == UNMATCHED) {
+	    const char *name = symbolName(a[j].tag);
+	    size_t len = strlen(name);
+	    vlen_t found = UNMATCHED;
+	    for (i = 0; i < plan->dots; i++)
+		if (matched[i] == UNMATCHED && !strncmp(symbolName(plan->formal[i].sym), name, len)) {
+		    if (found != UNMATCHED)
+			A_error("argument %u matches multiple formal arguments", j + 1);
+		    found = i;
+		}
+	    if (found != UNMATCHED) {
+		matched[found] = j;
+		a[j].formal = found;
+	    }
+	}
+    /* positions */
+    for (i = 0, j = 0; j < n; j++)
+	if (!a[j].tag) {
+	    while (i < plan->dots && matched[i] != UNMATCHED) i++;
+	    if (i == plan->dots) break;
+	    matched[i] = j;
+	    a[j].formal = i;
+	}
+}
+
+static AObject *closure_call(AObject *obj, AObject *args, AObject *where) {
+    AClosurePlan *plan = CLOSURE_PLAN(obj);
+    AllocationPool *scope = enterScope();
+    AObject *env = allocObject(envClass), *frame = allocFrame(plan->capacity), *dots = nullObject, *res;
+    AFrameEntry *e = FRAME_ENTRY(frame);
+    vlen_t i, j, n = closure_args(args, where, 0), matched[plan->n + 1];
+    closure_arg_t a[n + 1];
+    set(&ENV_FRAME(env), frame);
+    set(&ENV_PARENT(env), CLOSURE_ENV(obj));
+    closure_args(args, where, a);
+    for (i = 0; i < plan->n; i++)
+	matched[i] = UNMATCHED;
+    for (j = 0; j < n && !a[j].tag; j++) ;
+    if (j == n) { /* no names: the arguments go to the formals in order */
+	for (j = 0; j < n && j < plan->dots; j++) {
+	    matched[j] = j;
+	    a[j].formal = j;
+	}
+    } else
+	closure_match(plan, a, n, matched);
+    /* whatever is left goes to ... (in reverse, so the pairlist is built from its end) */
+    for (j = n; j-- > 0; )
+	if (a[j].formal == UNMATCHED) {
+	    if (plan->dots == plan->n)
+		A_error("unused argument%s%s", a[j].tag ? " " : "", a[j].tag ? symbolName(a[j].tag) : "");
+	    dots = consPairs(pairlistClass, a[j].value, dots, a[j].tag ? (AObject*) sym_t2ASymbol(a[j].tag) : nullObject);
+	}
+    for (i = 0; i < plan->n; i++) {
+	AFrameEntry *s = e + plan->formal[i].slot;
+	s->sym = plan->formal[i].sym;
+	set(&s->value, (i == plan->dots) ? dots : ((matched[i] != UNMATCHED) ? a[matched[i]].value : R_MissingArg));
+    }
+    frame->len = plan->n;
+    /* defaults can refer to other arguments, so they are evaluated once all are bound */
+    for (i = 0; i < plan->n; i++)
+	if (i != plan->dots && matched[i] == UNMATCHED && plan->formal[i].value)
+	    set(&e[plan->formal[i].slot].value, eval(plan->formal[i].value, env));
+    res = eval(CLOSURE_CODE(obj), env);
+    checkNoLoopControl();
+    return leaveScope(scope, res);
+}
+
+/* append an argument to the pairlist *head which ends in *tail */
+static void append_arg(AObject **head, AObject **tail, AObject *value, AObject *tag) {
+    AObject *cell = consPairs(pairlistClass, value, nullObject, tag ? tag : nullObject);
+    if (*tail)
+	set(&DIRECT_CDR(*tail), cell);
+    else
+	*head = cell;
+    *tail = cell;
+}
+
+/* natives get their arguments unevaluated, so ... in the arguments of a native is replaced by the values it holds (the native evaluates them again, which doesn't change vectors). Returns args itself if it doesn't contain ... */
+AObject *expandDots(AObject *args, AObject *where) {
+    AObject *a, *d, *head = nullObject, *tail = 0;
+    for (a = args; a != nullObject && !IS_DOTS(DIRECT_CAR(a)); a = DIRECT_CDR(a)) ;
+    if (a == nullObject)
+	return args;
+    for (a = args; a != nullObject; a = DIRECT_CDR(a)) {
+	if (!IS_DOTS(DIRECT_CAR(a))) {
+	    append_arg(&head, &tail, DIRECT_CAR(a), DIRECT_TAG(a));
+	    continue;
+	}
+	for (d = symbol_get(AS_dots, where); d && CLASS(d) == pairlistClass; d = DIRECT_CDR(d))
+	    append_arg(&head, &tail, DIRECT_CAR(d), DIRECT_TAG(d));
+    }
+    return head;
+}
+
+void closure_init() {
+    symbol_t attrs[5] = { AS_formals, AS_body, AS_environment, AS_code, 0 };
+    closureClass = subclass(objectClass, "closure", attrs, NULL);
+    closureClass->copy = default_nocopy;
+    closureClass->call = closure_call;
+}
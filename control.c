@@ -0,0 +1,144 @@
+#include "aleph.h"
+
+#include <math.h>
+
+/* Control flow: if, for, while, repeat, break and next.
+
+   Each iteration of a loop is evaluated in its own scope, so the temporaries of the body are released right away instead of piling up until the loop ends. The loop variable of for() is a scalar that is written over with the next element as long as the frame is its only owner - only if the body made it multi-owned (e.g. by assigning it to another variable) or replaced it, a new one is created. Compact sequences (1:n) are iterated by computing the elements, they are never materialized.
+
+   break and next are not implemented by jumping (A_error() is the only user of error_jmpbuf): they set the pending control transfer in the thread context and return. `{` doesn't evaluate any further expressions once it is set and the loop clears it, then either stops or continues with the next iteration. */
+
+/* the value of a condition */
+static int control_test(AObject *v) {
+    AClass *cls = CLASS(v);
+    if (cls == nullClass || LENGTH(v) == 0)
+	A_error("argument is of length zero");
+    if (LENGTH(v) > 1)
+	A_error("the condition has length > 1");
+    if (cls == logicalClass || cls == integerClass) {
+	int b = INTEGER(v)[0];
+	if (b == A_NA_INT) A_error("missing value where TRUE/FALSE needed");
+	return b != 0;
+    }
+    if (cls == realClass) {
+	double d = REAL(v)[0];
+	if (isnan(d)) A_error("missing value where TRUE/FALSE needed");
+	return d != 0.0;
+    }
+    A_error("argument is not interpretable as logical");
+    return 0;
+}
+
+/* consume the pending control transfer after an iteration. Returns 1 if the loop has to stop */
+static int control_break(ThreadContext *ctx) {
+    int c = ctx->control;
+    ctx->control = 0;
+    return c == CTRL_BREAK;
+}
+
+/* if (cond) expr [else expr] */
+AObject *fn_if(AObject *args, AObject *where) {
+    int t = control_test(eval(getAttr(args, AS_head), where));
+    args = getAttr(args, AS_next);
+    if (args == nullObject) A_error("missing 'if' expression");
+    if (t)
+	return eval(getAttr(args, AS_head), where);
+    args = getAttr(args, AS_next);
+    return (args != nullObject) ? eval(getAttr(args, AS_head), where) : nullObject;
+}
+
+/* for (var in seq) body */
+AObject *fn_for(AObject *args, AObject *where) {
+    ThreadContext *ctx = currentThreadContext();
+    AObject *var = getAttr(args, AS_head), *seq, *body, *box = 0;
+    AClass *cls;
+    symbol_t sym;
+    vlen_t i, n;
+    int compact;
+    const void *data = 0;
+    if (CLASS(var) != symbolClass) A_error("invalid for() loop variable");
+    sym = ASymbol2sym_t(var);
+    args = getAttr(args, AS_next);
+    seq = eval(getAttr(args, AS_head), where);
+    body = getAttr(getAttr(args, AS_next), AS_head);
+    cls = CLASS(seq);
+    if (cls == nullClass)
+	return nullObject;
+    if (cls != integerClass && cls != realClass && cls != logicalClass && cls != stringClass && cls != listClass)
+	A_error("invalid for() loop sequence");
+    /* the sequence may be the value of a variable the body assigns to */
+    if (!seq->pool || seq->pool == gc_pool)
+	pinObject(claimObject(seq), currentPool());
+    n = LENGTH(seq);
+    compact = (seq->flags & AOF_COMPACT) != 0;
+    if (!compact)
+	data = ADataPtr(seq);
+    for (i = 0; i < n; i++) {
+	AllocationPool *scope;
+	AFrameEntry *e;
+	if (cls == listClass)
+	    symbol_set(sym, ((AObject**) data)[i], where);
+	else {
+	    e = frameLookup(ENV_FRAME(where), sym);
+	    /* (the body may have replaced the box with an object at the same address, so it also has to be a plain scalar of the right class) */
+	    if (!box || !e || e->value != box || box->pool || CLASS(box) != cls || box->len != 1 || (box->flags & (AOF_DEFERRED | AOF_COMPACT | AOF_MAPPED))) {
+		box = (cls == stringClass) ? allocObjectVector(stringClass, 1) : allocVarObject(cls, (cls == realClass) ? sizeof(double) : sizeof(int), 1);
+		symbol_set(sym, box, where);
+	    }
+	    if (compact)
+		INTEGER(box)[0] = COMPACT_SEQ(seq)->start + (int) i * COMPACT_SEQ(seq)->step;
+	    else if (cls == realClass)
+		REAL(box)[0] = ((const double*) data)[i];
+	    else if (cls == stringClass)
+		SET_STRING_ELT(box, 0, ((AObject**) data)[i]);
+	    else
+		INTEGER(box)[0] = ((const int*) data)[i];
+	}
+	scope = enterScope();
+	eval(body, where);
+	leaveScope(scope, NULL);
+	if (ctx->control && control_break(ctx))
+	    break;
+    }
+    return nullObject;
+}
+
+/* while (cond) body */
+AObject *fn_while(AObject *args, AObject *where) {
+    ThreadContext *ctx = currentThreadContext();
+    AObject *cond = getAttr(args, AS_head), *body = getAttr(getAttr(args, AS_next), AS_head);
+    while (1) {
+	AllocationPool *scope = enterScope();
+	int t = control_test(eval(cond, where));
+	if (t)
+	    eval(body, where);
+	leaveScope(scope, NULL);
+	if (!t || (ctx->control && control_break(ctx)))
+	    break;
+    }
+    return nullObject;
+}
+
+/* repeat body */
+AObject *fn_repeat(AObject *args, AObject *where) {
+    ThreadContext *ctx = currentThreadContext();
+    AObject *body = getAttr(args, AS_head);
+    while (1) {
+	AllocationPool *scope = enterScope();
+	eval(body, where);
+	leaveScope(scope, NULL);
+	if (ctx->control && control_break(ctx))
+	    break;
+    }
+    return nullObject;
+}
+
+AObject *fn_break(AObject *args, AObject *where) {
+    currentThreadContext()->control = CTRL_BREAK;
+    return nullObject;
+}
+
+AObject *fn_next(AObject *args, AObject *where) {
+    currentThreadContext()->control = CTRL_NEXT;
+    return nullObject;
+}
@@ -0,0 +1,274 @@
+#include "aleph.h"
+
+/* Generic functions and method dispatch.
+
+   A generic (AGeneric) is a name with a table of methods, each selected by the classes of the first arguments (its signature). The arithmetic operators are generics whose default is the built-in vector arithmetic, so they only consult the method table if methods were defined (see arith.c); other generics are created by generic(name) and have no default.
+
+   The method for a combination of argument classes is found by comparing the classes with the signatures of all methods: the distance of a class to a signature class is the number of steps up the class hierarchy (objectClass, "ANY", matches everything but is farther than any real ancestor) and the method with the smallest total distance wins. That search only happens the first time a combination is seen: the result (including "no method") is kept in a global dispatch cache keyed by the generic and the classes. Each entry records the dispatch epoch it was computed in and the epoch is advanced whenever a method is set or a class is created, which invalidates all entries at once.
+
+   Like the symbol lookup caches, the dispatch cache is not used while other threads are running. */
+
+#define DISPATCH_CACHE_SIZE 1024 /* must be a power of two */
+#define ANY_DISTANCE 1024
+
+typedef struct {
+    AGeneric *generic;
+    AClass *cls[DISPATCH_MAX_ARGS];
+    unsigned long epoch;
+    AObject *method;
+} dispatch_entry_t;
+
+static dispatch_entry_t dispatch_cache[DISPATCH_CACHE_SIZE];
+
+/* all generics (so they can be found by name) */
+static AGeneric **generics;
+static vlen_t generic_count, generic_size;
+
+void registerGeneric(AGeneric *g, symbol_t name) {
+    g->name = name;
+    if (!g->arity) g->arity = 1;
+    if (generic_count == generic_size) {
+	generic_size = generic_size ? generic_size * 2 : 32;
+	generics = (AGeneric**) Arealloc(generics, sizeof(AGeneric*) * generic_size);
+    }
+    generics[generic_count++] = g;
+}
+
+/* the generic of the given name, a new one is created if there is none and create is set (NULL otherwise) */
+AGeneric *findGeneric(symbol_t name, int create) {
+    AGeneric *g;
+    vlen_t i;
+    for (i = 0; i < generic_count; i++)
+	if (generics[i]->name == name) return generics[i];
+    if (!create) return 0;
+    g = (AGeneric*) Acalloc(1, sizeof(AGeneric));
+    registerGeneric(g, name);
+    return g;
+}
+
+/* add a method (or replace the one with the same signature). Missing classes at the end of the signature are "ANY" */
+void setMethod(AGeneric *g, AClass **sig, int n, AObject *fn) {
+    AMethod *m = 0;
+    vlen_t i;
+    int j;
+    if (n > DISPATCH_MAX_ARGS) A_error("methods can only be selected by up to %d arguments", DISPATCH_MAX_ARGS);
+    for (j = n; j < DISPATCH_MAX_ARGS; j++) sig[j] = objectClass;
+    for (i = 0; i < g->methods; i++)
+	if (!memcmp(g->method[i].sig, sig, sizeof(AClass*) * DISPATCH_MAX_ARGS))
+	    m = g->method + i;
+    if (m)
+	releaseObject(m->fn);
+    else {
+	if (g->methods == g->size) {
+	    g->size = g->size ? g->size * 2 : 4;
+	    g->method = (AMethod*) Arealloc(g->method, sizeof(AMethod) * g->size);
+	}
+	m = g->method + g->methods++;
+	memcpy(m->sig, sig, sizeof(AClass*) * DISPATCH_MAX_ARGS);
+    }
+    m->fn = preserveObject(fn);
+    if (n > g->arity) g->arity = n;
+    dispatch_epoch++;
+}
+
+/* number of steps from class cc up to its ancestor cl (-1 if cl is not an ancestor). The ancestry tells whether cl is an ancestor at all; if it is, the superclasses are walked breadth first, so cl is first reached on a shortest path and each ancestor is visited only once, no matter how many paths lead to it (the ancestry words size the visited set) */
+static int class_distance(AClass *cc, AClass *cl) {
+    vlen_t words = cc->ancestry_words, ancestors = 0, head = 0, tail = 1, level_end = 1, i;
+    int d = 0;
+    if (cc == cl) return 0;
+    if (cl == objectClass) return ANY_DISTANCE;
+    if (!isAssignableClass(cc, cl)) return -1;
+    for (i = 0; i < words; i++)
+	ancestors += (vlen_t) __builtin_popcountl(cc->ancestry[i]);
+    {
+	AClass *queue[ancestors];
+	unsigned long visited[words];
+	memset(visited, 0, sizeof(visited));
+	queue[0] = cc;
+	visited[cc->id / ANCESTRY_BITS] |= 1ul << (cc->id % ANCESTRY_BITS);
+	while (head < tail) {
+	    AClass *c = queue[head++];
+	    for (i = 0; i < c->supers; i++) {
+		AClass *s = (i < BUILTIN_SUPERCLASSES) ? c->super[i] : c->more_super[i - BUILTIN_SUPERCLASSES];
+		if (s == cl) return d + 1;
+		if (!((visited[s->id / ANCESTRY_BITS] >> (s->id % ANCESTRY_BITS)) & 1)) {
+		    visited[s->id / ANCESTRY_BITS] |= 1ul << (s->id % ANCESTRY_BITS);
+		    queue[tail++] = s;
+		}
+	    }
+	    if (head == level_end) { /* the next level starts */
+		d++;
+		level_end = tail;
+	    }
+	}
+    }
+    return -1;
+}
+
+/* the method closest to the classes (NULL if none applies). Arguments that were not supplied (NULL) only match "ANY" */
+static AObject *resolve_method(AGeneric *g, AClass **cls) {
+    AObject *best = 0;
+    int best_distance = 0, i, d, total;
+    vlen_t j;
+    for (j = 0; j < g->methods; j++) {
+	AMethod *m = g->method + j;
+	for (i = 0, total = 0; i < DISPATCH_MAX_ARGS; i++) {
+	    d = cls[i] ? class_distance(cls[i], m->sig[i]) : ((m->sig[i] == objectClass) ? ANY_DISTANCE : -1);
+	    if (d < 0) break;
+	    total += d;
+	}
+	if (i == DISPATCH_MAX_ARGS && (!best || total < best_distance)) {
+	    best = m->fn;
+	    best_distance = total;
+	}
+    }
+    return best;
+}
+
+/* the method of generic g for the (evaluated) arguments args[0..n-1], NULL if there is none */
+AObject *dispatchMethod(AGeneric *g, AObject **args, int n) {
+    AClass *cls[DISPATCH_MAX_ARGS] = { 0 };
+    unsigned long h = (unsigned long) g >> 4;
+    dispatch_entry_t *e;
+    AObject *m;
+    int i;
+    for (i = 0; i < n && i < g->arity; i++) {
+	cls[i] = CLASS(args[i]);
+	h = h * 31 + ((unsigned long) cls[i] >> 4);
+    }
+    e = dispatch_cache + (h & (DISPATCH_CACHE_SIZE - 1));
+    if (!aleph_threads && e->epoch == dispatch_epoch && e->generic == g && !memcmp(e->cls, cls, sizeof(cls)))
+	return e->method;
+    m = resolve_method(g, cls);
+    if (!aleph_threads) {
+	e->generic = g;
+	memcpy(e->cls, cls, sizeof(cls));
+	e->epoch = dispatch_epoch;
+	e->method = m;
+    }
+    return m;
+}
+
+/* call a method with evaluated arguments (functions evaluate their arguments, but vectors evaluate to themselves) */
+AObject *callMethod(AObject *method, AObject **args, int n, AObject *where) {
+    AObject *pl = nullObject;
+    while (n-- > 0)
+	pl = CONS(args[n], pl);
+    return CLASS(method)->call(method, pl, where);
+}
+
+/* generic objects: calling them evaluates the arguments and calls the method selected by their classes */
+#define GENERIC(O) ((AGeneric*) (O)->attr[(O)->attrs + 1])
+
+static AObject *generic_call(AObject *obj, AObject *args, AObject *where) {
+    AGeneric *g = GENERIC(obj);
+    AObject *v[DISPATCH_MAX_ARGS], *tag[DISPATCH_MAX_ARGS], *m, *a;
+    int n = 0, pinned = 0;
+    args = expandDots(args, where);
+    if (args != nullObject && DIRECT_CAR(args) == R_MissingArg && DIRECT_CDR(args) == nullObject && (!DIRECT_TAG(args) || DIRECT_TAG(args) == nullObject))
+	args = nullObject; /* f() is parsed as a call with one empty argument */
+    /* missing arguments keep their slot (so the following ones keep their positions) and are passed on as R_MissingArg */
+    for (a = args; a != nullObject && n < DISPATCH_MAX_ARGS; a = DIRECT_CDR(a), n++) {
+	if (CLASS(DIRECT_CAR(a)) == langClass) /* evaluating a call may drop the owners of the values so far, e.g. g(x, (x = 5)) */
+	    for (; pinned < n; pinned++)
+		pinValue(v[pinned]);
+	v[n] = (DIRECT_CAR(a) == R_MissingArg) ? R_MissingArg : eval(DIRECT_CAR(a), where);
+	tag[n] = DIRECT_TAG(a);
+    }
+    if (!(m = dispatchMethod(g, v, n)))
+	A_error("unable to find a method for '%s' for the classes of its arguments%s%s", symbolName(g->name), n ? " starting with " : "", n ? className(v[0]) : "");
+    /* the evaluated arguments with their tags, followed by the ones not used for dispatch as they are */
+    while (n-- > 0)
+	a = consPairs(pairlistClass, v[n], a, tag[n] ? tag[n] : nullObject);
+    return CLASS(m)->call(m, a, where);
+}
+
+void dispatch_init() {
+    genericClass = subclass(objectClass, "generic", NULL, NULL);
+    genericClass->copy = default_nocopy;
+    genericClass->call = generic_call;
+}
+
+/* generic(name) - a generic function without default, its methods are set by setMethod */
+AObject *fn_generic(AObject *args, AObject *where) {
+    const char *name = stringArg(&args, where, "name", 0);
+    AObject *res;
+    if (!name) A_error("missing generic name");
+    res = allocVarObject(genericClass, sizeof(AGeneric*), 0);
+    res->attr[res->attrs + 1] = (AObject*) findGeneric(newSymbol(name), 1); /* (as native functions do, see main.c) */
+    return res;
+}
+
+/* setMethod(name, class, ..., fn) - fn is called by the generic name if its arguments are of the given classes ("ANY" for any class) */
+AObject *fn_setmethod(AObject *args, AObject *where) {
+    const char *name = stringArg(&args, where, "name", 0), *cn;
+    AClass *sig[DISPATCH_MAX_ARGS + 1];
+    AObject *fn;
+    int n = 0;
+    if (!name) A_error("missing generic name");
+    while (getAttr(args, AS_next) != nullObject) {
+	if (n == DISPATCH_MAX_ARGS) A_error("methods can only be selected by up to %d arguments", DISPATCH_MAX_ARGS);
+	cn = stringArg(&args, where, "class", 0);
+	if (!(sig[n++] = strcmp(cn, "ANY") ? findClass(cn) : objectClass))
+	    A_error("undefined class '%s'", cn);
+    }
+    if (args == nullObject) A_error("missing method");
+    fn = eval(getAttr(args, AS_head), where);
+    if (CLASS(fn)->call == default_call) A_error("method for '%s' is not a function", name);
+    setMethod(findGeneric(newSymbol(name), 1), sig, n, fn);
+    return fn;
+}
+
+/* setClass(name, contains, ...) - a new class derived from contains and any further classes given */
+AObject *fn_setclass(AObject *args, AObject *where) {
+    const char *name = stringArg(&args, where, "name", 0), *sn = stringArg(&args, where, "contains", "object");
+    AClass *super = findClass(sn), *cl;
+    if (!name) A_error("missing class name");
+    if (!super) A_error("undefined class '%s'", sn);
+    cl = subclass(super, name, NULL, NULL);
+    while ((sn = stringArg(&args, where, "contains", 0))) {
+	if (!(super = findClass(sn))) A_error("undefined class '%s'", sn);
+	addSuperclass(cl, super);
+    }
+    return mkString(name);
+}
+
+/* size of one element of a vector of class cl (or a class derived from it) as the vector allocators use it, 0 if it is not a known atomic vector */
+static size_t vector_element_size(AClass *cl) {
+    if (isAssignableClass(cl, realClass)) return sizeof(double);
+    if (isAssignableClass(cl, integerClass)) return sizeof(int);
+    if (isAssignableClass(cl, logicalClass)) return sizeof(bool_t);
+    if (isAssignableClass(cl, complexClass)) return sizeof(complex_t);
+    return 0;
+}
+
+/* new(class, value) - a copy of value (a vector) as an object of a class derived from the class of value */
+AObject *fn_new(AObject *args, AObject *where) {
+    const char *name = stringArg(&args, where, "class", 0);
+    AClass *cls = name ? findClass(name) : 0, *vc;
+    AObject *value, *res;
+    vlen_t i, n;
+    if (!cls) A_error("undefined class '%s'", name ? name : "");
+    if (args == nullObject) A_error("missing value");
+    value = eval(getAttr(args, AS_head), where);
+    vc = CLASS(value);
+    if (!isAssignableClass(cls, vc) || cls->attrs != vc->attrs || !isAssignableClass(vc, vectorClass))
+	A_error("cannot create '%s' from '%s'", cls->name, vc->name);
+    n = LENGTH(value);
+    if (isAssignableClass(vc, listClass) || isAssignableClass(vc, stringClass)) {
+	res = allocObjectVector(cls, n);
+	for (i = 0; i < n; i++)
+	    SET_VECTOR_ELT(res, i, VECTOR_ELT(value, i));
+    } else {
+	size_t es = vector_element_size(vc);
+	if (!es) A_error("cannot create '%s' from '%s'", cls->name, vc->name);
+	res = allocVarObject(cls, es * n, n);
+	memcpy(DIRECT_DATAPTR(res), ADataPtr(value), es * n);
+    }
+    return res;
+}
+
+/* class(x) - the name of the class of x */
+AObject *fn_class(AObject *args, AObject *where) {
+    return mkString(className(eval(getAttr(args, AS_head), where)));
+}
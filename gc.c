@@ -1,5 +1,220 @@
 #include "aleph.h"
 
-/* this will eventually perform the garbage collection. It is callen by low-level memory alloc functions when they're running out of memory -- should probably be called more often, though ... */
+#include <sys/time.h>
+
+/* Mark-and-sweep garbage collector for the gc pool (see the description of pools in aleph.h).
+
+   We use two colors so that no separate pass is needed to reset marks: after a collection all live objects have the color gc_color and new objects are created with it as well. A collection flips the color, so at its start every object has the "unreached" color. Objects in the gc pool are explicitly set to that color (so they are marked as candidates for removal), then everything reachable from the local pools is re-colored. The traversal follows all references, but it stops at objects that have already been re-colored, so cycles (which can only go through objects in the gc pool) are fine. Finally all objects in the gc pool that still have the old color are freed (along with any objects owned exclusively by them).
+
+   The collector is run when the memory allocated in objects since the last run exceeds gc_threshold (see GC_CHECK) and when malloc fails. It only sees the pools of the main thread, so it doesn't run while other threads are running - it will run once they have been joined (see threads.c). */
+
+#define GC_MIN_THRESHOLD (8 * 1024 * 1024)
+
+vsize_t gc_threshold = GC_MIN_THRESHOLD;
+unsigned short gc_color = 0;
+
+static int gc_running = 0;
+
+/* statistics */
+static unsigned long gc_runs = 0, gc_objects_freed = 0;
+static double gc_bytes_freed = 0.0, gc_pause_total = 0.0, gc_pause_last = 0.0, gc_pause_max = 0.0;
+static vsize_t gc_live_bytes = 0;
+
+/* work stack used by both the traversal and freeOwned */
+typedef struct {
+    AObject **item;
+    vlen_t n, size;
+} gc_stack_t;
+
+static gc_stack_t mark_stack, preserved;
+static __thread gc_stack_t free_stack; /* freeOwned is used by all threads */
+
+static void stack_push(gc_stack_t *s, AObject *o) {
+    if (s->n == s->size) {
+	/* we can't call Arealloc() since it could call the collector */
+	vlen_t ns = s->size ? (s->size * 2) : 1024;
+	AObject **ni = (AObject**) realloc(s->item, sizeof(AObject*) * ns);
+	if (!ni) {
+	    fprintf(stderr, "FATAL: out of memory in garbage collector\n");
+	    abort();
+	}
+	s->item = ni;
+	s->size = ns;
+    }
+    s->item[s->n++] = o;
+}
+
+static void push_owned(AObject *o, void *ctx) {
+    if (!o->pool)
+	stack_push((gc_stack_t*) ctx, o);
+}
+
+/* free all objects owned exclusively by o (objects without a pool are owned by a single other object). The object itself is not freed. */
+void freeOwned(AObject *o) {
+    vlen_t base = free_stack.n; /* we may be called from within the sweep */
+    CLASS(o)->traverse(o, push_owned, &free_stack);
+    while (free_stack.n > base) {
+	AObject *c = free_stack.item[--free_stack.n];
+	CLASS(c)->traverse(c, push_owned, &free_stack);
+	A_debug(ADL_alloc, " - freeing owned object <%p>", c);
+	if (gc_running) {
+	    gc_objects_freed++;
+	    gc_bytes_freed += (double) objectSize(c);
+	}
+	freeObjectMemory(c);
+    }
+}
+
+static unsigned short live_color;
+
+static void mark_ref(AObject *o, void *ctx) {
+    if ((o->flags & AOF_COLOR) != live_color) {
+	o->flags = (o->flags & ~AOF_COLOR) | live_color;
+	stack_push(&mark_stack, o);
+    }
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((double) tv.tv_sec) + ((double) tv.tv_usec) / 1000000.0;
+}
+
+/* this is called by the allocation functions, either when enough memory has been allocated since the last run or when they're running out of memory */
 void gc_run(size_t needed) {
+    AllocationPool *pool;
+#ifdef ADEBUG
+    unsigned long freed0 = gc_objects_freed;
+    double bytes0 = gc_bytes_freed;
+#endif
+    double t0;
+    vlen_t i, j, n;
+
+    if (gc_running || !gc_pool || aleph_threads) return;
+    gc_running = 1;
+    t0 = now();
+    live_color = gc_color ^ AOF_COLOR;
+
+    /* 1) mark all objects in the gc pool as unreached */
+    for (i = 0, n = gc_pool->watermark; i < n; i++)
+	if (gc_pool->item[i])
+	    gc_pool->item[i]->flags = (gc_pool->item[i]->flags & ~AOF_COLOR) | gc_color;
+
+    /* 2) re-color everything reachable from the local pools and preserved objects */
+    for (pool = root_pool; pool; pool = pool->next)
+	for (i = 0, n = pool->watermark; i < n; i++)
+	    if (pool->item[i])
+		mark_ref(pool->item[i], 0);
+    for (i = 0; i < preserved.n; i++)
+	mark_ref(preserved.item[i], 0);
+    while (mark_stack.n) {
+	AObject *o = mark_stack.item[--mark_stack.n];
+	CLASS(o)->traverse(o, mark_ref, 0);
+    }
+
+    /* 3) sweep the gc pool. Unreached objects can still reference each other, so we free what they own first and only then the objects themselves */
+    gc_live_bytes = 0;
+    for (i = 0, n = gc_pool->watermark; i < n; i++) {
+	AObject *o = gc_pool->item[i];
+	if (o) {
+	    if ((o->flags & AOF_COLOR) != live_color)
+		freeOwned(o);
+	    else
+		gc_live_bytes += objectSize(o);
+	}
+    }
+    /* the second pass also compacts the pool, so there are no holes left */
+    for (i = 0, j = 0, n = gc_pool->watermark; i < n; i++) {
+	AObject *o = gc_pool->item[i];
+	if (o) {
+	    if ((o->flags & AOF_COLOR) != live_color) {
+		gc_objects_freed++;
+		gc_bytes_freed += (double) objectSize(o);
+		freeObjectMemory(o);
+		gc_pool->count--;
+	    } else {
+		gc_pool->item[j] = o;
+		o->slot = j++;
+	    }
+	}
+    }
+    gc_pool->watermark = j;
+    gc_pool->holes = 0;
+
+    gc_color = live_color;
+    currentThreadContext()->allocated = 0;
+    /* let the heap grow to twice the live size before we collect again */
+    gc_threshold = (gc_live_bytes > GC_MIN_THRESHOLD) ? gc_live_bytes : GC_MIN_THRESHOLD;
+    gc_pause_last = now() - t0;
+    gc_pause_total += gc_pause_last;
+    if (gc_pause_last > gc_pause_max) gc_pause_max = gc_pause_last;
+    gc_runs++;
+    gc_running = 0;
+    A_debug(ADL_info, "-- gc: freed %lu objects (%.0f bytes) in %.3fms, %lu bytes live",
+	    gc_objects_freed - freed0, gc_bytes_freed - bytes0, gc_pause_last * 1000.0, (unsigned long) gc_live_bytes);
+}
+
+/* Objects that are referenced only from C code (e.g. the global environment) have no owner that would keep them alive once they have been moved to the gc pool, so they have to be registered as additional roots. The object is moved to the gc pool (it may have any number of owners from now on). */
+AObject *preserveObject(AObject *o) {
+    A_LOCK(gc_lock);
+    if (o->pool != gc_pool) {
+	if (o->pool)
+	    removeObjectFromPool(o, o->pool);
+	addObjectToPool(o, gc_pool);
+    }
+    stack_push(&preserved, o);
+    A_UNLOCK(gc_lock);
+    return o;
+}
+
+void releaseObject(AObject *o) {
+    vlen_t i;
+    A_LOCK(gc_lock);
+    for (i = preserved.n; i > 0; i--)
+	if (preserved.item[i - 1] == o) {
+	    preserved.item[i - 1] = preserved.item[--preserved.n];
+	    break;
+	}
+    A_UNLOCK(gc_lock);
+}
+
+/* release the free stack of a thread that is about to exit */
+void gc_thread_exit() {
+    free(free_stack.item);
+    free_stack.item = 0;
+    free_stack.n = free_stack.size = 0;
+}
+
+void gc_print_stats() {
+    A_printf("GC: %lu runs, %lu objects (%.0f bytes) freed, pause total %.3fms, max %.3fms\n",
+	     gc_runs, gc_objects_freed, gc_bytes_freed, gc_pause_total * 1000.0, gc_pause_max * 1000.0);
+#if NURSERY
+    {
+	ANursery *n = &currentThreadContext()->nursery;
+	A_printf("Nursery: %lu objects allocated in %lu chunks, chunks emptied %lu times\n", n->objects, n->chunks, n->recycled);
+    }
+#endif
+}
+
+/* gc() - runs the collector and returns its statistics */
+AObject *fn_gc(AObject *args, AObject *where) {
+    static const char *names[] = { "runs", "objects.freed", "bytes.freed", "pause.last.ms", "pause.total.ms", "pause.max.ms", "bytes.live" };
+    AObject *res, *nam;
+    double *d;
+    vlen_t i;
+    gc_run(0);
+    res = allocRealVector(7);
+    d = REAL(res);
+    d[0] = (double) gc_runs;
+    d[1] = (double) gc_objects_freed;
+    d[2] = gc_bytes_freed;
+    d[3] = gc_pause_last * 1000.0;
+    d[4] = gc_pause_total * 1000.0;
+    d[5] = gc_pause_max * 1000.0;
+    d[6] = (double) gc_live_bytes;
+    nam = allocObjectVector(stringClass, 7);
+    for (i = 0; i < 7; i++)
+	SET_STRING_ELT(nam, i, mkChar(names[i]));
+    setAttr(res, AS_names, nam);
+    return res;
 }
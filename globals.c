@@ -1,10 +1,21 @@
 #include "aleph.h"
 
-jmp_buf error_jmpbuf;
-
-ASymbol symbol[MAX_SYM];
-vlen_t  symbols = 0;
+ASymbolDir *symbol_dir;
+vlen_t  symbols = 0, symbol_chunks = 0;
+ASymbolHash *symbol_hash;
 
 ThreadContext mainThreadContext;
+__thread ThreadContext *thread_context = &mainThreadContext;
+
+int aleph_threads = 0;
+pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER, symbol_lock = PTHREAD_MUTEX_INITIALIZER, alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long frame_serial = 0;
+
+AClass **class_list;
+vlen_t classes = 0, class_list_size = 0, class_ids = 0;
+unsigned long dispatch_epoch = 1;
 
 AllocationPool *gc_pool, *root_pool;
+
+AObject *globalEnv;
@@ -373,6 +373,9 @@ cr	:					{ EatLines = 1; }
 
 static int (*ptr_getc)(void);
 
+/* Input is read from the block parse_ptr..parse_end and ptr_getc() is only called when it is used up. Sources that have their text in memory make it all one block, files fill the block a line at a time (see file_getc), so xxgetrun() can take runs of blanks, symbol characters and digits straight from it */
+static const char *parse_ptr, *parse_end;
+
 /* Private pushback, since file ungetc only guarantees one byte.
    We need up to one MBCS-worth */
 
@@ -389,7 +392,9 @@ static int xxgetc(void)
 {
     int c;
 
-    if(npush) c = pushback[--npush]; else  c = ptr_getc();
+    if(npush) c = pushback[--npush];
+    else if(parse_ptr < parse_end) c = (unsigned char) *parse_ptr++;
+    else c = ptr_getc();
 
     prevpos = (prevpos + 1) % PUSHBACK_BUFSIZE;
     prevcols[prevpos] = xxcolno;
@@ -448,6 +453,55 @@ static int xxungetc(int c)
     return c;
 }
 
+/* character classes for xxgetrun */
+#define LEX_BLANK   1 /* space, tab and form feed */
+#define LEX_SYMBOL  2 /* ASCII letters and digits, '.' and '_' */
+#define LEX_DIGIT   4
+#define LEX_COMMENT 8 /* anything but a newline */
+
+static unsigned char lex_class[256];
+
+static void lex_init(void)
+{
+    int c;
+    for (c = 0; c < 256; c++)
+	lex_class[c] = ((c == ' ' || c == '\t' || c == '\f') ? LEX_BLANK : 0) |
+	    ((c < 0x80 && (isalnum(c) || c == '.' || c == '_')) ? LEX_SYMBOL : 0) |
+	    ((c >= '0' && c <= '9') ? LEX_DIGIT : 0) |
+	    ((c != '\n') ? LEX_COMMENT : 0);
+}
+
+/* Fast path of xxgetc for a run of characters of the class cls: takes all such characters at the start of the input block (at most room if dst is set, they are copied there) and does the bookkeeping of xxgetc for them at once. Returns their number. Only the position after the run is kept for xxungetc, so the caller has to read the next character with xxgetc before it can push back */
+static int xxgetrun(char *dst, int room, int cls)
+{
+    const unsigned char *s = (const unsigned char *) parse_ptr;
+    int n = 0, i, max = (int) (parse_end - parse_ptr);
+
+    if (npush || max <= 0) return 0;
+    if (dst && max > room) max = room;
+    while (n < max && (lex_class[s[n]] & cls)) n++;
+    if (!n) return 0;
+    if (dst) memcpy(dst, s, n);
+    for (i = 0; i < n; i++) {
+	R_ParseContextLast = (R_ParseContextLast + 1) % PARSE_CONTEXT_SIZE;
+	R_ParseContext[R_ParseContextLast] = s[i];
+	if (s[i] == '\t')
+	    xxcolno = (xxcolno + 8) & ~7;
+	else if (!(0x80 <= s[i] && s[i] <= 0xBF && known_to_be_utf8))
+	    xxcolno++;
+    }
+    xxbyteno += n;
+    if ( KeepSource && GenerateCode && FunctionLevel > 0 ) {
+	if(SourcePtr + n <= FunctionSource + MAXFUNSIZE) {
+	    memcpy(SourcePtr, s, n);
+	    SourcePtr += n;
+	} else error(_("function is too long to keep source (at line %d)"), xxlineno);
+    }
+    xxcharcount += n;
+    parse_ptr += n;
+    return n;
+}
+
 static SEXP makeSrcref(YYLTYPE *lloc, SEXP srcfile)
 {
     SEXP val;
@@ -650,7 +704,7 @@ static SEXP xxnullsub0(YYLTYPE *lloc)
     SEXP ans;
     UNPROTECT_PTR(R_NilValue);
     if (GenerateCode)
-	PROTECT(ans = TagArg(R_MissingArg, install("NULL"), lloc));
+	PROTECT(ans = TagArg(R_MissingArg, installed(AS_NULL), lloc));
     else
 	PROTECT(ans = R_NilValue);
     return ans;
@@ -658,7 +712,7 @@ static SEXP xxnullsub0(YYLTYPE *lloc)
 
 static SEXP xxnullsub1(SEXP expr, YYLTYPE *lloc)
 {
-    SEXP ans = install("NULL");
+    SEXP ans = installed(AS_NULL);
     UNPROTECT_PTR(R_NilValue);
     if (GenerateCode)
 	PROTECT(ans = TagArg(expr, ans, lloc));
@@ -875,7 +929,7 @@ static SEXP xxdefun(SEXP fname, SEXP formals, SEXP body)
 		}
 	    /* PrintValue(source); */
 	}
-	PROTECT(ans = lang4(fname, CDR(formals), body, source));
+	PROTECT(ans = lang4(fname, (formals == R_NilValue) ? R_NilValue : CDR(formals), body, source)); /* (unlike in R, CDR(R_NilValue) is not R_NilValue) */
 	UNPROTECT_PTR(source);
     }
     else
@@ -946,6 +1000,7 @@ static SEXP xxexprlist(SEXP a1, YYLTYPE *lloc, SEXP a2)
     if (GenerateCode) {
 #ifdef ALEPH
 	a2->attr[0] = (AObject*) langClass;
+	if (CAR(a2) == a2) CAR(a2) = R_NilValue; /* empty list, see NewList() */
 #else
 	SET_TYPEOF(a2, LANGSXP);
 #endif
@@ -996,7 +1051,12 @@ static SEXP TagArg(SEXP arg, SEXP tag, YYLTYPE *lloc)
 static SEXP NewList(void)
 {
     SEXP s = CONS(R_NilValue, R_NilValue);
+#ifdef ALEPH
+    /* the self-reference must not go through the write barrier - it would make s own itself and free it on the next SETCAR */
+    CAR(s) = s;
+#else
     SETCAR(s, s);
+#endif
     return s;
 }
 
@@ -1008,6 +1068,12 @@ static SEXP GrowList(SEXP l, SEXP s)
     PROTECT(s);
     tmp = CONS(s, R_NilValue);
     UNPROTECT(1);
+#ifdef ALEPH
+    if (CAR(l) == l) { /* empty list: drop the (non-owning) self-reference */
+	SETCDR(l, tmp);
+	CAR(l) = R_NilValue;
+    } else
+#endif
     SETCDR(CAR(l), tmp);
     SETCAR(l, tmp);
     return l;
@@ -1117,6 +1183,7 @@ static void ParseInit(void)
     KeepSource = *LOGICAL(GetOption(install("keep.source"), R_BaseEnv));
 #endif
     npush = 0;
+    if (!lex_class['a']) lex_init();
 }
 
 static void ParseContextInit(void)
@@ -1148,22 +1215,36 @@ static SEXP R_Parse1(ParseStatus *status)
 }
 
 static FILE *fp_parse;
+static long fp_parse_pos;
+static char *fp_line;
+static size_t fp_line_size;
 
+/* fill the input block with the next line of the file. Reading ahead no further than the end of the line keeps interactive input working */
 static int file_getc(void)
 {
-    return R_fgetc(fp_parse);
+    ssize_t n = getline(&fp_line, &fp_line_size, fp_parse);
+    if (n <= 0)
+	return EOF;
+    parse_ptr = fp_line + 1;
+    parse_end = fp_line + n;
+    return (unsigned char) fp_line[0];
 }
 
-/* used in main.c and this file */
+/* used in main.c and this file. The rest of the line of the last expression stays in the input block for the next call on the same file, so the file must not be read otherwise in between */
 attribute_hidden
 SEXP R_Parse1File(FILE *fp, int gencode, ParseStatus *status)
 {
     ParseInit();
     ParseContextInit();
     GenerateCode = gencode;
+    /* anything left in the input block has to be the rest of the line of this file */
+    if (parse_ptr < parse_end && (fp != fp_parse || ptr_getc != file_getc || ftell(fp) != fp_parse_pos))
+	parse_ptr = parse_end = 0;
     fp_parse = fp;
     ptr_getc = file_getc;
     R_Parse1(status);
+    if (parse_ptr < parse_end)
+	fp_parse_pos = ftell(fp);
     return R_CurrentExpr;
 }
 
@@ -1186,6 +1267,7 @@ SEXP R_Parse1Buffer(IoBuffer *buffer, int gencode, ParseStatus *status)
     ParseContextInit();
     GenerateCode = gencode;
     iob = buffer;
+    parse_ptr = parse_end = 0;
     ptr_getc = buffer_getc;
     R_Parse1(status);
     return R_CurrentExpr;
@@ -1251,7 +1333,14 @@ static SEXP R_Parse(int n, ParseStatus *status, SEXP srcfile)
 finish:
 
     t = CDR(t);
+#ifdef ALEPH
+    /* (length() doesn't count the elements of pairlists) */
+    for (n = 0, rval = t; rval != R_NilValue; rval = CDR(rval))
+	n++;
+    rval = allocVector(EXPRSXP, n);
+#else
     rval = allocVector(EXPRSXP, length(t));
+#endif
     for (n = 0 ; n < LENGTH(rval) ; n++, t = CDR(t))
 	SET_VECTOR_ELT(rval, n, CAR(t));
     if (SrcFile) {
@@ -1273,6 +1362,7 @@ SEXP R_ParseFile(FILE *fp, int n, ParseStatus *status, SEXP srcfile)
 {
     GenerateCode = 1;
     fp_parse = fp;
+    parse_ptr = parse_end = 0;
     ptr_getc = file_getc;
     return R_Parse(n, status, srcfile);
 }
@@ -1297,6 +1387,7 @@ SEXP R_ParseConn(Rconnection con, int n, ParseStatus *status, SEXP srcfile)
 {
     GenerateCode = 1;
     con_parse = con;
+    parse_ptr = parse_end = 0;
     ptr_getc = con_getc;
     return R_Parse(n, status, srcfile);
 }
@@ -1309,6 +1400,7 @@ SEXP R_ParseVector(SEXP text, int n, ParseStatus *status, SEXP srcfile)
     R_TextBufferInit(&textb, text);
     txtb = &textb;
     GenerateCode = 1;
+    parse_ptr = parse_end = 0;
     ptr_getc = text_getc;
     rval = R_Parse(n, status, srcfile);
     R_TextBufferFree(&textb);
@@ -1351,6 +1443,7 @@ SEXP R_ParseBuffer(IoBuffer *buffer, int n, ParseStatus *status, SEXP prompt, SE
     xxbyteno = 0;
     GenerateCode = 1;
     iob = buffer;
+    parse_ptr = parse_end = 0;
     ptr_getc = buffer_getc;
 
     if (!isNull(srcfile)) {
@@ -1412,6 +1505,41 @@ finish:
     return rval;
 }
 
+#else
+
+static char *text_block;
+static size_t text_block_size;
+
+static int text_getc(void)
+{
+    return EOF;
+}
+
+/* text is a character vector of lines. They are joined into one input block, so the lexer reads all of it directly */
+SEXP R_ParseVector(SEXP text, int n, ParseStatus *status, SEXP srcfile)
+{
+    vlen_t i, lines = LENGTH(text);
+    size_t len = 0, l;
+    char *p;
+    for (i = 0; i < lines; i++)
+	len += strlen(CHAR(STRING_ELT(text, i))) + 1;
+    if (len > text_block_size) {
+	text_block = (char*) Arealloc(text_block, len);
+	text_block_size = len;
+    }
+    for (i = 0, p = text_block; i < lines; i++) {
+	l = strlen(CHAR(STRING_ELT(text, i)));
+	memcpy(p, CHAR(STRING_ELT(text, i)), l);
+	p += l;
+	*(p++) = '\n';
+    }
+    GenerateCode = 1;
+    parse_ptr = text_block;
+    parse_end = p;
+    ptr_getc = text_getc;
+    return R_Parse(n, status, srcfile);
+}
+
 #endif
 
 /*----------------------------------------------------------------------------
@@ -1484,29 +1612,30 @@ static int nextchar(int expect)
 struct {
     char *name;
     int token;
+    symbol_t sym; /* the symbol for keywords that are parsed as symbols */
 }
 static keywords[] = {
-    { "NULL",	    NULL_CONST },
-    { "NA",	    NUM_CONST  },
-    { "TRUE",	    NUM_CONST  },
-    { "FALSE",	    NUM_CONST  },
-    { "Inf",	    NUM_CONST  },
-    { "NaN",	    NUM_CONST  },
-    { "NA_integer_", NUM_CONST  },
-    { "NA_real_",    NUM_CONST  },
-    { "NA_character_", NUM_CONST  },
-    { "NA_complex_", NUM_CONST  },
-    { "function",   FUNCTION   },
-    { "while",	    WHILE      },
-    { "repeat",	    REPEAT     },
-    { "for",	    FOR	       },
-    { "if",	    IF	       },
-    { "in",	    IN	       },
-    { "else",	    ELSE       },
-    { "next",	    NEXT       },
-    { "break",	    BREAK      },
-    { "...",	    SYMBOL     },
-    { 0,	    0	       }
+    { "NULL",          NULL_CONST, 0 },
+    { "NA",            NUM_CONST,  0 },
+    { "TRUE",          NUM_CONST,  0 },
+    { "FALSE",         NUM_CONST,  0 },
+    { "Inf",           NUM_CONST,  0 },
+    { "NaN",           NUM_CONST,  0 },
+    { "NA_integer_",   NUM_CONST,  0 },
+    { "NA_real_",      NUM_CONST,  0 },
+    { "NA_character_", NUM_CONST,  0 },
+    { "NA_complex_",   NUM_CONST,  0 },
+    { "function",      FUNCTION,   AS_function },
+    { "while",         WHILE,      AS_while },
+    { "repeat",        REPEAT,     AS_repeat },
+    { "for",           FOR,        AS_for },
+    { "if",            IF,         AS_if },
+    { "in",            IN,         0 },
+    { "else",          ELSE,       0 },
+    { "next",          NEXT,       AS_next },
+    { "break",         BREAK,      AS_break },
+    { "...",           SYMBOL,     AS_dots },
+    { 0,               0,          0 }
 };
 
 /* KeywordLookup has side effects, it sets yylval */
@@ -1567,13 +1696,13 @@ static int KeywordLookup(const char *s)
 	    case IF:
 	    case NEXT:
 	    case BREAK:
-		yylval = install(s);
+		yylval = installed(keywords[i].sym);
 		break;
 	    case IN:
 	    case ELSE:
 		break;
 	    case SYMBOL:
-		PROTECT(yylval = install(s));
+		PROTECT(yylval = installed(keywords[i].sym));
 		break;
 	    }
 	    return keywords[i].token;
@@ -1777,7 +1906,10 @@ static int SkipSpace(void)
 	}
     } else
 #endif
+    {
+	xxgetrun(NULL, 0, LEX_BLANK);
 	while ((c = xxgetc()) == ' ' || c == '\t' || c == '\f') ;
+    }
     return c;
 }
 
@@ -1790,6 +1922,7 @@ static int SkipSpace(void)
 static int SkipComment(void)
 {
     int c;
+    xxgetrun(NULL, 0, LEX_COMMENT);
     while ((c = xxgetc()) != '\n' && c != R_EOF) ;
     if (c == R_EOF) EndOfFile = 2;
     return c;
@@ -1802,9 +1935,15 @@ static int NumericValue(int c)
     int last = c;
     int nd = 0;
     int asNumeric = 0;
+    int run;
 
     DECLARE_YYTEXT_BUFP(yyp);
     YYTEXT_PUSH(c, yyp);
+    /* runs of digits are taken from the input block at once */
+    if ((run = xxgetrun(yyp, sizeof(yytext) - 2 - (yyp - yytext), LEX_DIGIT))) {
+	yyp += run;
+	last = yyp[-1];
+    }
     /* We don't care about other than ASCII digits */
     while (isdigit(c = xxgetc()) || c == '.' || c == 'e' || c == 'E'
 	   || c == 'x' || c == 'X' || c == 'L')
@@ -1856,6 +1995,10 @@ static int NumericValue(int c)
 	}
 	YYTEXT_PUSH(c, yyp);
 	last = c;
+	if ((run = xxgetrun(yyp, sizeof(yytext) - 2 - (yyp - yytext), LEX_DIGIT))) {
+	    yyp += run;
+	    last = yyp[-1];
+	}
     }
     YYTEXT_PUSH('\0', yyp);
     /* Make certain that things are okay. */
@@ -2410,6 +2553,7 @@ static int SymbolValue(int c)
 #endif
 	do {
 	    YYTEXT_PUSH(c, yyp);
+	    yyp += xxgetrun(yyp, sizeof(yytext) - 2 - (yyp - yytext), LEX_SYMBOL);
 	} while ((c = xxgetc()) != R_EOF &&
 		 (isalnum(c) || c == '.' || c == '_'));
     xxungetc(c);
@@ -2506,110 +2650,110 @@ static int token(void)
     switch (c) {
     case '<':
 	if (nextchar('=')) {
-	    yylval = install("<=");
+	    yylval = installed(AS_le);
 	    return LE;
 	}
 	if (nextchar('-')) {
-	    yylval = install("<-");
+	    yylval = installed(AS_left_assign);
 	    return LEFT_ASSIGN;
 	}
 	if (nextchar('<')) {
 	    if (nextchar('-')) {
-		yylval = install("<<-");
+		yylval = installed(AS_super_assign);
 		return LEFT_ASSIGN;
 	    }
 	    else
 		return ERROR;
 	}
-	yylval = install("<");
+	yylval = installed(AS_lt);
 	return LT;
     case '-':
 	if (nextchar('>')) {
 	    if (nextchar('>')) {
-		yylval = install("<<-");
+		yylval = installed(AS_super_assign);
 		return RIGHT_ASSIGN;
 	    }
 	    else {
-		yylval = install("<-");
+		yylval = installed(AS_left_assign);
 		return RIGHT_ASSIGN;
 	    }
 	}
-	yylval = install("-");
+	yylval = installed(AS_minus);
 	return '-';
     case '>':
 	if (nextchar('=')) {
-	    yylval = install(">=");
+	    yylval = installed(AS_ge);
 	    return GE;
 	}
-	yylval = install(">");
+	yylval = installed(AS_gt);
 	return GT;
     case '!':
 	if (nextchar('=')) {
-	    yylval = install("!=");
+	    yylval = installed(AS_ne);
 	    return NE;
 	}
-	yylval = install("!");
+	yylval = installed(AS_not);
 	return '!';
     case '=':
 	if (nextchar('=')) {
-	    yylval = install("==");
+	    yylval = installed(AS_eq);
 	    return EQ;
 	}
-	yylval = install("=");
+	yylval = installed(AS_assign);
 	return EQ_ASSIGN;
     case ':':
 	if (nextchar(':')) {
 	    if (nextchar(':')) {
-		yylval = install(":::");
+		yylval = installed(AS_ns_get_int);
 		return NS_GET_INT;
 	    }
 	    else {
-		yylval = install("::");
+		yylval = installed(AS_ns_get);
 		return NS_GET;
 	    }
 	}
 	if (nextchar('=')) {
-	    yylval = install(":=");
+	    yylval = installed(AS_colon_assign);
 	    return LEFT_ASSIGN;
 	}
-	yylval = install(":");
+	yylval = installed(AS_colon);
 	return ':';
     case '&':
 	if (nextchar('&')) {
-	    yylval = install("&&");
+	    yylval = installed(AS_and2);
 	    return AND2;
 	}
-	yylval = install("&");
+	yylval = installed(AS_and);
 	return AND;
     case '|':
 	if (nextchar('|')) {
-	    yylval = install("||");
+	    yylval = installed(AS_or2);
 	    return OR2;
 	}
-	yylval = install("|");
+	yylval = installed(AS_or);
 	return OR;
     case LBRACE:
-	yylval = install("{");
+	yylval = installed(AS_brace);
 	return c;
     case RBRACE:
 	return c;
     case '(':
-	yylval = install("(");
+	yylval = installed(AS_paren);
 	return c;
     case ')':
 	return c;
     case '[':
 	if (nextchar('[')) {
-	    yylval = install("[[");
+	    yylval = installed(AS_bracket2);
 	    return LBB;
 	}
-	yylval = install("[");
+	yylval = installed(AS_bracket);
 	return c;
     case ']':
 	return c;
     case '?':
 	strcpy(yytext, "?");
-	yylval = install(yytext);
+	yylval = installed(AS_question);
 	return c;
     case '*':
 	/* Replace ** by ^.  This has been here since 1998, but is
@@ -2621,7 +2765,7 @@ static int token(void)
 	    c='^';
 	yytext[0] = c;
 	yytext[1] = '\0';
-	yylval = install(yytext);
+	yylval = installed((c == '^') ? AS_power : AS_times);
 	return c;
     case '+':
     case '/':
@@ -2631,7 +2775,7 @@ static int token(void)
     case '@':
 	yytext[0] = c;
 	yytext[1] = '\0';
-	yylval = install(yytext);
+	yylval = installed((c == '+') ? AS_plus : (c == '/') ? AS_divide : (c == '^') ? AS_power : (c == '~') ? AS_tilde : (c == '$') ? AS_dollar : AS_at);
 	return c;
     default:
 	return c;
@@ -2868,10 +3012,26 @@ static int yylex(void)
 SEXP parsingTest(FILE *f) {
     ParseStatus ps;
     R_ParseErrorMsg[0] = 0;
-    SEXP r = R_Parse1File(f, 1, &ps);
+    SEXP r;
+    do /* skip empty lines */
+	r = R_Parse1File(f, 1, &ps);
+    while (ps == PARSE_NULL);
 #ifdef A_DEBUG
     printf("parse status: %d, error message: %s\n", ps, R_ParseErrorMsg);
 #endif
+    /* R_CurrentExpr still holds the previous expression at the end of the input and on errors, but that may have been released already */
+    if (ps != PARSE_OK) {
+	if (ps == PARSE_ERROR)
+	    fprintf(stderr, "Error: parse error %s\n", R_ParseErrorMsg);
+	return NULL;
+    }
     return r;
 }
+
+/* only checks the syntax of the next expression in f (nothing is built). Returns the parse status */
+int parsingCheck(FILE *f) {
+    ParseStatus ps;
+    R_Parse1File(f, 0, &ps);
+    return ps;
+}
 #endif
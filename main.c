@@ -10,32 +10,20 @@ typedef AObject *(*native_fn_ptr)(AObject *args, AObject *where);
 /* native functions */
 static AObject *native_fn_call(AObject *obj, AObject *args, AObject *where) {
     native_fn_ptr ptr = (native_fn_ptr) obj->attr[obj->attrs + 1];
+    AllocationPool *scope;
     if (!ptr) A_error("Attempt to call a native function pointing to NULL");
-    return ptr(args, where);
+    args = expandDots(args, where);
+    if (obj->flags & AOF_NOSCOPE)
+	return ptr(args, where);
+    /* temporaries created by the call are released as soon as it returns */
+    scope = enterScope();
+    return leaveScope(scope, ptr(args, where));
 }
 
 #include <dlfcn.h>
 
 AClass *natFnClass;
 
-static AObject *create_native_fn(AObject *args, AObject *where) {
-    if (CLASS(args) != pairlistClass || CAR(args) == nullObject)
-	A_error("'name' is missing in call to nativeFunction");
-    const char *name = CHAR(STRING_ELT(CAR(args), 0));
-    void *dl = dlopen(NULL, RTLD_LAZY | RTLD_GLOBAL);
-    if (!dl) A_error("cannot open dynamc library");
-    void *addr = dlsym(dl, name);
-    if (!addr) {
-	dlclose(dl);
-	A_error("unable to find symbol '%s'", name);
-    }
-    AObject *fn = allocVarObject(natFnClass, sizeof(void*), 0);
-    setAttr(fn, newSymbol("formals"), CDR(args));
-    setAttr(fn, newSymbol("environment"), where);
-    fn->attr[fn->attrs + 1] = addr;
-    return fn;
-}
-
 int alephInitialize() {
     if (aleph_initialized) return 0;
 
@@ -46,7 +34,7 @@ int alephInitialize() {
 
     A_printf("----------------------------------------\n\n Aleph v0.0 (absolutely experimental)\n\n");
 
-    gc_pool = newCustomPool(NULL, 1024*1024); /* create the garbage collector pool. It's large by default since we don't want to be allocating too many of them (but it could be probably smaller ...) */
+    gc_pool = newCustomPool(NULL, 64*1024); /* create the garbage collector pool (it grows as needed) */
     root_pool = newPool(); /* create the root pool */
     
     A_debug(ADL_info, "sizeof(AObject) = %u, sizeof(AClass) = %u", (unsigned int) sizeof(AObject), (unsigned int) sizeof(AClass));
@@ -54,12 +42,15 @@ int alephInitialize() {
     /* fix up pools for all static objects -- we are currently flagging constants with gc_pool even though they are not incuded it in, because objects with gc_pool are not freed */
     nullObject->pool = gc_pool;
     
-    newSymbol(""); /* symbol at index 0 is the empty symbol - it is interpreted as no symbol in maps */
-    newSymbol("class"); /* symbol #1 is the class */
+    addWellKnownSymbols(); /* the AS_* symbols, starting with the empty symbol at index 0 (no symbol in maps) and the class (#1) */
     
     /* adjust class to have object as its superclass - we can't do that statically since there is a loop */
     classClass->supers = 1;
     classClass->super[0] = objectClass;
+    initClassAncestry(objectClass);
+    initClassAncestry(classClass);
+    initClassAncestry(nullClass);
+    initClassAncestry(symbolClass);
     
     /* set low-level functions for the most basic classes that we created statically */
     symbolClass->copy = classClass->copy = objectClass->copy = default_copy;
@@ -69,23 +60,28 @@ int alephInitialize() {
     nullClass->eval = classClass->eval = objectClass->eval = default_eval;
     symbolClass->eval = symbol_eval;
     nullClass->call = symbolClass->call = classClass->call = objectClass->call = default_call;
+    nullClass->traverse = symbolClass->traverse = classClass->traverse = objectClass->traverse = default_traverse;
     
     /* set pool to gc_pool for all static classes as constants */
     symbolClass->class_obj.pool = nullClass->class_obj.pool = classClass->class_obj.pool = objectClass->class_obj.pool = gc_pool;
 
-    /* FIXME: this is a temporary definitiong of environments */
-    symbol_t envAttrs[4] = { newSymbol("names"), newSymbol("values"), newSymbol("parent"), 0 };
+    /* environments hold their bindings in a frame (see ENV_FRAME_ATTR_ID and ENV_PARENT_ATTR_ID for the layout) */
+    frameClass = subclass(objectClass, "frame", NULL, NULL);
+    frameClass->copy = default_nocopy;
+    frameClass->traverse = frame_traverse;
+    symbol_t envAttrs[3] = { AS_frame, AS_parent, 0 };
     envClass = subclass(objectClass, "environment", envAttrs, NULL);
     envClass->copy = default_nocopy; /* reference semantics */
     
     /* define most basic classes that are not directly definable due to cycles */
     charClass = subclass(objectClass, "characterString", NULL, NULL); /* this one doesn't really exist in R */
-    symbol_t vectorAttrs[2] = { AS_names = newSymbol("names"), 0 };
+    symbol_t vectorAttrs[2] = { AS_names, 0 };
     vectorClass = subclass(objectClass, "vector", vectorAttrs, NULL); /* we cannot specify type because character class doesn't exist yet */
     stringClass = subclass(vectorClass, "character", NULL, NULL);
+    stringClass->traverse = objvector_traverse;
     vectorClass->attr_classes[0] = stringClass; /* fix up class for "names" now that we have defined "character" class */
     stringClass->attr_classes[0] = stringClass; /* the fixup is needed in both class object */
-    symbol_t pairlistAttrs[4] = { AS_head = newSymbol("head"), AS_tag = newSymbol("tag"), AS_next = newSymbol("next"), 0 };
+    symbol_t pairlistAttrs[4] = { AS_head, AS_tag, AS_next, 0 };
     pairlistClass = subclass(objectClass, "pairlist", pairlistAttrs, NULL);
     pairlistClass->attr_classes[0] = pairlistClass; /* "next" is recursive */
 
@@ -96,14 +92,25 @@ int alephInitialize() {
     realClass = subclass(numericClass, "real", NULL, NULL);
     integerClass = subclass(numericClass, "integer", NULL, NULL);
     listClass = subclass(vectorClass, "list", NULL, NULL);
+    listClass->traverse = objvector_traverse;
     logicalClass = subclass(vectorClass, "logical", NULL, NULL);
     complexClass = subclass(vectorClass, "complex", NULL, NULL);
+    /* numeric results can be deferred expressions (see arith.c) */
+    realClass->dataPtr = integerClass->dataPtr = logicalClass->dataPtr = vector_dataPtr;
+    realClass->traverse = integerClass->traverse = logicalClass->traverse = vector_traverse;
+    /* owner of a memory-mapped file that vectors can be views into (see mapped.c) */
+    mappedFileClass = subclass(objectClass, "mappedFile", NULL, NULL);
+    mappedFileClass->copy = default_nocopy;
 
     AClass *pointerClass = subclass(objectClass, "pointer", NULL, NULL);
     /* FIXME: this is a quick hack for experiments - we will need arguments (formals) and possibly other info */
-    symbol_t natFnAttr[3] = { newSymbol("formals"), newSymbol("environment"), 0 };
+    symbol_t natFnAttr[3] = { AS_formals, AS_environment, 0 };
     natFnClass = subclass(pointerClass, "nativeFunction", natFnAttr, NULL);
     natFnClass->call = native_fn_call;
+    bytecode_init();
+    closure_init();
+    dispatch_init();
+    arith_init();
 
     /* initialize R compatibility code */
     /* NOTE: this will create some objects in the root pool, so the root pool should never go away until you're done with R */
@@ -120,6 +127,26 @@ AObject *foo(AObject *args, AObject *where) {
     return mkString("foo");
 }
 
+/* the benchmark driver (bench.c) has its own main() so it builds this file with ALEPH_NO_MAIN */
+#ifndef ALEPH_NO_MAIN
+
+static AObject *create_native_fn(AObject *args, AObject *where) {
+    if (CLASS(args) != pairlistClass || CAR(args) == nullObject)
+	A_error("'name' is missing in call to nativeFunction");
+    const char *name = CHAR(STRING_ELT(CAR(args), 0));
+    void *dl = dlopen(NULL, RTLD_LAZY | RTLD_GLOBAL);
+    if (!dl) A_error("cannot open dynamc library");
+    void *addr = dlsym(dl, name);
+    if (!addr) {
+	dlclose(dl);
+	A_error("unable to find symbol '%s'", name);
+    }
+    AObject *fn = allocVarObject(natFnClass, sizeof(void*), 0);
+    setAttr(fn, AS_formals, CDR(args));
+    setAttr(fn, AS_environment, where);
+    fn->attr[fn->attrs + 1] = addr;
+    return fn;
+}
 
 int main(int argc, char **argv) {
     if (alephInitialize())
@@ -148,17 +175,19 @@ int main(int argc, char **argv) {
     //PrintValue(getAttr(obj, newSymbol("names")));
     //PrintValue(getAttr(obj, newSymbol("class")));
     
-    //PrintValue((AObject*) &symbol[newSymbol("class")]);
+    //PrintValue((AObject*) sym_t2ASymbol(newSymbol("class")));
 #endif
 
-    /* our evaluation environemnt */
-    AObject *env = allocEnv();
+    /* our evaluation environemnt - it is referenced from here but its owners are the objects in it (e.g. native functions) so it has to be preserved */
+    AObject *env = globalEnv = preserveObject(allocEnv(NULL));
 
     /* create one object - the constructor to native functions so we can create them */
     AObject *natFnConstr = allocVarObject(natFnClass, sizeof(native_fn_ptr), 1);
     natFnConstr->attr[natFnConstr->attrs + 1] = (AObject*) create_native_fn;
-    symbol_set(newSymbol("nativeFunction"), natFnConstr, env);
-    symbol_set(newSymbol("="), create_native_fn(list1(mkString("fn_assign")), env), env);
+    symbol_set(AS_nativeFunction, natFnConstr, env);
+    AObject *assignFn = create_native_fn(list1(mkString("fn_assign")), env);
+    assignFn->flags |= AOF_NOSCOPE; /* the assigned value is moved out of the pool by the assignment anyway */
+    symbol_set(AS_assign, assignFn, env);
 
     /* PrintValue(env); */
 
@@ -167,8 +196,11 @@ int main(int argc, char **argv) {
     FILE *f = fopen("init.R", "r");
     if (f) {
 	while (!feof(f)) {
+	    AllocationPool *stmt = newPool();
 	    AObject *p = parsingTest(f);
 	    if (p) eval(p, env);
+	    releasePool(stmt);
+	    currentThreadContext()->pool = pool;
 	}
 	fclose(f);
     }
@@ -183,18 +215,32 @@ int main(int argc, char **argv) {
 	fprintf(stderr, "ERROR: cannot open test.R for reading\n");
     else {
 	while (1) {
+	    /* everything created while parsing and evaluating one expression lives in its own pool, so it is released right after the result has been printed. This also cleans up any scopes left behind by an error */
+	    AllocationPool *stmt = newPool();
 	    A_debug(ADL_info, "-- parsing ...");
 	    AObject *p = parsingTest(f);
 	    A_debug(ADL_info, "-- parser result:");
 #ifdef ADEBUG
 	    PrintValue(p);
 #endif
+	    if (p) {
+		/* set only if the evaluation succeeds: after an error (longjmp) it must not refer to anything from a previous statement */
+		AObject * volatile res = NULL;
+		A_debug(ADL_info, "-- evaluate:");
+		ON_ERROR
+		    res = NULL;
+		else {
+		    res = eval(p, env);
+		    checkNoLoopControl();
+		}
+		if (res) {
+		    A_debug(ADL_info, "-- result:");
+		    PrintValue(res);
+		}
+	    }
+	    releasePool(stmt);
+	    currentThreadContext()->pool = pool;
 	    if (!p) break;
-	    A_debug(ADL_info, "-- evaluate:");
-	    NEW_CONTEXT
-		p = eval(p, env);
-	    A_debug(ADL_info, "-- result:");
-	    PrintValue(p);
 	}
     }
 
@@ -205,8 +251,10 @@ int main(int argc, char **argv) {
     releasePool(root_pool); /* remove the root pool */
 
     A_printf("The gc pool contains %d objects\n", gc_pool->count);
+    gc_print_stats();
     releasePool(gc_pool); /* also remove the gc pool and thus all objects */
 
     return 0;
 }
 
+#endif
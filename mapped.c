@@ -0,0 +1,92 @@
+#include "aleph.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Numeric vectors backed by memory-mapped files.
+
+   A mapped vector is a regular real or integer vector flagged AOF_MAPPED whose data holds an AMapping instead of the elements - vector_dataPtr returns the address in the mapping, so everything that uses REAL()/INTEGER() (including the arithmetic kernels) works on the file contents in place. Nothing is read up front, the kernel pages the file in as it is touched. Files are mapped either read-only (writing to the vector is a fatal error) or copy-on-write (modified pages become private to the process, the file is never changed).
+
+   The mapping itself is owned by a mappedFile object (also flagged AOF_MAPPED) which unmaps the file when it is freed (see freeObjectMemory). Vectors are views into it and reference it, so a file can hold any number of vectors (see serialize.c) and stays mapped as long as any of them is alive. */
+
+void mapped_release(AObject *o) {
+    AMapping *m = MAPPING(o);
+    if (m->size) {
+	A_debug(ADL_alloc, " - unmap <%p> (%lu bytes)", m->addr, (unsigned long) m->size);
+	munmap(m->addr, m->size);
+	m->addr = 0;
+	m->size = 0;
+    }
+}
+
+/* map a whole file. Empty files result in an object without a mapping */
+AObject *mapFile(const char *file, int copy_on_write) {
+    struct stat st;
+    AObject *res;
+    void *addr = 0;
+    int fd = open(file, O_RDONLY);
+    if (fd == -1)
+	A_error("cannot open '%s': %s", file, strerror(errno));
+    if (fstat(fd, &st)) {
+	close(fd);
+	A_error("cannot stat '%s': %s", file, strerror(errno));
+    }
+    if (st.st_size) { /* mmap() doesn't allow empty mappings */
+	addr = mmap(NULL, st.st_size, copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+	    close(fd);
+	    A_error("cannot map '%s': %s", file, strerror(errno));
+	}
+	/* vectors are usually processed front to back, so read ahead aggressively */
+	madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd); /* the mapping keeps its own reference to the file */
+    res = allocVarObject(mappedFileClass, sizeof(AMapping), 0);
+    res->flags |= AOF_MAPPED;
+    MAPPING(res)->addr = addr;
+    MAPPING(res)->size = st.st_size;
+    return res;
+}
+
+/* create a vector of class cls and length len whose elements are at the given offset in a mapped file */
+AObject *mapView(AObject *file, size_t offset, AClass *cls, vlen_t len) {
+    AObject *res = allocVarObject(cls, sizeof(AMapping), len);
+    res->flags |= AOF_MAPPED;
+    MAPPING(res)->addr = ((char*) MAPPING(file)->addr) + offset;
+    set(&MAPPING(res)->file, file);
+    return res;
+}
+
+/* map a file of native doubles (cls = realClass) or ints (cls = integerClass) */
+AObject *mapVector(const char *file, AClass *cls, int copy_on_write) {
+    size_t es = (cls == realClass) ? sizeof(double) : sizeof(int);
+    AObject *f = mapFile(file, copy_on_write);
+    size_t size = MAPPING(f)->size;
+    if (size % es || size / es > (size_t) UINT_MAX)
+	A_error("size of '%s' is not a valid length for a vector of type '%s'", file, cls->name);
+    if (!size)
+	return allocVarObject(cls, 0, 0);
+    return mapView(f, 0, cls, (vlen_t) (size / es));
+}
+
+/* mmapVector(file, type = "real", mode = "r") - maps a file of raw (native byte order) doubles or integers (type "integer") as a vector. mode is "r" for read-only or "c" for copy-on-write */
+AObject *fn_mmap(AObject *args, AObject *where) {
+    const char *file, *type, *mode;
+    AClass *cls;
+    if (args == nullObject) A_error("missing file name");
+    file = stringArg(&args, where, "file", 0);
+    type = stringArg(&args, where, "type", "real");
+    mode = stringArg(&args, where, "mode", "r");
+    if (!strcmp(type, "real") || !strcmp(type, "double"))
+	cls = realClass;
+    else if (!strcmp(type, "integer"))
+	cls = integerClass;
+    else
+	return A_error("invalid type '%s', must be \"real\" or \"integer\"", type);
+    if (strcmp(mode, "r") && strcmp(mode, "c"))
+	A_error("invalid mode '%s', must be \"r\" or \"c\"", mode);
+    return mapVector(file, cls, mode[0] == 'c');
+}
@@ -0,0 +1,47 @@
+# generates symtab.h from symbols.def: awk -f mksymtab.awk symbols.def > symtab.h
+
+BEGIN {
+    n = 0;
+    print "/* generated from symbols.def by mksymtab.awk - do not edit */";
+    print "";
+    print "#ifndef ALEPH_SYMTAB_H__";
+    print "#define ALEPH_SYMTAB_H__";
+    print "";
+}
+
+/^[ \t]*(#|$)/ { next; }
+
+{
+    if (NF != 2 || $2 !~ /^".*"$/) {
+	printf("%s:%d: expected a constant name and a quoted symbol\n", FILENAME, FNR) > "/dev/stderr";
+	err = 1;
+	exit 1;
+    }
+    if (($1 in consts) || ($2 in syms)) {
+	printf("%s:%d: duplicate symbol %s %s\n", FILENAME, FNR, $1, $2) > "/dev/stderr";
+	err = 1;
+	exit 1;
+    }
+    consts[$1] = 1;
+    syms[$2] = 1;
+    printf("#define AS_%s ((symbol_t) %d)\n", $1, n);
+    name[n++] = $2;
+}
+
+# (exit in a rule still runs END)
+END {
+    if (err)
+	exit 1;
+    if (n < 2 || name[0] != "\"\"" || name[1] != "\"class\"") {
+	printf("%s: the first symbols must be \"\" and \"class\"\n", FILENAME) > "/dev/stderr";
+	exit 1;
+    }
+    print "";
+    printf("#define WELL_KNOWN_SYMBOLS %d\n", n);
+    printf("#define WELL_KNOWN_SYMBOL_NAMES {");
+    for (i = 0; i < n; i++)
+	printf("%s \\\n    %s", i ? "," : "", name[i]);
+    print " }";
+    print "";
+    print "#endif";
+}
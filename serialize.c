@@ -0,0 +1,418 @@
+#include "aleph.h"
+
+#include <errno.h>
+
+/* Binary serialization of object graphs.
+
+   saveObject() writes everything reachable from an object, loadObject() recreates it. The graph is flattened into a table of objects: references are indices into the table (starting at 1, 0 stands for NULL), so shared objects and cycles are preserved. The file is an ASerFile header followed by one record per object in table order:
+
+     ASerHeader   kind, number of attribute references, length, name size or class reference and size of the payload
+     name         name of a symbol or class (0-terminated)
+     attributes   attribute references (32-bit indices)
+     payload      raw elements, element references or environment bindings (pairs of symbol and value references)
+
+   Each section is padded to 8 bytes, so all payloads are aligned. The loader maps the file copy-on-write and large numeric payloads are not copied at all - the vectors are views into the mapping (see mapped.c), so loading costs the same no matter how large the vectors are. Symbols and classes are stored by name and resolved when loading (objects reference their class which always precedes them in the table), the global environment is stored as a reference to the global environment of the loading session. Numbers are in native byte order, so files can only be exchanged between machines of the same architecture. */
+
+#define SER_MAGIC   "ALEPHSR1"
+#define SER_VERSION 1
+
+/* payloads of at least this size are used in place instead of being copied */
+#define SER_MAP_MIN 4096
+
+#define SER_PAD(X) (((X) + 7) & ~((size_t) 7))
+
+typedef unsigned int ser_ref_t;
+
+enum { SER_NULL = 1, SER_SYMBOL, SER_CLASS, SER_GLOBALENV, SER_ENV, SER_PLAIN, SER_RAW, SER_REFS };
+
+typedef struct {
+    char magic[8];
+    unsigned int version, objects;
+    ser_ref_t root, reserved;
+} ASerFile;
+
+typedef struct {
+    unsigned int kind, refs; /* SER_* and number of attribute references */
+    vlen_t len;              /* vector length (number of bindings for environments) */
+    unsigned int name;       /* symbols and classes: size of the name including the terminating 0, other objects: reference to the class */
+    unsigned long size;      /* size of the payload */
+} ASerHeader;
+
+typedef struct {
+    AObject *obj;
+    ser_ref_t index;
+} ser_entry_t;
+
+typedef struct {
+    AObject **item;     /* the object table, item[0] is unused */
+    vlen_t n, size;
+    ser_entry_t *hash;  /* open addressing hash of table indices by object pointer */
+    vlen_t mask;
+    FILE *f;
+    ser_ref_t *ref;      /* all references in the order they are written, recorded while collecting the objects */
+    vsize_t refs, ref_size, ref_pos;
+    AObject *bad;        /* first object that cannot be serialized */
+} ser_t;
+
+/* scratch memory that is released with the current pool - also when we bail out with an error */
+static void *scratch(size_t size) {
+    return DIRECT_DATAPTR(allocVarObject(charClass, size, 0));
+}
+
+/* size of the elements of atomic vectors, also of classes derived from them (e.g. by new()), 0 for anything else */
+static vlen_t raw_element_size(AClass *cls) {
+    if (isAssignableClass(cls, realClass)) return sizeof(double);
+    if (isAssignableClass(cls, integerClass)) return sizeof(int);
+    if (isAssignableClass(cls, logicalClass)) return sizeof(bool_t);
+    if (isAssignableClass(cls, complexClass)) return sizeof(complex_t);
+    return 0;
+}
+
+/* returns 0 for objects that cannot be serialized */
+static unsigned int ser_kind(AObject *o) {
+    AClass *cls = CLASS(o);
+    if (o == nullObject) return SER_NULL;
+    if (cls == symbolClass) return SER_SYMBOL;
+    if (cls == classClass) return SER_CLASS;
+    if (o == globalEnv) return SER_GLOBALENV;
+    if (cls == envClass) return SER_ENV;
+    if (cls->traverse == objvector_traverse) return SER_REFS;
+    if (raw_element_size(cls) || cls == charClass) return SER_RAW;
+    if (!o->size) return SER_PLAIN;
+    return 0;
+}
+
+/* the high bits of the product are well mixed, so we use those */
+#define PTR_HASH(O) ((vlen_t) ((((unsigned long) (O)) * 0x9E3779B97F4A7C15ul) >> 32))
+
+static ser_ref_t ser_lookup(ser_t *s, AObject *o) {
+    vlen_t h = PTR_HASH(o) & s->mask;
+    while (s->hash[h].obj && s->hash[h].obj != o)
+	h = (h + 1) & s->mask;
+    return s->hash[h].index;
+}
+
+static void ser_insert(ser_t *s, AObject *o, ser_ref_t index) {
+    vlen_t h = PTR_HASH(o) & s->mask;
+    while (s->hash[h].obj) h = (h + 1) & s->mask;
+    s->hash[h].obj = o;
+    s->hash[h].index = index;
+}
+
+/* the hash is kept at most half full */
+static void ser_alloc_hash(ser_t *s) {
+    free(s->hash);
+    s->mask = s->size * 2 - 1;
+    s->hash = (ser_entry_t*) Acalloc(s->mask + 1, sizeof(ser_entry_t));
+}
+
+static void ser_free(ser_t *s) {
+    free(s->item);
+    free(s->hash);
+    free(s->ref);
+}
+
+/* add an object to the table unless it is already there. The tables are malloc'ed (we don't want large scratch objects to trigger collections), so errors are only raised once the caller has released them */
+static ser_ref_t ser_add(ser_t *s, AObject *o) {
+    unsigned int kind;
+    ser_ref_t r;
+    if (!o) return 0;
+    if ((r = ser_lookup(s, o))) return r;
+    if (!(kind = ser_kind(o))) {
+	if (!s->bad) s->bad = o;
+	return 0;
+    }
+    if (kind >= SER_PLAIN) /* the class has to be created first when loading */
+	ser_add(s, (AObject*) CLASS(o));
+    if (s->n == s->size) { /* the table is full - grow it and the hash */
+	vlen_t i;
+	s->size *= 2;
+	s->item = (AObject**) Arealloc(s->item, sizeof(AObject*) * s->size);
+	ser_alloc_hash(s);
+	for (i = 1; i < s->n; i++)
+	    ser_insert(s, s->item[i], i);
+    }
+    ser_insert(s, o, s->n);
+    s->item[s->n] = o;
+    return s->n++;
+}
+
+/* add a referenced object and record the reference */
+static void ser_collect(ser_t *s, AObject *o) {
+    ser_ref_t r = ser_add(s, o);
+    if (s->refs == s->ref_size) {
+	s->ref_size *= 2;
+	s->ref = (ser_ref_t*) Arealloc(s->ref, sizeof(ser_ref_t) * s->ref_size);
+    }
+    s->ref[s->refs++] = r;
+}
+
+/* references in the attribute section */
+static void ser_attrs(ser_t *s, AObject *o, unsigned int kind, void (*fn)(ser_t *, AObject *)) {
+    vlen_t i;
+    if (kind == SER_ENV)
+	fn(s, ENV_PARENT(o));
+    else if (kind >= SER_PLAIN)
+	for (i = 1; i <= o->attrs; i++)
+	    fn(s, o->attr[i]);
+}
+
+/* references in the payload */
+static void ser_payload(ser_t *s, AObject *o, unsigned int kind, void (*fn)(ser_t *, AObject *)) {
+    vlen_t i, n;
+    if (kind == SER_REFS) {
+	AObject **e = (AObject**) ADataPtr(o);
+	for (i = 0, n = LENGTH(o); i < n; i++)
+	    fn(s, e[i]);
+    } else if (kind == SER_ENV) {
+	AObject *frame = ENV_FRAME(o);
+	AFrameEntry *e = FRAME_ENTRY(frame);
+	for (i = 0, n = FRAME_CAPACITY(frame); i < n; i++)
+	    if (e[i].sym && e[i].value) {
+		fn(s, (AObject*) sym_t2ASymbol(e[i].sym));
+		fn(s, e[i].value);
+	    }
+    }
+}
+
+static vlen_t env_bindings(AObject *env) {
+    AObject *frame = ENV_FRAME(env);
+    AFrameEntry *e = FRAME_ENTRY(frame);
+    vlen_t i, n = FRAME_CAPACITY(frame), b = 0;
+    for (i = 0; i < n; i++)
+	if (e[i].sym && e[i].value) b++;
+    return b;
+}
+
+static void ser_write(ser_t *s, const void *data, size_t size) {
+    static const char zero[8];
+    if (size) fwrite(data, 1, size, s->f);
+    if (SER_PAD(size) != size) fwrite(zero, 1, SER_PAD(size) - size, s->f);
+}
+
+/* write the next n recorded references */
+static void write_refs(ser_t *s, vsize_t n) {
+    ser_write(s, s->ref + s->ref_pos, sizeof(ser_ref_t) * n);
+    s->ref_pos += n;
+}
+
+static void ser_record(ser_t *s, AObject *o) {
+    unsigned int kind = ser_kind(o);
+    ASerHeader h;
+    const char *name = 0;
+    const void *data = 0;
+    memset(&h, 0, sizeof(h));
+    h.kind = kind;
+    switch (kind) {
+    case SER_SYMBOL: name = ((ASymbol*) o)->name; break;
+    case SER_CLASS: name = ((AClass*) o)->name; break;
+    case SER_ENV:
+	h.refs = 1;
+	h.len = env_bindings(o);
+	h.size = sizeof(ser_ref_t) * 2 * h.len;
+	break;
+    case SER_PLAIN:
+    case SER_RAW:
+    case SER_REFS:
+	h.name = ser_lookup(s, (AObject*) CLASS(o));
+	h.refs = o->attrs;
+	h.len = LENGTH(o);
+	if (kind == SER_REFS)
+	    h.size = sizeof(ser_ref_t) * h.len;
+	else if (kind == SER_RAW) {
+	    /* deferred and compact vectors are materialized here */
+	    data = (CLASS(o) == charClass) ? DIRECT_DATAPTR(o) : ADataPtr(o);
+	    h.size = (CLASS(o) == charClass) ? o->size : (unsigned long) raw_element_size(CLASS(o)) * h.len;
+	}
+    }
+    if (name) h.name = strlen(name) + 1;
+    ser_write(s, &h, sizeof(h));
+    if (name) ser_write(s, name, h.name);
+    write_refs(s, h.refs);
+    if (kind == SER_RAW)
+	ser_write(s, data, h.size);
+    else
+	write_refs(s, h.size / sizeof(ser_ref_t));
+}
+
+/* write the object graph of o into a file */
+void saveObject(AObject *o, const char *file) {
+    ser_t s;
+    ASerFile fh;
+    vlen_t i;
+    int err;
+    memset(&s, 0, sizeof(s));
+    s.size = 1024;
+    s.item = (AObject**) Amalloc(sizeof(AObject*) * s.size);
+    ser_alloc_hash(&s);
+    s.ref_size = 4096;
+    s.ref = (ser_ref_t*) Amalloc(sizeof(ser_ref_t) * s.ref_size);
+    s.n = 1;
+    /* collect all objects - the table itself is the queue of objects whose references have to be visited */
+    ser_add(&s, o);
+    for (i = 1; i < s.n; i++) {
+	unsigned int kind = ser_kind(s.item[i]);
+	ser_attrs(&s, s.item[i], kind, ser_collect);
+	ser_payload(&s, s.item[i], kind, ser_collect);
+    }
+    if (s.bad) {
+	ser_free(&s);
+	A_error("cannot serialize objects of class '%s'", className(s.bad));
+    }
+    if (!(s.f = fopen(file, "wb"))) {
+	ser_free(&s);
+	A_error("cannot create '%s': %s", file, strerror(errno));
+    }
+    memcpy(fh.magic, SER_MAGIC, sizeof(fh.magic));
+    fh.version = SER_VERSION;
+    fh.objects = s.n - 1;
+    fh.root = ser_lookup(&s, o);
+    fh.reserved = 0;
+    ser_write(&s, &fh, sizeof(fh));
+    for (i = 1; i < s.n; i++)
+	ser_record(&s, s.item[i]);
+    err = ferror(s.f);
+    ser_free(&s);
+    if (fclose(s.f) || err)
+	A_error("error while writing '%s'", file);
+}
+
+static AObject *corrupt(const char *file) {
+    return A_error("'%s' is not a valid serialized object file", file);
+}
+
+/* read an object graph written by saveObject */
+AObject *loadObject(const char *file) {
+    AObject *map = mapFile(file, 1), **tbl;
+    const char *base = (const char*) MAPPING(map)->addr, *p;
+    size_t size = MAPPING(map)->size;
+    const ASerFile *fh = (const ASerFile*) base;
+    const ASerHeader **rec;
+    vlen_t i, j, n;
+
+    if (size < sizeof(ASerFile) || memcmp(fh->magic, SER_MAGIC, sizeof(fh->magic)) || fh->version != SER_VERSION ||
+	!fh->root || fh->root > fh->objects)
+	corrupt(file);
+    n = fh->objects;
+    if (n > (size - sizeof(ASerFile)) / sizeof(ASerHeader))
+	corrupt(file);
+    tbl = (AObject**) scratch(sizeof(AObject*) * (n + 1));
+    rec = (const ASerHeader**) scratch(sizeof(ASerHeader*) * (n + 1));
+
+    /* 1) create all objects */
+    p = base + sizeof(ASerFile);
+    for (i = 1; i <= n; i++) {
+	const ASerHeader *r = (const ASerHeader*) p;
+	const char *name = p + sizeof(ASerHeader), *payload;
+	size_t left = size - (p - base), refs_size, name_size;
+	AClass *cls = 0;
+	AObject *o = 0;
+	if (left < sizeof(ASerHeader) || r->refs > left / sizeof(ser_ref_t)) corrupt(file);
+	refs_size = SER_PAD(sizeof(ser_ref_t) * (size_t) r->refs);
+	name_size = (r->kind == SER_SYMBOL || r->kind == SER_CLASS) ? SER_PAD(r->name) : 0;
+	if (name_size > left || refs_size > left || r->size > left ||
+	    sizeof(ASerHeader) + name_size + refs_size + SER_PAD(r->size) > left ||
+	    (name_size && (!r->name || name[r->name - 1])))
+	    corrupt(file);
+	payload = name + name_size + refs_size;
+	if (r->kind >= SER_PLAIN && r->kind <= SER_REFS) {
+	    /* the class precedes its instances */
+	    if (!r->name || r->name >= i || CLASS(tbl[r->name]) != classClass)
+		corrupt(file);
+	    cls = (AClass*) tbl[r->name];
+	    if (cls->attrs != r->refs)
+		A_error("class '%s' has a different layout than in '%s'", cls->name, file);
+	}
+	switch (r->kind) {
+	case SER_NULL: o = nullObject; break;
+	case SER_GLOBALENV:
+	    if (!globalEnv) A_error("there is no global environment to load '%s' into", file);
+	    o = globalEnv;
+	    break;
+	case SER_SYMBOL:
+	    o = (AObject*) sym_t2ASymbol(newSymbol(name));
+	    break;
+	case SER_CLASS:
+	    if (!(cls = findClass(name)))
+		A_error("unknown class '%s' in '%s'", name, file);
+	    o = (AObject*) cls;
+	    break;
+	case SER_ENV:
+	    if (r->refs != 1 || r->size != sizeof(ser_ref_t) * 2 * (size_t) r->len) corrupt(file);
+	    o = allocEnv(NULL);
+	    break;
+	case SER_PLAIN:
+	    if (r->size) corrupt(file);
+	    o = allocObject(cls);
+	    o->len = r->len;
+	    break;
+	case SER_RAW: {
+	    vlen_t es = raw_element_size(cls);
+	    if (cls == charClass ? (r->size != (size_t) r->len + 1 || payload[r->len]) : (!es || r->size != (size_t) es * r->len))
+		corrupt(file);
+	    if (cls->dataPtr == vector_dataPtr && r->size >= SER_MAP_MIN)
+		o = mapView(map, payload - base, cls, r->len);
+	    else {
+		o = allocVarObject(cls, r->size, r->len);
+		memcpy(DIRECT_DATAPTR(o), payload, r->size);
+	    }
+	    break;
+	}
+	case SER_REFS:
+	    if (cls->traverse != objvector_traverse || r->size != sizeof(ser_ref_t) * (size_t) r->len) corrupt(file);
+	    o = allocObjectVector(cls, r->len);
+	    break;
+	default:
+	    corrupt(file);
+	}
+	tbl[i] = o;
+	rec[i] = r;
+	p += sizeof(ASerHeader) + name_size + refs_size + SER_PAD(r->size);
+    }
+
+    /* 2) resolve references (all indices are checked, so a damaged file cannot make us follow wild pointers) */
+#define REF(X) (((X) > n) ? corrupt(file) : ((X) ? tbl[X] : 0))
+    for (i = 1; i <= n; i++) {
+	const ASerHeader *r = rec[i];
+	const ser_ref_t *refs = (const ser_ref_t*) (((const char*) r) + sizeof(ASerHeader) + ((r->kind == SER_SYMBOL || r->kind == SER_CLASS) ? SER_PAD(r->name) : 0));
+	const ser_ref_t *pl = (const ser_ref_t*) (((const char*) refs) + SER_PAD(sizeof(ser_ref_t) * (size_t) r->refs));
+	AObject *o = tbl[i];
+	if (r->kind == SER_ENV) {
+	    AObject *parent = REF(refs[0]);
+	    set(&ENV_PARENT(o), parent ? parent : nullObject);
+	    for (j = 0; j < r->len; j++) {
+		AObject *sym = REF(pl[2 * j]);
+		if (!sym || CLASS(sym) != symbolClass) corrupt(file);
+		symbol_set(ASymbol2sym_t(sym), REF(pl[2 * j + 1]), o);
+	    }
+	} else if (r->kind >= SER_PLAIN) {
+	    for (j = 0; j < r->refs; j++)
+		set(&o->attr[j + 1], REF(refs[j]));
+	    if (r->kind == SER_REFS)
+		for (j = 0; j < r->len; j++)
+		    SET_VECTOR_ELT(o, j, REF(pl[j]));
+	}
+    }
+#undef REF
+    return tbl[fh->root];
+}
+
+/* saveObject(x, file) */
+AObject *fn_save(AObject *args, AObject *where) {
+    AObject *x;
+    const char *file;
+    if (args == nullObject) A_error("missing object to save");
+    x = eval(getAttr(args, AS_head), where);
+    args = getAttr(args, AS_next);
+    if (!(file = stringArg(&args, where, "file", 0)))
+	A_error("missing file name");
+    saveObject(x, file);
+    return nullObject;
+}
+
+/* loadObject(file) */
+AObject *fn_load(AObject *args, AObject *where) {
+    const char *file = stringArg(&args, where, "file", 0);
+    if (!file) A_error("missing file name");
+    return loadObject(file);
+}
@@ -0,0 +1,142 @@
+#include "aleph.h"
+
+/* Size-class slab allocator for small objects.
+
+   The allocator is shared by all threads, so it is locked while other threads are running.
+
+   Requests are rounded up to a multiple of SLAB_GRANULE and served from the slab of that size class. A slab is a page of SLAB_PAGE_SIZE bytes (aligned to its size, so the page header can be found from any pointer into it) that is cut into slots of one size. Free slots are kept in a per-page free list, pages with at least one free slot are kept in a per-class list. A page that becomes completely empty is returned to the system unless it is the only page of its class with free slots (so alternating alloc/free at a page boundary doesn't thrash). */
+
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+typedef struct ASlabPage_s {
+    struct ASlabPage_s *prev, *next; /* list of pages with free slots */
+    struct ASlabClass_s *cls;
+    void *free;        /* free list of released slots */
+    char *bump;        /* slots after this one have never been used */
+    vlen_t used, capacity;
+    int partial;       /* is the page in the list of pages with free slots? */
+} ASlabPage;
+
+typedef struct ASlabClass_s {
+    ASlabPage *partial;
+    vlen_t size;
+    unsigned long pages, used, allocs; /* pages, slots in use, total allocations */
+} ASlabClass;
+
+#define SLAB_PAGE(P) ((ASlabPage*) (((unsigned long) (P)) & ~((unsigned long) SLAB_PAGE_SIZE - 1)))
+#define SLAB_HEADER ((sizeof(ASlabPage) + SLAB_GRANULE - 1) & ~(SLAB_GRANULE - 1))
+#define SLAB_FIRST(PG) (((char*) (PG)) + SLAB_HEADER)
+
+static ASlabClass slab_class[SLAB_CLASSES];
+
+static void partial_add(ASlabClass *cls, ASlabPage *pg) {
+    pg->prev = 0;
+    pg->next = cls->partial;
+    if (pg->next) pg->next->prev = pg;
+    cls->partial = pg;
+    pg->partial = 1;
+}
+
+static void partial_remove(ASlabClass *cls, ASlabPage *pg) {
+    if (pg->prev) pg->prev->next = pg->next; else cls->partial = pg->next;
+    if (pg->next) pg->next->prev = pg->prev;
+    pg->prev = pg->next = 0;
+    pg->partial = 0;
+}
+
+static ASlabPage *new_page(ASlabClass *cls) {
+    void *v;
+    ASlabPage *pg;
+    if (posix_memalign(&v, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE)) {
+	gc_run(SLAB_PAGE_SIZE);
+	if (posix_memalign(&v, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE))
+	    return 0;
+    }
+    pg = (ASlabPage*) v;
+    pg->cls = cls;
+    pg->free = 0;
+    pg->bump = SLAB_FIRST(pg);
+    pg->used = 0;
+    pg->capacity = (vlen_t) ((((char*) pg) + SLAB_PAGE_SIZE - pg->bump) / cls->size);
+    cls->pages++;
+    partial_add(cls, pg);
+    A_debug(ADL_alloc, " + slab page <%p> for size %u (%u slots)", pg, cls->size, pg->capacity);
+    return pg;
+}
+
+/* allocate zeroed memory of the given size (at most SLAB_MAX_SIZE). Returns NULL if no memory is available */
+void *slabAlloc(size_t size) {
+    ASlabClass *cls = slab_class + ((size + SLAB_GRANULE - 1) / SLAB_GRANULE) - 1;
+    ASlabPage *pg;
+    void *v;
+    A_LOCK(alloc_lock);
+    pg = cls->partial;
+    if (!cls->size) cls->size = (vlen_t) ((cls - slab_class) + 1) * SLAB_GRANULE;
+    if (!pg && !(pg = new_page(cls))) {
+	A_UNLOCK(alloc_lock);
+	return 0;
+    }
+    if (pg->free) {
+	v = pg->free;
+	pg->free = *((void**) v);
+    } else {
+	v = pg->bump;
+	pg->bump += cls->size;
+    }
+    if (++pg->used == pg->capacity)
+	partial_remove(cls, pg);
+    cls->used++;
+    cls->allocs++;
+    A_UNLOCK(alloc_lock);
+    memset(v, 0, cls->size);
+    return v;
+}
+
+/* release memory allocated by slabAlloc */
+void slabFree(void *ptr) {
+    ASlabPage *pg = SLAB_PAGE(ptr);
+    ASlabClass *cls = pg->cls;
+    A_LOCK(alloc_lock);
+    *((void**) ptr) = pg->free;
+    pg->free = ptr;
+    cls->used--;
+    if (!pg->partial)
+	partial_add(cls, pg);
+    if (--pg->used == 0 && (pg->prev || pg->next)) { /* empty and not the only page with free slots - give it back */
+	partial_remove(cls, pg);
+	cls->pages--;
+	A_debug(ADL_alloc, " - slab page <%p> for size %u", pg, cls->size);
+	free(pg);
+    }
+    A_UNLOCK(alloc_lock);
+}
+
+void slab_print_stats() {
+    int i;
+    A_printf("%8s %8s %10s %10s %12s\n", "size", "pages", "in use", "capacity", "allocations");
+    for (i = 0; i < SLAB_CLASSES; i++)
+	if (slab_class[i].allocs) {
+	    ASlabClass *c = slab_class + i;
+	    A_printf("%8u %8lu %10lu %10lu %12lu\n", c->size, c->pages, c->used, c->pages * ((SLAB_PAGE_SIZE - SLAB_HEADER) / c->size), c->allocs);
+	}
+}
+
+/* slabStats() - returns the number of slots in use for each size class that has been used so far (names are the slot sizes) */
+AObject *fn_slabstats(AObject *args, AObject *where) {
+    AObject *res, *nam;
+    vlen_t i, j = 0, n = 0;
+    char buf[16];
+    for (i = 0; i < SLAB_CLASSES; i++)
+	if (slab_class[i].allocs) n++;
+    res = allocIntVector(n);
+    nam = allocObjectVector(stringClass, n);
+    for (i = 0; i < SLAB_CLASSES; i++)
+	if (slab_class[i].allocs) {
+	    INTEGER(res)[j] = (int) slab_class[i].used;
+	    snprintf(buf, sizeof(buf), "%u", slab_class[i].size);
+	    SET_STRING_ELT(nam, j, mkChar(buf));
+	    j++;
+	}
+    setAttr(res, AS_names, nam);
+    return res;
+}
@@ -1,3 +1,129 @@
-#include "types.h"
+#include "aleph.h"
 
-symbol_t AS_next, AS_head, AS_tag, AS_names, AS_class;
+/* insert the symbol index into the hash table (no check for duplicates). The entry is published last, so lookups in other threads only see complete symbols */
+static void symbol_hash_insert(ASymbolHash *t, symbol_t sym, unsigned int hash) {
+    vlen_t i = hash & t->mask;
+    while (t->slot[i])
+	i = (i + 1) & t->mask;
+    __atomic_store_n(t->slot + i, sym + 1, __ATOMIC_RELEASE);
+}
+
+/* make sure the hash table can hold count symbols (keeping the load under 3/4). Called with the lock held */
+static ASymbolHash *symbol_hash_reserve(vlen_t count) {
+    ASymbolHash *t = symbol_hash;
+    if (!t || count * 4 > t->mask * 3) {
+	vlen_t i, n = t ? ((t->mask + 1) * 2) : 1024;
+	ASymbolHash *nt;
+	while (count * 4 > (n - 1) * 3)
+	    n *= 2;
+	nt = (ASymbolHash*) Acalloc(1, sizeof(ASymbolHash) + sizeof(symbol_t) * (n - 1));
+	nt->mask = n - 1;
+	for (i = 0; i < symbols; i++)
+	    symbol_hash_insert(nt, i, sym_t2ASymbol(i)->hash);
+	if (t) {
+	    if (aleph_threads) /* other threads may be searching it right now */
+		nt->retired = t;
+	    else {
+		nt->retired = t->retired;
+		free(t);
+	    }
+	}
+	__atomic_store_n(&symbol_hash, nt, __ATOMIC_RELEASE);
+	t = nt;
+    }
+    return t;
+}
+
+/* create the next symbol and add it to the hash table t (which must have room for it). Called with the lock held */
+static symbol_t symbol_create(ASymbolHash *t, const char *name, unsigned int hash) {
+    symbol_t sym = symbols;
+    ASymbol *s;
+    if ((sym >> SYM_CHUNK_BITS) >= symbol_chunks) { /* all chunks are full */
+	ASymbolDir *d = symbol_dir;
+	if (!d || symbol_chunks == d->size) { /* so is the directory: replace it by a larger copy */
+	    vlen_t n = d ? d->size * 2 : 64;
+	    ASymbolDir *nd = (ASymbolDir*) Acalloc(1, sizeof(ASymbolDir) + sizeof(ASymbol*) * (n - 1));
+	    nd->size = n;
+	    if (d) {
+		memcpy(nd->chunk, d->chunk, sizeof(ASymbol*) * symbol_chunks);
+		if (aleph_threads) /* other threads may be reading it right now */
+		    nd->retired = d;
+		else {
+		    nd->retired = d->retired;
+		    free(d);
+		}
+	    }
+	    __atomic_store_n(&symbol_dir, nd, __ATOMIC_RELEASE);
+	    d = nd;
+	}
+	d->chunk[symbol_chunks] = (ASymbol*) Acalloc(SYM_CHUNK, sizeof(ASymbol));
+	symbol_chunks++;
+    }
+    s = sym_t2ASymbol(sym);
+    s->obj.attrs = 0;
+    s->obj.size = sizeof(char *);
+    s->obj.attr[0] = (AObject*) symbolClass; /* this is ok even with class write barrier since symbolClass is constant */
+    s->obj.pool = gc_pool; /* flag it as constant to gc_pool */
+    s->name = strdup(name);
+    s->index = sym;
+    s->hash = hash;
+    symbol_hash_insert(t, sym, hash);
+    A_debug(ADL_alloc, " - new symbol: [%d] %s", sym + 1, name);
+    symbols++;
+    return sym;
+}
+
+/* slow path of newSymbol() - the symbol doesn't exist yet so we create it, growing the chunk list and the hash table as needed. Other threads may be adding the same symbol, so we have to look again once we hold the lock */
+symbol_t addSymbol(const char *name, unsigned int hash) {
+    symbol_t sym;
+    ASymbol *s;
+    ASymbolHash *t;
+    A_LOCK(symbol_lock);
+    if ((t = symbol_hash)) {
+	vlen_t i = hash & t->mask;
+	while ((sym = t->slot[i])) {
+	    s = sym_t2ASymbol(sym - 1);
+	    if (s->hash == hash && !strcmp(s->name, name)) {
+		A_UNLOCK(symbol_lock);
+		return sym - 1;
+	    }
+	    i = (i + 1) & t->mask;
+	}
+    }
+    sym = symbol_create(symbol_hash_reserve(symbols + 1), name, hash);
+    A_UNLOCK(symbol_lock);
+    return sym;
+}
+
+/* create the well-known symbols (symbols.def) in one go, so they get the numbers of their AS_* constants. Has to be called before any other symbol is created */
+void addWellKnownSymbols() {
+    static const char *names[WELL_KNOWN_SYMBOLS] = WELL_KNOWN_SYMBOL_NAMES;
+    ASymbolHash *t;
+    vlen_t i;
+    if (symbols) A_error("FATAL: well-known symbols have to be created first");
+    A_LOCK(symbol_lock);
+    t = symbol_hash_reserve(WELL_KNOWN_SYMBOLS);
+    for (i = 0; i < WELL_KNOWN_SYMBOLS; i++)
+	symbol_create(t, names[i], symbolHash(names[i]));
+    A_UNLOCK(symbol_lock);
+}
+
+/* free the tables replaced while other threads were running. Only called when there are none */
+void releaseRetiredSymbolTables() {
+    ASymbolHash *t = symbol_hash ? symbol_hash->retired : 0;
+    while (t) {
+	ASymbolHash *r = t->retired;
+	free(t);
+	t = r;
+    }
+    if (symbol_hash) symbol_hash->retired = 0;
+    if (symbol_dir) {
+	ASymbolDir *d = symbol_dir->retired;
+	while (d) {
+	    ASymbolDir *r = d->retired;
+	    free(d);
+	    d = r;
+	}
+	symbol_dir->retired = 0;
+    }
+}
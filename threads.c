@@ -0,0 +1,279 @@
+#include "aleph.h"
+
+#include <unistd.h>
+
+/* Threads.
+
+   Every thread has its own ThreadContext (found through the thread-local thread_context): its stack of local pools, its nursery and its error handler. Objects in local pools are only ever seen by the thread that created them, so pools and nurseries need no locks. What threads share is synchronized, but only while other threads are running (aleph_threads > 0), so single-threaded code pays nothing:
+    - the gc pool: promotion of single-owned objects (claimObject) and preserveObject are locked
+    - the symbol table: lookups are lock-free, adding symbols is locked (see symbols.c)
+    - the slab allocator is locked, nursery chunks use atomic live counts since objects can be freed by other threads (see nurseryFreeShared)
+    - frame serials are atomic and the symbol lookup cache is bypassed
+   Threads are started and joined by the main thread. The garbage collector only runs while no other threads are running (memory allocated by threads is counted at join). Environments are not locked, so threads must not assign to environments that other threads use, and the parser is not reentrant. */
+
+struct AThread_s {
+    pthread_t tid;
+    ThreadContext *ctx;
+    AObject *(*fn)(AObject *);
+    AObject *arg, *res;
+};
+
+static ThreadContext *spare_contexts; /* contexts of joined threads - they are never freed since chunks of their nurseries may still point to them */
+
+/* called by nurseryAlloc when it retires the current chunk c of nursery n while other threads are running. Returns 1 if the chunk is empty (other threads freed its last objects while it was current) and can be re-used */
+int nurseryRetire(ANursery *n, ANurseryChunk *c) {
+    vlen_t empty = 0;
+    __atomic_store_n(&n->current, NULL, __ATOMIC_SEQ_CST);
+    if (!__atomic_compare_exchange_n(&c->live, &empty, NURSERY_CLAIMED, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	return 0;
+    c->live = 0;
+    return 1;
+}
+
+/* nurseryFree while other threads are running. The owner of a chunk recycles it as usual. Another thread that frees the last object of a chunk releases it - unless it is the current chunk of its owner, which will find it empty when it retires it (see nurseryRetire). Both may see the chunk empty and not current at the same time, so it is claimed first */
+void nurseryFreeShared(ANurseryChunk *c) {
+    ANursery *n = c->nursery;
+    vlen_t empty = 0;
+    if (__atomic_sub_fetch(&c->live, 1, __ATOMIC_SEQ_CST))
+	return;
+    if (n == &currentThreadContext()->nursery) {
+	n->recycled++;
+	c->ptr = NURSERY_START(c);
+	if (c != n->current) {
+	    if (n->spares < NURSERY_SPARE_CHUNKS) {
+		c->next = n->spare;
+		n->spare = c;
+		n->spares++;
+	    } else
+		free(c);
+	}
+    } else if (__atomic_load_n(&n->current, __ATOMIC_SEQ_CST) != c &&
+	       __atomic_compare_exchange_n(&c->live, &empty, NURSERY_CLAIMED, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	free(c);
+}
+
+/* give up the nursery of an exiting thread: spare chunks are freed, the current chunk is left to the last thread that frees an object in it */
+static void nursery_detach(ANursery *n) {
+    ANurseryChunk *c = n->current;
+    while (n->spare) {
+	ANurseryChunk *s = n->spare;
+	n->spare = s->next;
+	free(s);
+    }
+    n->spares = 0;
+    if (c && nurseryRetire(n, c))
+	free(c);
+}
+
+static void *thread_main(void *data) {
+    AThread *t = (AThread*) data;
+    ThreadContext *ctx = thread_context = t->ctx;
+    AllocationPool *root = newPool();
+    ON_ERROR {
+	/* the error has been reported, the thread has no result */
+	t->res = 0;
+    } else {
+	AObject *res = t->fn(t->arg);
+	/* the result has to survive the release of our pools, so it goes to the gc pool. joinThread pins it in the pool of the caller */
+	if (res && res->pool != gc_pool) {
+	    if (res->pool)
+		removeObjectFromPool(res, res->pool);
+	    claimObject(res);
+	}
+	t->res = res;
+    }
+    releasePool(root);
+    ctx->pool = 0;
+    nursery_detach(&ctx->nursery);
+    gc_thread_exit();
+    return 0;
+}
+
+/* run fn(arg) in a new thread. arg is preserved until the thread is joined */
+AThread *startThread(AObject *(*fn)(AObject *), AObject *arg) {
+    AThread *t;
+    ThreadContext *ctx;
+    if (currentThreadContext() != &mainThreadContext)
+	A_error("threads can only be started by the main thread");
+    t = (AThread*) Acalloc(1, sizeof(AThread));
+    if ((ctx = spare_contexts))
+	spare_contexts = ctx->next;
+    else
+	ctx = (ThreadContext*) Acalloc(1, sizeof(ThreadContext));
+    ctx->next = 0;
+    t->ctx = ctx;
+    t->fn = fn;
+    t->arg = arg ? preserveObject(arg) : 0;
+    aleph_threads++;
+    if (pthread_create(&t->tid, NULL, thread_main, t)) {
+	aleph_threads--;
+	if (arg) releaseObject(arg);
+	ctx->next = spare_contexts;
+	spare_contexts = ctx;
+	free(t);
+	A_error("unable to create a thread");
+    }
+    return t;
+}
+
+/* wait for a thread to finish and return its result (pinned in the current pool). Returns NULL if the thread failed with an error */
+AObject *joinThread(AThread *t) {
+    AObject *res;
+    ThreadContext *ctx = t->ctx;
+    pthread_join(t->tid, NULL);
+    aleph_threads--;
+    mainThreadContext.allocated += ctx->allocated;
+    ctx->allocated = 0;
+    ctx->next = spare_contexts;
+    spare_contexts = ctx;
+    if (t->arg) releaseObject(t->arg);
+    if ((res = t->res))
+	pinObject(res, currentPool());
+    free(t);
+    if (!aleph_threads)
+	releaseRetiredSymbolTables();
+    return res;
+}
+
+/* Parallel kernels.
+
+   Loops over long vectors are split into chunks that are processed by a pool of kernel workers together with the calling thread. Kernel workers are plain threads without a ThreadContext: they only run C loops over memory the caller has prepared, so they must not allocate objects or raise errors. Each participant starts with an equal share of the chunks and takes them from the front; once its share is done it steals chunks from the back of the other shares, so chunks that take longer (page faults in mapped files, slow pow() arguments) don't leave cores idle. Which thread processes a chunk must not affect the result, so reductions combine per-chunk results in chunk order (see fn_sum in arith.c).
+
+   parallel_workers is the number of participants (0 = one per online CPU) and loops over less than parallel_min_length elements are not split. Only one loop uses the pool at a time, loops of other threads (see startThread) run serially meanwhile. The workers are started on first use and never stopped. */
+
+#ifndef PARALLEL_MIN_LENGTH
+#define PARALLEL_MIN_LENGTH 262144
+#endif
+#define PARALLEL_MAX_WORKERS 64
+
+int parallel_workers = 0;
+vlen_t parallel_min_length = PARALLEL_MIN_LENGTH;
+
+typedef struct {
+    unsigned long long range; /* the next chunk of the share (low 32 bits) and its end (high 32 bits) */
+    unsigned long start;      /* round counter when the worker was started */
+    char pad[64 - sizeof(unsigned long long) - sizeof(unsigned long)]; /* shares are updated by different cores */
+} kernel_share_t;
+
+static struct {
+    pthread_mutex_t lock;     /* held while a loop uses the pool */
+    pthread_mutex_t sync;     /* protects round and pending */
+    pthread_cond_t wake, done;
+    int threads;              /* workers started so far */
+    int active;               /* participants in the current loop (the caller is 0) */
+    int pending;              /* workers that haven't finished the current round */
+    unsigned long round;
+    parallel_fn_t fn;
+    void *data;
+    vlen_t n, chunk;
+    kernel_share_t share[PARALLEL_MAX_WORKERS];
+} kp = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* take the next chunk for participant w: from the front of its own share, otherwise from the back of another one. Returns 0 if all chunks have been taken */
+static int next_chunk(int w, vlen_t *chunk) {
+    int i;
+    for (i = 0; i < kp.active; i++) {
+	unsigned long long *r = &kp.share[(w + i) % kp.active].range, old = __atomic_load_n(r, __ATOMIC_ACQUIRE), upd;
+	for (;;) {
+	    vlen_t next = (vlen_t) old, end = (vlen_t) (old >> 32);
+	    if (next >= end) break;
+	    if (i) {
+		upd = old - (1ULL << 32);
+		*chunk = end - 1;
+	    } else {
+		upd = old + 1;
+		*chunk = next;
+	    }
+	    if (__atomic_compare_exchange_n(r, &old, upd, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return 1;
+	}
+    }
+    return 0;
+}
+
+static void run_chunks(int w) {
+    vlen_t c;
+    while (next_chunk(w, &c)) {
+	vlen_t from = c * kp.chunk;
+	kp.fn(kp.data, from, (kp.n - from > kp.chunk) ? from + kp.chunk : kp.n, w);
+    }
+}
+
+static void *kernel_worker(void *arg) {
+    int w = (int) (long) arg;
+    unsigned long seen = kp.share[w].start;
+    for (;;) {
+	pthread_mutex_lock(&kp.sync);
+	while (kp.round == seen)
+	    pthread_cond_wait(&kp.wake, &kp.sync);
+	seen = kp.round;
+	pthread_mutex_unlock(&kp.sync);
+	if (w < kp.active)
+	    run_chunks(w);
+	pthread_mutex_lock(&kp.sync);
+	if (!--kp.pending)
+	    pthread_cond_signal(&kp.done);
+	pthread_mutex_unlock(&kp.sync);
+    }
+    return 0;
+}
+
+/* number of participants parallelFor will use for a loop over n elements (at most - fewer if there are fewer chunks or the pool is busy). Worker indices passed to the chunk function are below this */
+int parallelWorkers(vlen_t n) {
+    static int cpus;
+    int w = parallel_workers;
+    if (n < parallel_min_length)
+	return 1;
+    if (w < 1) {
+	if (!cpus) {
+	    long c = sysconf(_SC_NPROCESSORS_ONLN);
+	    cpus = (c < 1) ? 1 : ((c > PARALLEL_MAX_WORKERS) ? PARALLEL_MAX_WORKERS : (int) c);
+	}
+	w = cpus;
+    }
+    return (w > PARALLEL_MAX_WORKERS) ? PARALLEL_MAX_WORKERS : w;
+}
+
+/* call fn(data, from, to, worker) for consecutive chunks [from, to) of [0, n) of the given size, in parallel if n is large enough. The chunk boundaries don't depend on the number of workers */
+void parallelFor(vlen_t n, vlen_t chunk, parallel_fn_t fn, void *data) {
+    vlen_t chunks = n / chunk + ((n % chunk) ? 1 : 0), from;
+    int workers = parallelWorkers(n), i;
+    if ((vlen_t) workers > chunks)
+	workers = (int) chunks;
+    if (workers < 2 || pthread_mutex_trylock(&kp.lock)) {
+	for (from = 0; from < n; from += chunk)
+	    fn(data, from, (n - from > chunk) ? from + chunk : n, 0);
+	return;
+    }
+    while (kp.threads < workers - 1) {
+	pthread_t tid;
+	int w = kp.threads + 1;
+	kp.share[w].start = kp.round;
+	if (pthread_create(&tid, NULL, kernel_worker, (void*) (long) w)) {
+	    workers = w; /* run with what we have */
+	    break;
+	}
+	pthread_detach(tid);
+	kp.threads++;
+    }
+    kp.fn = fn;
+    kp.data = data;
+    kp.n = n;
+    kp.chunk = chunk;
+    for (i = 0; i < workers; i++) {
+	unsigned long long first = (unsigned long long) chunks * i / workers, end = (unsigned long long) chunks * (i + 1) / workers;
+	kp.share[i].range = first | (end << 32);
+    }
+    pthread_mutex_lock(&kp.sync);
+    kp.active = workers;
+    kp.pending = kp.threads;
+    kp.round++;
+    pthread_cond_broadcast(&kp.wake);
+    pthread_mutex_unlock(&kp.sync);
+    run_chunks(0);
+    pthread_mutex_lock(&kp.sync);
+    while (kp.pending)
+	pthread_cond_wait(&kp.done, &kp.sync);
+    pthread_mutex_unlock(&kp.sync);
+    pthread_mutex_unlock(&kp.lock);
+}
@@ -16,6 +16,12 @@ typedef struct {
 
 typedef int bool_t; /* FIXME: logical is now 4 byte for compatibility, but we'll want to use 1 byte or so later ... */
 
+/* entry of a class attribute map: the symbol of an attribute and its slot (see attrIndex) */
+typedef struct {
+    symbol_t sym;
+    smapi_t index;
+} AAttrEntry;
+
 typedef struct AClass_s AClass;
 typedef struct AObject_s AObject;
 typedef struct ASymbol_s ASymbol;
@@ -25,20 +31,23 @@ typedef struct AllocationPool_s AllocationPool;
 /*============== internals =============*/
 
 /* the object layout is very simple: [[NOTE if changed, you must also update static class definitions!]]
- 0  # of attrs
+ 0  # of attrs (16-bit) and object flags (16-bit, see AOF_*)
  1  length (in elements - for vector objects)
  2  pointer to the pool owning this obejct (or NULL is it is owned by a single other object)
- 3  size (in excess of sizeof(AObject))
- 4  class (zero-attribute)
+ 3  index of the object in the pool's item array (only valid if pool is set)
+ 4  size (in excess of sizeof(AObject))
+ 5  class (zero-attribute)
  *  any further attributes
  *  data 
  
- the smallest object is 20 (32-bit) or 32 bytes (64-bit) long
+ the smallest object is 24 (32-bit) or 40 bytes (64-bit) long
  */
 
 struct AObject_s {
-    vlen_t attrs, len; /* number of attributes, length */
+    unsigned short attrs, flags; /* number of attributes, object flags */
+    vlen_t len;        /* length */
     AllocationPool *pool; /* this the allocation pool owning this object. */
+    vlen_t slot;       /* slot in the pool (so it can be removed without a search) */
     vsize_t size;      /* size of the data portion (64-bit safe) */
     AObject *attr[1];  /* array of attributes - the first one is not counted in attrs and is the class object */
 };
@@ -46,6 +55,13 @@ struct AObject_s {
 struct ASymbol_s {
     AObject obj;
     char *name;
+    symbol_t index;    /* index of this symbol in the symbol table */
+    unsigned int hash; /* hash of the name (see symbolHash) */
+    vlen_t version;    /* incremented each time a new binding of this symbol is created */
+    /* lookup cache (see symbol_eval in aleph.h) */
+    vlen_t cache_version, cache_slot;
+    unsigned long cache_serial, cache_found;
+    AObject *cache_env;
 };
 
 /* number of superclasses that are stored directly int the class object. Since most classes have only one or two superclasses we store them directly for speed and use overflow array for special objects that have more superclasses. Note that superclass code needs to be also modified if this is touched. */
@@ -60,10 +76,13 @@ struct AClass_s {
     vlen_t supers;
     AClass *super[BUILTIN_SUPERCLASSES]; /* first superclasses (so we don't have to do dual look-up for most objects) */
     AClass **more_super;
+    /* ancestry: the id of the class and the set of the ids of the class and all its ancestors (see isAssignableClass) */
+    vlen_t id, ancestry_words;
+    unsigned long *ancestry;
     
-    /* mapping of symbols to attribute slots in instances */
-    vlen_t attr_map_len;
-    smapi_t *attr_map;
+    /* mapping of symbols to attribute slots in instances: a hash table of attr_map_mask + 1 entries (NULL if there are no attributes) */
+    vlen_t attr_map_mask;
+    AAttrEntry *attr_map;
     AClass **attr_classes;
     
     /* class-level attributes (denoted by negative index in the map) */
@@ -77,6 +96,7 @@ struct AClass_s {
     vlen_t (*length)(AObject *);
     AObject *(*eval)(AObject *, AObject *);
     AObject *(*call)(AObject *, AObject *, AObject *); /* fun, args, where (can be used to eval args if desired) */
+    void (*traverse)(AObject *, void (*)(AObject *, void *), void *); /* calls the function on each object referenced by the object (used by the garbage collector) */
     /* -- maybe a destructor? -- */
 };
 